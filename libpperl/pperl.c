@@ -30,6 +30,7 @@
 #include <unistd.h>
 
 #define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
 #include <EXTERN.h>
 #include <XSUB.h>
 #include <perl.h>
@@ -43,32 +44,33 @@
 
 EXTERN_C void	 xs_init _((void));			    /* perlxsi.c */
 
-static bool	 pperl_curdir_save(int *fdp, struct perlresult *result);
-static void	 pperl_curdir_restore(int *fdp);
-
-static perlinterp_t pperl_current_interp(void);
-static void	 pperl_setvars(const char *procname);
-static SV	*pperl_eval(SV *code_sv, const char *name,
+static SV	*pperl_eval(pTHX_ SV *code_sv, const char *name,
 			    perlenv_t penv, struct perlresult *result);
+static void	 pperl_discard_package(perlcode_t pc);
+static void	 pperl_invoke(perlcode_t pc, const char *handler,
+			      perlargs_t pargs, perlenv_t penv,
+			      struct perlresult *result);
 static XS(XS_pperl_exit);
 static XS(XS_pperl_prologue);
 static XS(XS_pperl_epilogue);
+static XS(XS_pperl_defer);
+static void	 pperl_defer_run(pTHX_ perlinterp_t interp);
 
 
 /*
- * Dummy result structure used when caller doesn't provide one of their own.
- * This is junk storage and only used to simplify result reporting logic.
+ * Point *resultp at the caller's own (junk) dummy result structure if the
+ * caller of a public routine didn't provide one; this simplifies result
+ * reporting logic.  The dummy lives on the caller's stack so concurrent
+ * calls in different interpreters don't share it.
  */
-static struct perlresult dummy_result;
-
 static inline
 void
-pperl_result_init(struct perlresult **resultp)
+pperl_result_init(struct perlresult **resultp, struct perlresult *dummy)
 {
 	struct perlresult *result = *resultp;
 
 	if (result == NULL)
-		*resultp = &dummy_result;
+		*resultp = dummy;
 	else
 		pperl_result_clear(result);
 }
@@ -76,15 +78,32 @@ pperl_result_init(struct perlresult **resultp)
 
 /*!
  * pperl_seterr() - Populate result structure from given errno(2) value.
+ *
+ *	The error message is kept in the interpreter, so it remains valid
+ *	until the next error in the same interpreter.
  */
 void
-pperl_seterr(int errnum, struct perlresult *result)
+pperl_seterr(perlinterp_t interp, int errnum, struct perlresult *result)
 {
 	if (result == NULL)
 		return;
 	result->pperl_status = 0;
 	result->pperl_errno = errnum;
-	result->pperl_errmsg = strerror(errnum); /* XXX Not re-entrant. */
+	/*
+	 * configure probes strerror_r() without perl's flags, but perl.h
+	 * turns on _GNU_SOURCE, which selects glibc's char * variant here.
+	 */
+#if defined(STRERROR_R_CHAR_P) || \
+    (defined(_GNU_SOURCE) && defined(__GLIBC__))
+	result->pperl_errmsg = strerror_r(errnum, interp->pi_errbuf,
+					  sizeof(interp->pi_errbuf));
+#else
+	if (strerror_r(errnum, interp->pi_errbuf,
+		       sizeof(interp->pi_errbuf)) != 0)
+		snprintf(interp->pi_errbuf, sizeof(interp->pi_errbuf),
+			 "Unknown error: %d", errnum);
+	result->pperl_errmsg = interp->pi_errbuf;
+#endif
 }
 
 
@@ -111,14 +130,14 @@ pperl_seterr(int errnum, struct perlresult *result)
  *	      descriptor back.
  */ 
 bool
-pperl_curdir_save(int *fdp, struct perlresult *result)
+pperl_curdir_save(perlinterp_t interp, int *fdp, struct perlresult *result)
 {
 	int fd;
 
 	*fdp = fd = open(".", O_RDONLY);
 	if (fd < 0) {
 		pperl_log(LOG_ERR, "failed to save current directory: %m");
-		pperl_seterr(errno, result);
+		pperl_seterr(interp, errno, result);
 		return false;
 	}
 
@@ -169,6 +188,7 @@ pperl_new(const char *procname, enum pperl_newflags flags)
 	perlinterp_t interp;
 	char **argv;
 	PerlInterpreter *perl;
+	dTHXa(NULL);
 
 	/*
 	 * Require perl 5.8.4 or later.  Not done as a compile-time check to
@@ -237,13 +257,13 @@ pperl_new(const char *procname, enum pperl_newflags flags)
 	argv[1] = sbuf_data(&opt_sb);		/* command-line options. */
 	argv[0] = argv[1] + sbuf_len(&opt_sb);	/* "" */
 
-	PL_perl_destruct_level = 2;
-
 	/*
 	 * Build a new perl interpreter.
 	 */
 	perl = perl_alloc();
+	aTHXa(perl);
 	perl_construct(perl);
+	PL_perl_destruct_level = 2;
 
 	/*
 	 * Initialize the interpreter.  Perl intertwines the parsing and
@@ -300,6 +320,13 @@ pperl_new(const char *procname, enum pperl_newflags flags)
 	newXSproto(ignoreconst(PPERL_NAMESPACE_PUBLIC "::epilogue"),
 		   XS_pperl_epilogue, ignoreconst(__FILE__), "&");
 
+	/*
+	 * Allow code to put off cleanup until its output has been flushed
+	 * and the caller notified that the run is complete.
+	 */
+	newXSproto(ignoreconst(PPERL_NAMESPACE_PUBLIC "::defer"),
+		   XS_pperl_defer, ignoreconst(__FILE__), "&");
+
 	/*
 	 * Now that the perl interpreter is initialized, construct our local
 	 * data structure to contain the interpreter state information.
@@ -309,12 +336,59 @@ pperl_new(const char *procname, enum pperl_newflags flags)
 	interp->pi_alloc_argv = argv;
 	interp->pi_prologue_av = newAV();
 	interp->pi_epilogue_av = newAV();
+	interp->pi_defer_av = newAV();
 	LIST_INIT(&interp->pi_args_head);
 	LIST_INIT(&interp->pi_code_head);
 	LIST_INIT(&interp->pi_env_head);
 	LIST_INIT(&interp->pi_io_head);
-
-	pperl_io_init();
+	interp->pi_manifest = NULL;
+	interp->pi_manifest_usec_hv = NULL;
+	interp->pi_manifest_seen_hv = NULL;
+	interp->pi_reqprof_root = NULL;
+	interp->pi_reqprof_cur = NULL;
+	interp->pi_reqprof_on = false;
+	LIST_INIT(&interp->pi_reqpend_head);
+	interp->pi_inc_mtime_hv = NULL;
+	interp->pi_moddeps_hv = NULL;
+	interp->pi_deps_hv = NULL;
+	interp->pi_reload_interval = -1;
+	interp->pi_reload_last = 0;
+	interp->pi_code_hash = NULL;
+	interp->pi_code_hashsize = 0;
+	interp->pi_code_count = 0;
+	interp->pi_route_root = NULL;
+	TAILQ_INIT(&interp->pi_lru_head);
+	interp->pi_code_size = 0;
+	interp->pi_code_budget = 0;
+	interp->pi_lazy = false;
+	interp->pi_code_pending = 0;
+	interp->pi_timeout_msec = 0;
+	interp->pi_deadline = 0;
+	interp->pi_cancel = 0;
+	interp->pi_running = false;
+	interp->pi_armed = false;
+	interp->pi_fiber = NULL;
+	interp->pi_generation = 0;
+	interp->pi_pkgid = 0;
+	interp->pi_request = NULL;
+	LIST_INIT(&interp->pi_args_free);
+	interp->pi_args_nfree = 0;
+	LIST_INIT(&interp->pi_env_free);
+	interp->pi_env_nfree = 0;
+	interp->pi_call_av = NULL;
+	interp->pi_capture_out = NULL;
+	interp->pi_capture_err = NULL;
+	interp->pi_onComplete = NULL;
+	interp->pi_complete_data = 0;
+	memset(&interp->pi_hwm, 0, sizeof(interp->pi_hwm));
+
+	pperl_io_init(aTHX);
+
+	/* Keep %ENV to this interpreter; see pperl_env_populate(). */
+	pperl_env_detach(aTHX);
+
+	/* Avoid growing perl's stacks during the first few runs. */
+	pperl_hwm_presize(aTHX_ interp);
 
 	/*
 	 * Set the default process name displayed in 'ps' when no perl code
@@ -338,6 +412,9 @@ pperl_new(const char *procname, enum pperl_newflags flags)
 		SvREADONLY_on(sv);
 	}
 
+	/* Allow runs to be interrupted; see pperl_cancel(). */
+	pperl_cancel_init(interp);
+
 	pperl_log(LOG_DEBUG, "perl interpreter initialized (%p)", interp);
 
 	return (interp);
@@ -345,11 +422,12 @@ pperl_new(const char *procname, enum pperl_newflags flags)
 
 
 /*!
- * pperl_current_interp() - Lookup interpreter state pointer based on current
- *			    perl context.
+ * pperl_current_interp() - Lookup interpreter state pointer based on a perl
+ *			    context.
  *
  *	Retrieves the pointer stored in the libpperl::_private::_interp
- *	variable in the current perl context.  Converts the value back to
+ *	variable in the given perl context (e.g. that passed to an XS
+ *	routine).  Converts the value back to
  *	a C pointer and returns it.  Basic sanity checking is performed, but
  *	it is possible for an intentionally malicious program to circumvent
  *	the checks (e.g. by disabling the READONLY flag on _interp, changing
@@ -358,7 +436,7 @@ pperl_new(const char *procname, enum pperl_newflags flags)
  *	@returns Pointer to libpperl interpreter state record.
  */
 perlinterp_t
-pperl_current_interp(void)
+pperl_current_interp(pTHX)
 {
 	perlinterp_t interp;
 	SV *sv;
@@ -401,7 +479,7 @@ pperl_current_interp(void)
 	 * recorded in _interp has been corrupted and we are darn lucky we
 	 * didn't seg-fault when we dereferenced it.
 	 */
-	if (interp->pi_perl != PERL_GET_CONTEXT) {
+	if (interp->pi_perl != aTHX) {
 		pperl_log(LOG_ERR,
 			  "libpperl state corrupted; %s value incorrect",
 			  PPERL_NAMESPACE_PRIVATE "::_interp");
@@ -432,6 +510,7 @@ pperl_destroy(perlinterp_t *interpp)
 	perlio_t pio;
 	PerlInterpreter *orig_perl;
 	PerlInterpreter *perl;
+	dTHXa(interp->pi_perl);
 
 	*interpp = NULL;
 
@@ -447,6 +526,10 @@ pperl_destroy(perlinterp_t *interpp)
 	assert(SvREFCNT(interp->pi_epilogue_av) == 1);
 	SvREFCNT_dec(interp->pi_epilogue_av);
 
+	SvREFCNT_dec(interp->pi_defer_av);
+
+	pperl_registry_destroy(interp);
+
 	while (!LIST_EMPTY(&interp->pi_code_head)) {
 		code = LIST_FIRST(&interp->pi_code_head);
 		LIST_REMOVE(code, pc_link);
@@ -457,6 +540,7 @@ pperl_destroy(perlinterp_t *interpp)
 		 *	 perl interpreter is destroyed below.
 		 */
 
+		free(code->pc_src);
 		free(code->pc_name);
 		free(code);
 	}
@@ -471,6 +555,9 @@ pperl_destroy(perlinterp_t *interpp)
 		pperl_env_destroy(&penv);
 	}
 
+	pperl_args_purge(interp);
+	pperl_env_purge(interp);
+
 	while (!LIST_EMPTY(&interp->pi_io_head)) {
 		pio = LIST_FIRST(&interp->pi_io_head);
 		pperl_io_destroy(&pio);
@@ -487,6 +574,9 @@ pperl_destroy(perlinterp_t *interpp)
 	 */
 	free(interp->pi_alloc_argv[1]);		/* "-e;0" argument string. */
 	free(interp->pi_alloc_argv);		/* argument vector itself. */
+	if (interp->pi_manifest != NULL)
+		fclose(interp->pi_manifest);
+	pperl_profile_free(interp);
 	free(interp);
 
 	PERL_SET_CONTEXT(orig_perl);
@@ -516,6 +606,7 @@ pperl_incpath_add(perlinterp_t interp, const char *path)
 {
 	PerlInterpreter *orig_perl;
 	SV *path_sv;
+	dTHXa(interp->pi_perl);
 
 	orig_perl = PERL_GET_CONTEXT;
 	PERL_SET_CONTEXT(interp->pi_perl);
@@ -564,13 +655,18 @@ void
 pperl_load_module(perlinterp_t interp, const char *modulename,
 		  perlenv_t penv, struct perlresult *result)
 {
+	struct perlresult dummy_result;
 	PerlInterpreter *orig_perl;
+	uint64_t start;
+	HV *snapshot;
+	AV *inc_av;
 	int curdir;
+	dTHXa(interp->pi_perl);
 
-	pperl_result_init(&result);
+	pperl_result_init(&result, &dummy_result);
 
 	/* Save the current directory in case the module code changes it. */
-	if (!pperl_curdir_save(&curdir, result))
+	if (!pperl_curdir_save(interp, &curdir, result))
 		return;
 
 	orig_perl = PERL_GET_CONTEXT;
@@ -579,35 +675,29 @@ pperl_load_module(perlinterp_t interp, const char *modulename,
 	ENTER;
 	SAVETMPS;
 
-	pperl_setvars(modulename);
-	pperl_env_populate(penv);
+	pperl_setvars(aTHX_ modulename);
+	pperl_env_populate(aTHX_ penv);
 
 	/*
-	 * What follows is almost identical to the implementation of perl's
-	 * require_pv() function except that it doesn't wrap the argument in
-	 * single quotes, thus allowing modules to be specified by name
-	 * (e.g. File::Spec).  This is identical to mod_perl's
-	 * modperl_require_module() function which should kill any doubt that
-	 * perl's embedded API sucks.
-	 *
-	 * We can't follow perlapi(3)'s recommendation to use load_module()
-	 * either as that API croaks if a non-existent module is requested.
-	 * In practice, the only safe thing to do is to evaluate the perl code
-	 * "require Module" which is exactly what we do...
+	 * Record which modules the requested module pulls in (including
+	 * itself) and how long they took to compile for the benefit of
+	 * pperl_manifest_record().
 	 */
-	{
-		SV* sv;
-		dSP;
+	snapshot = pperl_inc_snapshot(aTHX);
+	start = pperl_clock();
 
-		PUSHSTACKi(PERLSI_REQUIRE);
-		PUTBACK;
-		sv = sv_newmortal();
-		sv_setpv(sv, "require ");
-		sv_catpv(sv, modulename);
-		eval_sv(sv, G_DISCARD|G_KEEPERR);
-		SPAGAIN;
-		POPSTACK;
-	}
+	pperl_require(aTHX_ "%s", modulename);
+	interp->pi_generation++;
+
+	/*
+	 * Only record modules which loaded; a record is never rewritten,
+	 * so one made now would stand even once the module is fixed.
+	 */
+	inc_av = pperl_inc_delta(aTHX_ snapshot);
+	if (!SvTRUE(ERRSV))
+		pperl_manifest_add(interp, modulename,
+				   pperl_clock() - start, inc_av);
+	SvREFCNT_dec(inc_av);
 
 	FREETMPS;
 	LEAVE;
@@ -630,6 +720,48 @@ pperl_load_module(perlinterp_t interp, const char *modulename,
 }
 
 
+/*!
+ * pperl_require() - Require a perl module or file in the current interpreter.
+ *
+ *	Evaluates the perl code "require ..." where the argument to require
+ *	is built from the given printf(3)-style format string.  The caller is
+ *	responsible for quoting the argument if it is a file path rather than
+ *	a module name.  Any error is left in ERRSV for the caller to inspect.
+ *
+ *	What follows is almost identical to the implementation of perl's
+ *	require_pv() function except that it doesn't wrap the argument in
+ *	single quotes, thus allowing modules to be specified by name
+ *	(e.g. File::Spec).  This is identical to mod_perl's
+ *	modperl_require_module() function which should kill any doubt that
+ *	perl's embedded API sucks.
+ *
+ *	We can't follow perlapi(3)'s recommendation to use load_module()
+ *	either as that API croaks if a non-existent module is requested.
+ *	In practice, the only safe thing to do is to evaluate the perl code
+ *	"require Module" which is exactly what we do...
+ *
+ *	@note	Must be called within an ENTER/LEAVE block.
+ */
+void
+pperl_require(pTHX_ const char *fmt, ...)
+{
+	va_list ap;
+	SV *sv;
+	dSP;
+
+	PUSHSTACKi(PERLSI_REQUIRE);
+	PUTBACK;
+	sv = sv_newmortal();
+	sv_setpv(sv, "require ");
+	va_start(ap, fmt);
+	sv_vcatpvf(sv, fmt, &ap);
+	va_end(ap);
+	eval_sv(sv, G_DISCARD|G_KEEPERR);
+	SPAGAIN;
+	POPSTACK;
+}
+
+
 /*!
  * pperl_setvars() - Populate global perl variables.
  *
@@ -643,7 +775,7 @@ pperl_load_module(perlinterp_t interp, const char *modulename,
  *	@note	Must be called within a perl ENTER/LEAVE block.
  */
 void
-pperl_setvars(const char *procname)
+pperl_setvars(pTHX_ const char *procname)
 {
 
 	/*
@@ -735,15 +867,16 @@ pperl_setvars(const char *procname)
  *		failed to be evaluated.
  */
 SV *
-pperl_eval(SV *code_sv, const char *name, perlenv_t penv,
+pperl_eval(pTHX_ SV *code_sv, const char *name, perlenv_t penv,
 	   struct perlresult *result)
 {
+	struct perlresult dummy_result;
 	SV *anonsub;
 	HV *pkgstash;
 	void *origstart;
 	dSP;			/* Declare local perl stack pointer. */
 
-	pperl_result_init(&result);
+	pperl_result_init(&result, &dummy_result);
 
 #if 0
 	fprintf(stderr, "eval> %s", SvPV(code_sv, PL_na));
@@ -752,8 +885,8 @@ pperl_eval(SV *code_sv, const char *name, perlenv_t penv,
 	ENTER;
 	SAVETMPS;
 
-	pperl_setvars(name);
-	pperl_env_populate(penv);
+	pperl_setvars(aTHX_ name);
+	pperl_env_populate(aTHX_ penv);
 
 	PUSHMARK(SP);
 
@@ -822,11 +955,11 @@ pperl_eval(SV *code_sv, const char *name, perlenv_t penv,
 	 * other blocks would have already been run, and hence removed from
 	 * the call lists.
 	 */
-	pperl_calllist_run(PL_checkav, NULL, RUN_ALL);
-	pperl_calllist_clear(PL_checkav, NULL);
+	pperl_calllist_run(aTHX_ PL_checkav, NULL, RUN_ALL);
+	pperl_calllist_clear(aTHX_ PL_checkav, NULL);
 
-	pperl_calllist_run(PL_initav, NULL, RUN_ALL);
-	pperl_calllist_clear(PL_initav, NULL);
+	pperl_calllist_run(aTHX_ PL_initav, NULL, RUN_ALL);
+	pperl_calllist_clear(aTHX_ PL_initav, NULL);
 
 	PUTBACK;
 	FREETMPS;
@@ -852,62 +985,54 @@ pperl_eval(SV *code_sv, const char *name, perlenv_t penv,
 
 
 /*!
- * pperl_load() - Load perl code into interpreter for later execution.
+ * pperl_compile() - Compile perl code into its own unique package.
  *
- *	@param	interp		Perl interpreter to load the code into;
- *				the code will always be executed in this
- *				interpreter.
+ *	Internal implementation of pperl_load(); also used by pperl_run() to
+ *	recompile code which was discarded to keep an interpreter within its
+ *	memory budget.  On success, the code's subroutine reference, package,
+ *	module dependencies, compile time, and approximate memory footprint
+ *	are recorded in \a pc and it is made the most recently used code in
+ *	its interpreter.
  *
- *	@param	name		Text describing the code being loaded.  See
- *				explanation under pperl_eval().
+ *	@param	pc		Code to compile; must not currently be
+ *				compiled.  The code's interpreter must be the
+ *				current perl context.
  *
  *	@param	penv		Environment variable list to populate \%ENV
- *				with while loading code.  This is primarilly
- *				for the benefit of any BEGIN, CHECK, or INIT
- *				code blocks that may run during load.
+ *				with while compiling.
  *
- *	@param	code		The perl code to load.  Does not require a
- *				nul-terminator as the length is explicitely
- *				provided via the \a codelen argument.
+ *	@param	code		The perl code to compile.
  *
- *	@param	codelen		The length (in bytes) of the perl code to load.
+ *	@param	codelen		The length (in bytes) of the perl code.
  *
  *	@param	result		If non-NULL, populated with the result returned
  *				by any perl BEGIN, CHECK, or INIT code blocks
- *				executed during load.
+ *				executed during compilation.
  *
- *	@return	Handle for refering to the loaded code if successful.  If
- *		an error occurred during load, returns NULL; if \a result
- *		was non-NULL, it is populated with the cause of the failure.
+ *	@return	True if the code compiled successfully.
  */
-perlcode_t
-pperl_load(perlinterp_t interp, const char *name, perlenv_t penv,
-	   const char *code, size_t codelen, struct perlresult *result)
+bool
+pperl_compile(perlcode_t pc, perlenv_t penv, const char *code,
+	      size_t codelen, struct perlresult *result)
 {
-	static u_int pkgid = 0;
-	PerlInterpreter *orig_perl;
-	perlcode_t pc;
+	const perlinterp_t interp = pc->pc_interp;
 	SV *code_sv;
 	SV *anonsub;
-	HV *pkgstash;
-	int curdir;
-
-	/* Save current directory in case perl code changes it. */
-	if (!pperl_curdir_save(&curdir, result))
-		return NULL;
+	HV *snapshot;
+	HV *deps_hv, *outer_deps_hv;
+	AV *inc_av;
+	uint64_t start, usec;
+	I32 svcount;
+	dTHXa(interp->pi_perl);
 
-	/*
-	 * Compile the code in the given interpreter context.
-	 */
-	orig_perl = PERL_GET_CONTEXT;
-	PERL_SET_CONTEXT(interp->pi_perl);
+	assert(pc->pc_sv == NULL);
 
 	/*
 	 * Increment counter by some prime number so we can build unique
 	 * package name below.  "1" would work, but I picked a more esoteric
 	 * prime to discourage people from trying to guess package names.
 	 */
-	pkgid += 17261921;
+	interp->pi_pkgid += 17261921;
 
 	/*
 	 * The only way to compile code in perl is to create an anonymous
@@ -932,22 +1057,46 @@ pperl_load(perlinterp_t interp, const char *name, perlenv_t penv,
 	 */
 	code_sv = newSV(codelen + 100);
 	sv_catpvf(code_sv, "package %s::_p%08X; sub {\n",
-			   PPERL_NAMESPACE_PRIVATE, pkgid);
+			   PPERL_NAMESPACE_PRIVATE, interp->pi_pkgid);
 	sv_catpvn(code_sv, code, codelen);
 	sv_catpv(code_sv, "\n}\n");
 
-	anonsub = pperl_eval(code_sv, name, penv, result);
+	/*
+	 * Note which modules get loaded while compiling the code, and how
+	 * long it takes, for pperl_manifest_record().  The number of perl
+	 * values created approximates how much memory the compiled code
+	 * occupies.  If modules may be reloaded, also note every module the
+	 * code requires, loaded already or not, as the code depends on them.
+	 */
+	outer_deps_hv = interp->pi_deps_hv;
+	deps_hv = interp->pi_reload_interval >= 0 ? newHV() : NULL;
+	interp->pi_deps_hv = deps_hv;
+
+	snapshot = pperl_inc_snapshot(aTHX);
+	svcount = PL_sv_count;
+	start = pperl_clock();
+
+	anonsub = pperl_eval(aTHX_ code_sv, pc->pc_name, penv, result);
+
+	interp->pi_deps_hv = outer_deps_hv;
+	usec = pperl_clock() - start;
+	svcount = PL_sv_count - svcount;
+	inc_av = pperl_inc_delta(aTHX_ snapshot);
 
 	/*
 	 * If we failed to evaluate the code, propogate the error back to our
-	 * caller.  Details will be in the 'result' structure.
+	 * caller.  Details will be in the 'result' structure.  Nothing is
+	 * added to the manifest, whose records are never rewritten.
 	 */
 	if (anonsub == NULL) {
-		PERL_SET_CONTEXT(orig_perl);
-		pperl_curdir_restore(&curdir);
-		return (NULL);
+		SvREFCNT_dec(inc_av);
+		SvREFCNT_dec(deps_hv);
+		return false;
 	}
 
+	pperl_manifest_add(interp, pc->pc_name, usec, inc_av);
+	SvREFCNT_dec(inc_av);
+
 	/*
 	 * Lookup perl "stash" representing the encapsulating package.
 	 */
@@ -955,199 +1104,99 @@ pperl_load(perlinterp_t interp, const char *name, perlenv_t penv,
 		SV *sv = SvRV(anonsub);
 		assert(SvTYPE(sv) == SVt_PVCV);
 
-		pkgstash = CvSTASH((CV *)sv);
+		pc->pc_pkgstash = CvSTASH((CV *)sv);
 	}
 
-	/*
-	 * Construct perlcode_t data structure to refer to the compiled perl
-	 * code.
-	 */
-	pc = pperl_malloc(sizeof(struct perlcode));
-	pc->pc_name = pperl_strdup(name);
-
-	LIST_INSERT_HEAD(&interp->pi_code_head, pc, pc_link);
-	pc->pc_interp = interp;
 	pc->pc_sv = anonsub;
-	pc->pc_pkgid = pkgid;
-	pc->pc_pkgstash = pkgstash;
+	pc->pc_pkgid = interp->pi_pkgid;
+	pc->pc_deps_hv = deps_hv;
+	pc->pc_usec = usec;
+	pc->pc_stale = false;
+	pc->pc_size = codelen;
+	pc->pc_initialized = false;
+	pperl_lru_insert(pc, svcount);
 
-	/* Restore perl context. */
-	PERL_SET_CONTEXT(orig_perl);
-
-	/* Restore current directory. */
-	pperl_curdir_restore(&curdir);
-
-	return (pc);
+	return true;
 }
 
 
 /*!
- * pperl_run() - Execute loaded perl code.
- *
- *	Runs code loaded via pperl_load() with \@ARGV and \%ENV populated
- *	from the values passed via \a pargs and \a penv.
- *
- *	@param	pc		The perl code to run.
- *
- *	@param	pargs		Argument list to pass as the perl \@ARGV array
- *				of command-line parameters when running the
- *				code.  If NULL, perl's \@ARGV array will be
- *				empty.
+ * pperl_discard() - Discard the compiled form of loaded code.
  *
- *	@param	penv		Environment variable list to populate \%ENV
- *				with while running code.
+ *	Runs the code's END blocks and frees the perl data structures
+ *	created when the code was compiled.  The perlcode structure itself
+ *	is left intact so the code can be recompiled from its saved source
+ *	(if any) or freed by the caller.
  *
- *	@param	result		If non-NULL, populated with the exit status
- *				and/or error message returned by the executed
- *				perl code.
+ *	@param	pc		Compiled code to discard.  The code's
+ *				interpreter must be the current perl context.
  */
 void
-pperl_run(const perlcode_t pc, perlargs_t pargs, perlenv_t penv,
-	      struct perlresult *result)
+pperl_discard(perlcode_t pc)
 {
-	const perlinterp_t interp = pc->pc_interp;
-	PerlInterpreter *orig_perl;
 	int curdir;
-	dSP;
+	dTHXa(pc->pc_interp->pi_perl);
 
-	pperl_result_init(&result);
+	assert(pc->pc_sv != NULL);
 
-	/* Save current directory in case perl code changes it. */
-	if (!pperl_curdir_save(&curdir, result))
-		return;
+	pperl_lru_remove(pc);
+
+	/* Save current directory in case an END block changes it. */
+	pperl_curdir_save(pc->pc_interp, &curdir, NULL);
 
 	/*
-	 * Save perl's notion of the "current" interpreter and switch to
-	 * the interpreter that code was compiled in.  Note that we have to
-	 * refresh our local copy of perl's state pointer afterwards as the
-	 * copy initialized by dSP refers to the original interpreter's stack.
+	 * Run END blocks now.  It doesn't really matter if they raise an
+	 * exception, because we are going to unload the code anyway.
 	 */
-	orig_perl = PERL_GET_CONTEXT;
-	PERL_SET_CONTEXT(interp->pi_perl);
-	SPAGAIN;
-
 	ENTER;
-	SAVETMPS;
+	pperl_setvars(aTHX_ pc->pc_name);
+	pperl_calllist_run(aTHX_ PL_endav, pc->pc_pkgstash, CONTINUE_ON_ERROR);
+	LEAVE;
 
-	pperl_setvars(pc->pc_name);
-	pperl_env_populate(penv);
-	pperl_args_populate(pargs);
+	/* Restore current directory. */
+	pperl_curdir_restore(&curdir);
 
 	/*
-	 * Run any prologue hooks declared in the code we are about to run
-	 * as well as hooks declared in all loaded modules.
+	 * Remove all references to BEGIN, CHECK, INIT, END, prologue, or
+	 * epilogue blocks in the code's package.
 	 */
-	pperl_calllist_run(interp->pi_prologue_av, pc->pc_pkgstash,
-			   RUN_PACKAGE_AND_MODULES|STOP_ON_ERROR);
-
-	if (!SvTRUE(ERRSV)) {
-		/*
-		 * Run the code.
-		 */
-		PUSHMARK(SP);
-		call_sv(pc->pc_sv, G_EVAL|G_VOID|G_DISCARD);
-	}
+	pperl_calllist_clear(aTHX_ PL_beginav, pc->pc_pkgstash);
+	pperl_calllist_clear(aTHX_ PL_checkav, pc->pc_pkgstash);
+	pperl_calllist_clear(aTHX_ PL_initav, pc->pc_pkgstash);
+	pperl_calllist_clear(aTHX_ PL_endav, pc->pc_pkgstash);
+	pperl_calllist_clear(aTHX_ pc->pc_interp->pi_prologue_av,
+			     pc->pc_pkgstash);
+	pperl_calllist_clear(aTHX_ pc->pc_interp->pi_epilogue_av,
+			     pc->pc_pkgstash);
 
 	/*
-	 * Run any epilogue hooks; all hooks will be run, even if an error
-	 * is raised.  The epilogue hooks can inspect the error state using
-	 * the perl $@ variable.
+	 * Perl squirrels away extra references to BEGIN and CHECK blocks.
+	 * Since want to remove all traces of the code being unloaded, we have
+	 * to remove references from perl's secret hiding places too.
 	 */
-	pperl_calllist_run(interp->pi_epilogue_av, pc->pc_pkgstash,
-			   RUN_PACKAGE_AND_MODULES|CONTINUE_ON_ERROR);
-
-
-	/* Flush any pending output. */
-	PerlIO_flush(PerlIO_stdout());
+	pperl_calllist_clear(aTHX_ PL_beginav_save, pc->pc_pkgstash);
+	pperl_calllist_clear(aTHX_ PL_checkav_save, pc->pc_pkgstash);
 
-	FREETMPS;
-	LEAVE;
-
-	result->pperl_status = STATUS_CURRENT;
-	if (SvTRUE(ERRSV)) {
-		/*
-		 * XXX Return error to caller.  It would be nice if we could
-		 *     postprocess the error messages to make them more useful.
-		 */
-		result->pperl_errmsg = SvPVX(ERRSV);
-		pperl_log(LOG_DEBUG, "%s(%s): %s",
-			  __func__, pc->pc_name, result->pperl_errmsg);
-	}
-
-	/* Restore perl's notion of the "current" interpreter. */
-	PERL_SET_CONTEXT(orig_perl);
-
-	/* Restore current directory. */
-	pperl_curdir_restore(&curdir);
+	pperl_discard_package(pc);
 }
 
 
 /*!
- * pperl_unload() - Unload code from a perl interpreter.
- *
- *	@warning
- *		If any symbols were imported from other packages, the memory
- *		for those symbols is effectively lost when the code is
- *		unloaded.  There is no documented perl API for finding and/or
- *		removing such symbols so there is nothing we can do about it.
- *		(I've spent days trying to reverse engineer perl's internals
- *		 looking for a solution, but to no avail).  So, as things are
- *		now, this routine can currently only reclaim *most* of the
- *		memory allocated to the unloaded code.
+ * pperl_discard_package() - Free the package compiled code lives in.
  *
- *	@param	pcp		Pointer to perlcode_t handle of code to unload.
+ *	Final step of pperl_discard(); the code's END blocks must have
+ *	already been run and its call list entries removed.
  *
- *	@post	*pcp is set to NULL.
+ *	@param	pc		Compiled code to discard.
  */
 void
-pperl_unload(perlcode_t *pcp)
+pperl_discard_package(perlcode_t pc)
 {
-	perlcode_t pc = *pcp;
-	PerlInterpreter *orig_perl;
 	char *name;
 	HV *parentstash;
 	HV *pkgstash;
 	SV *sv;
-	int curdir;
-
-	*pcp = NULL;
-
-	orig_perl = PERL_GET_CONTEXT;
-	PERL_SET_CONTEXT(pc->pc_interp->pi_perl);
-
-	/* Save current directory in case an END block changes it. */
-	pperl_curdir_save(&curdir, NULL);
-
-	/*
-	 * Run END blocks now.  It doesn't really matter if they raise an
-	 * exception, because we are going to unload the code anyway.
-	 */
-	ENTER;
-	pperl_setvars(pc->pc_name);
-	pperl_calllist_run(PL_endav, pc->pc_pkgstash, CONTINUE_ON_ERROR);
-	LEAVE;
-
-	/* Restore current directory. */
-	pperl_curdir_restore(&curdir);
-
-	/*
-	 * Remove all references to BEGIN, CHECK, INIT, END, prologue, or
-	 * epilogue blocks in the code's package.
-	 */
-	pperl_calllist_clear(PL_beginav, pc->pc_pkgstash);
-	pperl_calllist_clear(PL_checkav, pc->pc_pkgstash);
-	pperl_calllist_clear(PL_initav, pc->pc_pkgstash);
-	pperl_calllist_clear(PL_endav, pc->pc_pkgstash);
-	pperl_calllist_clear(pc->pc_interp->pi_prologue_av, pc->pc_pkgstash);
-	pperl_calllist_clear(pc->pc_interp->pi_epilogue_av, pc->pc_pkgstash);
-
-	/*
-	 * Perl squirrels away extra references to BEGIN and CHECK blocks.
-	 * Since want to remove all traces of the code being unloaded, we have
-	 * to remove references from perl's secret hiding places too.
-	 */
-	pperl_calllist_clear(PL_beginav_save, pc->pc_pkgstash);
-	pperl_calllist_clear(PL_checkav_save, pc->pc_pkgstash);
+	dTHXa(pc->pc_interp->pi_perl);
 
 	/*
 	 * Perform sanity checking to ensure we have a reference to a
@@ -1169,6 +1218,15 @@ pperl_unload(perlcode_t *pcp)
 	SvREFCNT_dec(pc->pc_sv);
 	assert(SvREFCNT(pc->pc_sv) == 0);
 
+	SvREFCNT_dec(pc->pc_deps_hv);
+
+	/* Drop cached handlers; they hold references to the package's subs. */
+	if (pc->pc_handler_hv != NULL) {
+		SvREFCNT_dec(pc->pc_handler_hv);
+		pc->pc_handler_hv = NULL;
+	}
+	pc->pc_initialized = false;
+
 	hv_undef(pkgstash);
 
 	/*
@@ -1179,40 +1237,831 @@ pperl_unload(perlcode_t *pcp)
 	hv_delete(parentstash, name, strlen(name), G_DISCARD);
 	free(name);
 
-	/*
-	 * Free the perlcode_t data structure itself.
-	 */
-	LIST_REMOVE(pc, pc_link);
-	free(pc->pc_name);
-	free(pc);
-
-	PERL_SET_CONTEXT(orig_perl);
+	pc->pc_sv = NULL;
+	pc->pc_pkgstash = NULL;
+	pc->pc_deps_hv = NULL;
 }
 
 
 /*!
- * XS_pperl_exit() - Non-fatal replacement for perl's exit function.
+ * pperl_load() - Load perl code into interpreter for later execution.
  *
- *	Custom exit routine which is installed as the global "exit" symbol by
- *	pperl_new().  Converts a call to exit() from perl code into an
- *	exception which can be caught by the calling C code.  This prevents
- *	perl code from accidentally terminating the calling program.
+ *	If a memory budget has been set for the interpreter (see
+ *	pperl_code_budget()), a copy of the code is retained so that it can
+ *	be discarded when it hasn't been run in a while and transparently
+ *	recompiled the next time it is.  If lazy compilation is enabled (see
+ *	pperl_lazy_compile()), the code is not compiled until it is first
+ *	run; BEGIN, CHECK, and INIT blocks run (and compile errors are
+ *	reported) at that point instead.
  *
- *	Has to be written as a perl XS extension.
- */
-XS(XS_pperl_exit)
-{
-	dXSARGS;
-
-	(void)cv;		/* Silence warning about unused parameter. */
-
-	/*
-	 * Temporarily clear $SIG{__DIE__} while we throw our exception to
-	 * prevent it from interfering.
-	 */
-	ENTER;
-	SAVESPTR(PL_diehook);
-	PL_diehook = Nullsv;
+ *	@param	interp		Perl interpreter to load the code into;
+ *				the code will always be executed in this
+ *				interpreter.
+ *
+ *	@param	name		Text describing the code being loaded.  See
+ *				explanation under pperl_eval().
+ *
+ *	@param	penv		Environment variable list to populate \%ENV
+ *				with while loading code.  This is primarilly
+ *				for the benefit of any BEGIN, CHECK, or INIT
+ *				code blocks that may run during load.
+ *
+ *	@param	code		The perl code to load.  Does not require a
+ *				nul-terminator as the length is explicitely
+ *				provided via the \a codelen argument.
+ *
+ *	@param	codelen		The length (in bytes) of the perl code to load.
+ *
+ *	@param	result		If non-NULL, populated with the result returned
+ *				by any perl BEGIN, CHECK, or INIT code blocks
+ *				executed during load.
+ *
+ *	@return	Handle for refering to the loaded code if successful.  If
+ *		an error occurred during load, returns NULL; if \a result
+ *		was non-NULL, it is populated with the cause of the failure.
+ */
+perlcode_t
+pperl_load(perlinterp_t interp, const char *name, perlenv_t penv,
+	   const char *code, size_t codelen, struct perlresult *result)
+{
+	PerlInterpreter *orig_perl;
+	perlcode_t pc;
+	int curdir;
+
+	/* Save current directory in case perl code changes it. */
+	if (!pperl_curdir_save(interp, &curdir, result))
+		return NULL;
+
+	/*
+	 * Compile the code in the given interpreter context.
+	 */
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	/*
+	 * Construct perlcode_t data structure to refer to the compiled perl
+	 * code.
+	 */
+	pc = pperl_malloc(sizeof(struct perlcode));
+	memset(pc, 0, sizeof(struct perlcode));
+	pc->pc_interp = interp;
+	pc->pc_name = pperl_strdup(name);
+
+	/*
+	 * In lazy mode, just hold onto the source; the code is compiled the
+	 * first time it is run or by pperl_warmup(), whichever is first.
+	 */
+	if (interp->pi_lazy) {
+		pperl_result_clear(result);
+		pc->pc_pending = true;
+		interp->pi_code_pending++;
+	}
+
+	/*
+	 * If we failed to compile the code, propogate the error back to our
+	 * caller.  Details will be in the 'result' structure.
+	 */
+	else if (!pperl_compile(pc, penv, code, codelen, result)) {
+		free(pc->pc_name);
+		free(pc);
+		PERL_SET_CONTEXT(orig_perl);
+		pperl_curdir_restore(&curdir);
+		return (NULL);
+	}
+
+	if (interp->pi_code_budget != 0 || pc->pc_pending ||
+	    interp->pi_reload_interval >= 0) {
+		pc->pc_src = pperl_malloc(codelen);
+		memcpy(pc->pc_src, code, codelen);
+		pc->pc_srclen = codelen;
+	}
+
+	LIST_INSERT_HEAD(&interp->pi_code_head, pc, pc_link);
+	pperl_registry_add(pc);
+	interp->pi_generation++;
+
+	/* Make room for the new code by discarding the least used. */
+	pperl_lru_trim(interp, pc);
+
+	/* Restore perl context. */
+	PERL_SET_CONTEXT(orig_perl);
+
+	/* Restore current directory. */
+	pperl_curdir_restore(&curdir);
+
+	return (pc);
+}
+
+
+/*!
+ * pperl_run() - Execute loaded perl code.
+ *
+ *	Runs code loaded via pperl_load() with \@ARGV and \%ENV populated
+ *	from the values passed via \a pargs and \a penv.  If the code was
+ *	discarded to keep the interpreter within its memory budget, it is
+ *	recompiled first.
+ *
+ *	@param	pc		The perl code to run.
+ *
+ *	@param	pargs		Argument list to pass as the perl \@ARGV array
+ *				of command-line parameters when running the
+ *				code.  If NULL, perl's \@ARGV array will be
+ *				empty.
+ *
+ *	@param	penv		Environment variable list to populate \%ENV
+ *				with while running code.
+ *
+ *	@param	result		If non-NULL, populated with the exit status
+ *				and/or error message returned by the executed
+ *				perl code.
+ */
+void
+pperl_run(const perlcode_t pc, perlargs_t pargs, perlenv_t penv,
+	      struct perlresult *result)
+{
+
+	pperl_invoke(pc, NULL, pargs, penv, result);
+}
+
+
+/*!
+ * pperl_run_handler() - Call a named subroutine in loaded perl code.
+ *
+ *	Rather than running the code's body every time, as pperl_run() does,
+ *	calls the named subroutine defined by the code.  This lets code do
+ *	expensive setup once in its body and serve each request from a lean
+ *	handler, e.g.:
+ *
+ *		our $dbh = DBI->connect(...);
+ *		sub handle { print $dbh->selectrow_array(...) }
+ *
+ *	The body is compiled inside an anonymous subroutine (see
+ *	pperl_load()), so named subroutines cannot see its "my" variables;
+ *	state shared with a handler must be kept in "our" variables, which
+ *	live in the code's private package.
+ *
+ *	The code's body is run (immediately before the handler) the first
+ *	time a handler is called, and again whenever the code has been
+ *	recompiled since, until it completes without error.  The subroutine
+ *	is looked up in the code's private package once and cached.
+ *
+ *	Prologue and epilogue hooks, \@ARGV, \%ENV, timeouts, and results
+ *	are handled exactly as for pperl_run().
+ *
+ *	@param	pc		The perl code to call the handler in.
+ *
+ *	@param	handler		Name of the subroutine to call, without a
+ *				package qualifier.
+ *
+ *	@param	pargs		Argument list to pass as the perl \@ARGV array.
+ *				If NULL, perl's \@ARGV array will be empty.
+ *
+ *	@param	penv		Environment variable list to populate \%ENV
+ *				with while running code.
+ *
+ *	@param	result		If non-NULL, populated with the exit status
+ *				and/or error message returned by the code.
+ */
+void
+pperl_run_handler(const perlcode_t pc, const char *handler, perlargs_t pargs,
+		  perlenv_t penv, struct perlresult *result)
+{
+
+	assert(handler != NULL);
+	pperl_invoke(pc, handler, pargs, penv, result);
+}
+
+
+/*!
+ * pperl_run_oncomplete() - Notify the caller as soon as a run's output is done.
+ *
+ *	Registers a callback to be invoked by every subsequent run in the
+ *	interpreter as soon as the epilogue hooks have run and output has
+ *	been flushed, with the run's result.  Only then is the run torn down:
+ *	subroutines registered with libpperl::defer() are called, and
+ *	temporaries and localized variables (which may hold large request
+ *	data) are freed.  The caller can thus complete the response (e.g.
+ *	send its final bytes to the client) without waiting for cleanup.
+ *
+ *	@param	interp		The interpreter to notify runs of.
+ *
+ *	@param	onComplete	Function to call; NULL to stop notifying.
+ *
+ *	@param	data		Opaque data passed to \a onComplete.
+ */
+void
+pperl_run_oncomplete(perlinterp_t interp, pperl_complete_t *onComplete,
+		     intptr_t data)
+{
+
+	interp->pi_onComplete = onComplete;
+	interp->pi_complete_data = data;
+}
+
+
+/*!
+ * pperl_run_chain() - Execute several pieces of loaded code as a pipeline.
+ *
+ *	Runs each piece of code in turn, as successive calls to pperl_run()
+ *	would, but sharing one setup: \@ARGV, \%ENV, \%SIG, and the current
+ *	directory are set up once for the whole chain, and output is only
+ *	flushed once at the end.  Each stage's STDOUT is captured in memory
+ *	and becomes the next stage's STDIN; the last stage writes to STDOUT
+ *	as usual.  This suits middleware stacks, e.g. an authentication
+ *	script followed by business logic followed by rendering.
+ *
+ *	The chain stops at the first stage which dies, exits with a non-zero
+ *	status, or is interrupted; later stages are not run.  Prologue and
+ *	epilogue hooks are run around each stage.
+ *
+ *	@param	pcv		Code to run, in order.  All must have been
+ *				loaded into the same interpreter.
+ *
+ *	@param	npc		Number of entries in \a pcv.
+ *
+ *	@param	pargs		Argument list; see pperl_run().
+ *
+ *	@param	penv		Environment variable list; see pperl_run().
+ *
+ *	@param	result		If non-NULL, populated with the exit status
+ *				and/or error message of the last stage run.
+ */
+void
+pperl_run_chain(perlcode_t *pcv, int npc, perlargs_t pargs, perlenv_t penv,
+		struct perlresult *result)
+{
+	const perlinterp_t interp = pcv[0]->pc_interp;
+	struct perlresult dummy_result;
+	struct pperl_output pipes[2], *in, *out;
+	PerlInterpreter *orig_perl;
+	perlcode_t pc = NULL;
+	I32 svcount;
+	int interrupted = 0;
+	int curdir, i;
+	dTHXa(interp->pi_perl);
+	dSP;
+
+	assert(npc > 0);
+
+	pperl_result_init(&result, &dummy_result);
+
+	if (pperl_fiber_parked(interp)) {
+		pperl_seterr(interp, EBUSY, result);
+		return;
+	}
+
+	/* Save current directory in case perl code changes it. */
+	if (!pperl_curdir_save(interp, &curdir, result))
+		return;
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	pperl_reload_check(interp, penv, false, NULL);
+
+	/* Compile any stages which were loaded lazily or discarded. */
+	for (i = 0; i < npc; i++) {
+		pc = pcv[i];
+		assert(pc->pc_interp == interp);
+		if (pc->pc_sv != NULL)
+			continue;
+		pperl_log(LOG_DEBUG, "compiling %s", pc->pc_name);
+		pperl_lazy_done(pc);
+		if (!pperl_compile(pc, penv, pc->pc_src, pc->pc_srclen,
+				   result)) {
+			PERL_SET_CONTEXT(orig_perl);
+			pperl_curdir_restore(&curdir);
+			return;
+		}
+		SPAGAIN;
+	}
+
+	memset(pipes, 0, sizeof(pipes));
+
+	ENTER;
+	SAVETMPS;
+
+	pperl_setvars(aTHX_ pcv[0]->pc_name);
+	pperl_env_populate(aTHX_ penv);
+	pperl_args_populate(aTHX_ pargs);
+	STATUS_CURRENT = 0;
+
+	for (i = 0; i < npc; i++) {
+		pc = pcv[i];
+		in = i > 0 ? &pipes[(i - 1) % 2] : NULL;
+		out = i < npc - 1 ? &pipes[i % 2] : NULL;
+		svcount = PL_sv_count;
+
+		ENTER;
+
+		sv_setpv_mg(get_sv("0", TRUE), pc->pc_name);
+		if (in != NULL)
+			pperl_io_input(aTHX_ "STDIN",
+				       in->po_buf != NULL ? in->po_buf : "",
+				       in->po_len);
+		if (out != NULL) {
+			out->po_len = 0;
+			pperl_io_capture(aTHX_ interp, "STDOUT", out);
+		}
+
+		pperl_calllist_run(aTHX_ interp->pi_prologue_av,
+				   pc->pc_pkgstash,
+				   RUN_PACKAGE_AND_MODULES|STOP_ON_ERROR);
+
+		if (!SvTRUE(ERRSV)) {
+			pperl_cancel_arm(interp);
+			PUSHMARK(SP);
+			call_sv(pc->pc_sv, G_EVAL|G_VOID|G_DISCARD);
+			pc->pc_initialized = !SvTRUE(ERRSV);
+			interrupted = pperl_cancel_disarm(interp);
+		}
+
+		pperl_calllist_run(aTHX_ interp->pi_epilogue_av,
+				   pc->pc_pkgstash,
+				   RUN_PACKAGE_AND_MODULES|CONTINUE_ON_ERROR);
+
+		/* Restores STDIN and completes the stage's output. */
+		LEAVE;
+
+		pperl_lru_touch(pc, PL_sv_count - svcount);
+
+		if (SvTRUE(ERRSV) || STATUS_CURRENT != 0 || interrupted)
+			break;
+
+		/* Perl expects the next stage's input to be nul-terminated. */
+		if (out != NULL && out->po_buf != NULL) {
+			if (out->po_len == out->po_size) {
+				out->po_size++;
+				out->po_buf = pperl_realloc(out->po_buf,
+							    out->po_size);
+			}
+			out->po_buf[out->po_len] = '\0';
+		}
+	}
+
+	/* Flush any pending output. */
+	PerlIO_flush(PerlIO_stdout());
+
+	result->pperl_status = STATUS_CURRENT;
+	result->pperl_errno = interrupted;
+	if (SvTRUE(ERRSV)) {
+		result->pperl_errmsg = SvPVX(ERRSV);
+		pperl_log(LOG_DEBUG, "%s(%s): %s",
+			  __func__, pc->pc_name, result->pperl_errmsg);
+	}
+
+	/* As in pperl_invoke(), notify the caller before tearing down. */
+	if (interp->pi_onComplete != NULL)
+		interp->pi_onComplete(result, interp->pi_complete_data);
+
+	pperl_defer_run(aTHX_ interp);
+
+	pperl_hwm_record(aTHX_ interp);
+
+	FREETMPS;
+	LEAVE;
+
+	free(pipes[0].po_buf);
+	free(pipes[1].po_buf);
+
+	pperl_lru_trim(interp, pc);
+
+	PERL_SET_CONTEXT(orig_perl);
+	pperl_curdir_restore(&curdir);
+}
+
+
+/*
+ * pperl_invoke() - Common code for pperl_run() and pperl_run_handler().
+ *
+ *	@param	handler		Name of subroutine to call; NULL to run the
+ *				code's body.
+ */
+void
+pperl_invoke(const perlcode_t pc, const char *handler, perlargs_t pargs,
+	     perlenv_t penv, struct perlresult *result)
+{
+	const perlinterp_t interp = pc->pc_interp;
+	struct perlresult dummy_result;
+	struct pperl_output *capture_out, *capture_err;
+	PerlInterpreter *orig_perl;
+	I32 svcount;
+	int interrupted = 0;
+	int curdir;
+	dTHXa(interp->pi_perl);
+	dSP;
+
+	pperl_result_init(&result, &dummy_result);
+
+	/* Take any capture buffers set up by pperl_run_capture(). */
+	capture_out = interp->pi_capture_out;
+	capture_err = interp->pi_capture_err;
+	interp->pi_capture_out = NULL;
+	interp->pi_capture_err = NULL;
+
+	/* Perl's stacks are in use by a parked fiber; see pperl_fiber_new(). */
+	if (pperl_fiber_parked(interp)) {
+		pperl_seterr(interp, EBUSY, result);
+		return;
+	}
+
+	/* Save current directory in case perl code changes it. */
+	if (!pperl_curdir_save(interp, &curdir, result))
+		return;
+
+	/*
+	 * Everything below refers to the interpreter explicitly, but perl
+	 * itself still consults the "current" interpreter in places (e.g.
+	 * signal delivery), so switch to the interpreter that code was
+	 * compiled in for the duration of the run.
+	 */
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	/*
+	 * If module reloading is enabled, pick up any modules which have
+	 * changed before running the code.  Failures are logged but don't
+	 * prevent the code from running against the old definitions.
+	 */
+	pperl_reload_check(interp, penv, false, NULL);
+
+	/*
+	 * Compile the code from its saved source if it was loaded lazily and
+	 * hasn't been compiled yet, or was discarded to stay within the
+	 * interpreter's memory budget or because a module it depends on
+	 * was reloaded.  A compile error is reported the same as it would
+	 * have been by pperl_load().
+	 */
+	if (pc->pc_sv == NULL) {
+		pperl_log(LOG_DEBUG, "compiling %s", pc->pc_name);
+		pperl_lazy_done(pc);
+		if (!pperl_compile(pc, penv, pc->pc_src, pc->pc_srclen,
+				   result)) {
+			PERL_SET_CONTEXT(orig_perl);
+			pperl_curdir_restore(&curdir);
+			return;
+		}
+		SPAGAIN;
+	}
+
+	/*
+	 * Values the code leaves behind (e.g. package variables) add to its
+	 * footprint; count them so the memory budget reflects them.
+	 */
+	svcount = PL_sv_count;
+
+	ENTER;
+	SAVETMPS;
+
+	pperl_setvars(aTHX_ pc->pc_name);
+	pperl_env_populate(aTHX_ penv);
+	pperl_args_populate(aTHX_ pargs);
+
+	/* Bind STDIN to the request's input, if run via pperl_request_run(). */
+	if (interp->pi_request != NULL) {
+		pperl_request_populate(aTHX_ interp->pi_request);
+		interp->pi_request = NULL;
+	}
+
+	/* Redirect output into the caller's buffers, if capturing. */
+	if (capture_out != NULL)
+		pperl_io_capture(aTHX_ interp, "STDOUT", capture_out);
+	if (capture_err != NULL)
+		pperl_io_capture(aTHX_ interp, "STDERR", capture_err);
+
+	/*
+	 * Run any prologue hooks declared in the code we are about to run
+	 * as well as hooks declared in all loaded modules.
+	 */
+	pperl_calllist_run(aTHX_ interp->pi_prologue_av, pc->pc_pkgstash,
+			   RUN_PACKAGE_AND_MODULES|STOP_ON_ERROR);
+
+	if (!SvTRUE(ERRSV)) {
+		/*
+		 * Run the code.  It may be interrupted if it runs past its
+		 * deadline or is cancelled from another thread; the epilogue
+		 * hooks below are run regardless.
+		 */
+		pperl_cancel_arm(interp);
+		if (handler == NULL || !pc->pc_initialized) {
+			PUSHMARK(SP);
+			call_sv(pc->pc_sv, G_EVAL|G_VOID|G_DISCARD);
+			pc->pc_initialized = !SvTRUE(ERRSV);
+		}
+		if (handler != NULL && !SvTRUE(ERRSV)) {
+			SV *handler_sv = pperl_handler_find(aTHX_ pc, handler);
+
+			if (handler_sv != NULL) {
+				PUSHMARK(SP);
+				call_sv(handler_sv, G_EVAL|G_VOID|G_DISCARD);
+			}
+			else
+				sv_setpvf(ERRSV, "Undefined subroutine &%s "
+					  "called by %s\n", handler,
+					  pc->pc_name);
+		}
+		interrupted = pperl_cancel_disarm(interp);
+	}
+
+	/*
+	 * Run any epilogue hooks; all hooks will be run, even if an error
+	 * is raised.  The epilogue hooks can inspect the error state using
+	 * the perl $@ variable.
+	 */
+	pperl_calllist_run(aTHX_ interp->pi_epilogue_av, pc->pc_pkgstash,
+			   RUN_PACKAGE_AND_MODULES|CONTINUE_ON_ERROR);
+
+
+	/* Flush any pending output; captured output is never buffered. */
+	if (capture_out == NULL)
+		PerlIO_flush(PerlIO_stdout());
+
+	result->pperl_status = STATUS_CURRENT;
+	result->pperl_errno = interrupted;
+	if (SvTRUE(ERRSV)) {
+		/*
+		 * XXX Return error to caller.  It would be nice if we could
+		 *     postprocess the error messages to make them more useful.
+		 */
+		result->pperl_errmsg = SvPVX(ERRSV);
+		pperl_log(LOG_DEBUG, "%s(%s): %s",
+			  __func__, pc->pc_name, result->pperl_errmsg);
+	}
+
+	/*
+	 * The run's output is complete; let the caller know before tearing
+	 * the run down.
+	 */
+	if (interp->pi_onComplete != NULL)
+		interp->pi_onComplete(result, interp->pi_complete_data);
+
+	pperl_defer_run(aTHX_ interp);
+
+	pperl_hwm_record(aTHX_ interp);
+
+	FREETMPS;
+	LEAVE;
+
+	/*
+	 * Mark the code as most recently used and, if the interpreter is now
+	 * over its memory budget, discard the least recently used code.
+	 */
+	pperl_lru_touch(pc, PL_sv_count - svcount);
+	pperl_lru_trim(interp, pc);
+
+	/* Restore perl's notion of the "current" interpreter. */
+	PERL_SET_CONTEXT(orig_perl);
+
+	/* Restore current directory. */
+	pperl_curdir_restore(&curdir);
+}
+
+
+/*
+ * pperl_handler_find() - Look up a handler subroutine in loaded code.
+ *
+ *	Subroutines are looked up in the code's private package and cached
+ *	by name, so each handler is only resolved once per compilation.
+ *
+ *	@return	The handler's CV, or NULL if the code doesn't define it.
+ */
+SV *
+pperl_handler_find(pTHX_ perlcode_t pc, const char *handler)
+{
+	size_t len;
+	SV **svp;
+	SV *name_sv;
+	CV *cv;
+
+	len = strlen(handler);
+	if (pc->pc_handler_hv != NULL) {
+		svp = hv_fetch(pc->pc_handler_hv, handler, len, FALSE);
+		if (svp != NULL)
+			return (SvRV(*svp));
+	}
+
+	name_sv = sv_2mortal(newSVpvf("%s::%s", HvNAME(pc->pc_pkgstash),
+				      handler));
+	cv = get_cv(SvPV_nolen(name_sv), FALSE);
+	if (cv == NULL)
+		return (NULL);
+
+	if (pc->pc_handler_hv == NULL)
+		pc->pc_handler_hv = newHV();
+	hv_store(pc->pc_handler_hv, handler, len, newRV_inc((SV *)cv), 0);
+
+	return ((SV *)cv);
+}
+
+
+/*
+ * pperl_defer_run() - Run subroutines registered with libpperl::defer().
+ *
+ *	Subroutines are run in the reverse of the order they were registered
+ *	in, and all of them are run even if some die; their errors are
+ *	logged, but do not affect the run's result (\$@ is preserved).
+ */
+void
+pperl_defer_run(pTHX_ perlinterp_t interp)
+{
+	AV *defer_av = interp->pi_defer_av;
+	SV *sv;
+	dSP;
+
+	if (av_len(defer_av) < 0)
+		return;
+
+	ENTER;
+	save_scalar(PL_errgv);
+
+	while ((sv = av_pop(defer_av)) != &PL_sv_undef) {
+		PUSHMARK(SP);
+		call_sv(sv, G_EVAL|G_VOID|G_DISCARD);
+		SPAGAIN;
+		if (SvTRUE(ERRSV))
+			pperl_log(LOG_WARNING, "deferred subroutine failed: %s",
+				  SvPV_nolen(ERRSV));
+		SvREFCNT_dec(sv);
+	}
+
+	LEAVE;
+}
+
+
+/*!
+ * pperl_unload() - Unload code from a perl interpreter.
+ *
+ *	@warning
+ *		If any symbols were imported from other packages, the memory
+ *		for those symbols is effectively lost when the code is
+ *		unloaded.  There is no documented perl API for finding and/or
+ *		removing such symbols so there is nothing we can do about it.
+ *		(I've spent days trying to reverse engineer perl's internals
+ *		 looking for a solution, but to no avail).  So, as things are
+ *		now, this routine can currently only reclaim *most* of the
+ *		memory allocated to the unloaded code.
+ *
+ *	@param	pcp		Pointer to perlcode_t handle of code to unload.
+ *
+ *	@post	*pcp is set to NULL.
+ */
+void
+pperl_unload(perlcode_t *pcp)
+{
+	perlcode_t pc = *pcp;
+	PerlInterpreter *orig_perl;
+
+	*pcp = NULL;
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(pc->pc_interp->pi_perl);
+
+	/* Code discarded to save memory has already run its END blocks. */
+	if (pc->pc_sv != NULL)
+		pperl_discard(pc);
+
+	/*
+	 * Free the perlcode_t data structure itself.
+	 */
+	pperl_lazy_done(pc);
+	pperl_registry_remove(pc);
+	LIST_REMOVE(pc, pc_link);
+	pc->pc_interp->pi_generation++;
+	free(pc->pc_src);
+	free(pc->pc_name);
+	free(pc);
+
+	PERL_SET_CONTEXT(orig_perl);
+}
+
+
+/*!
+ * pperl_unload_many() - Unload several pieces of code at once.
+ *
+ *	Equivalent to calling pperl_unload() on each piece of code, but each
+ *	of perl's call lists is scanned only once for the whole set rather
+ *	than once per piece of code, so unloading n pieces of code from
+ *	call lists holding m entries costs O(n + m) rather than O(n * m).
+ *
+ *	The END blocks of all the code are run first, in the order perl
+ *	would run them (i.e. most recently compiled first), rather than
+ *	grouped by the code they belong to.
+ *
+ *	@param	pcv		Array of handles of code to unload; all must
+ *				be loaded in the same interpreter.  Each
+ *				element is set to NULL.
+ *
+ *	@param	npc		Number of elements in \a pcv.
+ */
+void
+pperl_unload_many(perlcode_t *pcv, int npc)
+{
+	perlinterp_t interp;
+	PerlInterpreter *orig_perl;
+	perlcode_t pc;
+	HV *set;
+	int curdir;
+	int i;
+	dTHXa(NULL);
+
+	if (npc == 0)
+		return;
+
+	interp = pcv[0]->pc_interp;
+	aTHXa(interp->pi_perl);
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	/*
+	 * Build the set of packages to be discarded.  Code which was never
+	 * compiled (or was already discarded to save memory) has no package.
+	 */
+	set = pperl_calllist_stashset(aTHX);
+	for (i = 0; i < npc; i++) {
+		pc = pcv[i];
+		assert(pc->pc_interp == interp);
+		if (pc->pc_sv != NULL)
+			pperl_calllist_stashset_add(aTHX_ set, pc->pc_pkgstash,
+						    pc->pc_name);
+	}
+
+	/* Save current directory in case an END block changes it. */
+	pperl_curdir_save(interp, &curdir, NULL);
+
+	/*
+	 * Run END blocks now.  It doesn't really matter if they raise an
+	 * exception, because we are going to unload the code anyway.
+	 */
+	ENTER;
+	pperl_setvars(aTHX_ pcv[0]->pc_name);
+	pperl_calllist_run_set(aTHX_ PL_endav, set);
+	LEAVE;
+
+	/* Restore current directory. */
+	pperl_curdir_restore(&curdir);
+
+	/*
+	 * Remove all references to BEGIN, CHECK, INIT, END, prologue, or
+	 * epilogue blocks in the code's packages, including those perl
+	 * squirrels away; see pperl_discard().
+	 */
+	pperl_calllist_clear_set(aTHX_ PL_beginav, set);
+	pperl_calllist_clear_set(aTHX_ PL_checkav, set);
+	pperl_calllist_clear_set(aTHX_ PL_initav, set);
+	pperl_calllist_clear_set(aTHX_ PL_endav, set);
+	pperl_calllist_clear_set(aTHX_ interp->pi_prologue_av, set);
+	pperl_calllist_clear_set(aTHX_ interp->pi_epilogue_av, set);
+	pperl_calllist_clear_set(aTHX_ PL_beginav_save, set);
+	pperl_calllist_clear_set(aTHX_ PL_checkav_save, set);
+
+	SvREFCNT_dec(set);
+
+	for (i = 0; i < npc; i++) {
+		pc = pcv[i];
+		pcv[i] = NULL;
+
+		if (pc->pc_sv != NULL) {
+			pperl_lru_remove(pc);
+			pperl_discard_package(pc);
+		}
+
+		pperl_lazy_done(pc);
+		pperl_registry_remove(pc);
+		LIST_REMOVE(pc, pc_link);
+		pc->pc_interp->pi_generation++;
+		free(pc->pc_src);
+		free(pc->pc_name);
+		free(pc);
+	}
+
+	PERL_SET_CONTEXT(orig_perl);
+}
+
+
+/*!
+ * XS_pperl_exit() - Non-fatal replacement for perl's exit function.
+ *
+ *	Custom exit routine which is installed as the global "exit" symbol by
+ *	pperl_new().  Converts a call to exit() from perl code into an
+ *	exception which can be caught by the calling C code.  This prevents
+ *	perl code from accidentally terminating the calling program.
+ *
+ *	Has to be written as a perl XS extension.
+ */
+XS(XS_pperl_exit)
+{
+	dXSARGS;
+
+	(void)cv;		/* Silence warning about unused parameter. */
+
+	/*
+	 * Temporarily clear $SIG{__DIE__} while we throw our exception to
+	 * prevent it from interfering.
+	 */
+	ENTER;
+	SAVESPTR(PL_diehook);
+	PL_diehook = Nullsv;
 
 #if 0
 	errsv = get_sv("@", TRUE);
@@ -1255,7 +2104,7 @@ XS(XS_pperl_prologue)
 
 	(void)cv;		/* Silence warning about unused parameter. */
 
-	interp = pperl_current_interp();
+	interp = pperl_current_interp(aTHX);
 	if (interp == NULL)
 		croak("libpperl state corrupt");
 
@@ -1313,7 +2162,7 @@ XS(XS_pperl_epilogue)
 
 	(void)cv;		/* Silence warning about unused parameter. */
 
-	interp = pperl_current_interp();
+	interp = pperl_current_interp(aTHX);
 	if (interp == NULL)
 		croak("libpperl state corrupt");
 
@@ -1342,3 +2191,45 @@ XS(XS_pperl_epilogue)
 
 	XSRETURN_EMPTY;
 }
+
+
+/*!
+ * XS_pperl_defer() - XS extension allowing perl code to register cleanup to
+ *		      be run once its output is complete.
+ *
+ *	Called as libpperl::defer(sub { ... });
+ *
+ *	Registers a subroutine to be called near the end of the current run,
+ *	after its output has been flushed and the caller notified (see
+ *	pperl_run_oncomplete()), but before the run's temporaries are freed.
+ *	Expensive cleanup (e.g. freeing large data structures or logging)
+ *	can thus be kept out of the time it takes to complete a response.
+ *	Each subroutine is only run once.
+ */
+XS(XS_pperl_defer)
+{
+	perlinterp_t interp;
+	SV *sv;
+	dXSARGS;
+
+	(void)cv;		/* Silence warning about unused parameter. */
+
+	interp = pperl_current_interp(aTHX);
+	if (interp == NULL)
+		croak("libpperl state corrupt");
+
+	/* We expect a single argument. */
+	if (items != 1)
+		croak("Usage: " PPERL_NAMESPACE_PUBLIC "::defer(code-ref)");
+
+	/* Pop the argument off perl's call stack. */
+	sv = POPs;
+
+	/* Check that the argument is a valid code reference. */
+	if (!SvOK(sv) || !SvROK(sv) || SvTYPE(SvRV(sv)) != SVt_PVCV)
+		croak("Usage: " PPERL_NAMESPACE_PUBLIC "::defer(code-ref)");
+
+	av_push(interp->pi_defer_av, SvREFCNT_inc(SvRV(sv)));
+
+	XSRETURN_EMPTY;
+}
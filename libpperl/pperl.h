@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <inttypes.h>		/* For intptr_t */
 #include <stdarg.h>
+#include <stdio.h>		/* For FILE */
 
 #if !(__GNUC__ == 2 && __GNUC_MINOR__ >= 7 || __GNUC__ >= 3 || defined(__INTEL_COMPILER))
 #  ifndef __attribute__
@@ -65,6 +66,13 @@ typedef struct perlenv *perlenv_t;
 typedef struct perlargs *perlargs_t;
 typedef struct perlio *perlio_t;
 typedef struct perlcode *perlcode_t;
+typedef struct perlexecutor *perlexecutor_t;
+typedef struct perljob *perljob_t;
+typedef struct perlfiber *perlfiber_t;
+typedef struct perlzygote *perlzygote_t;
+typedef struct perlrequest *perlrequest_t;
+typedef struct perliobuf *perliobuf_t;
+typedef struct perlcache *perlcache_t;
 
 
 /*!
@@ -147,7 +155,9 @@ enum pperl_newflags {
  *	@param	pperl_errno	Equivalent to perl's \$! variable as a numeric
  *				value (which is the same as the C errno value
  *				of the library call that failed).  Zero if
- *				no error occurred.
+ *				no error occurred.  ETIMEDOUT or ECANCELED if
+ *				the code was interrupted; see
+ *				pperl_run_timeout() and pperl_cancel().
  *
  *	@param	pperl_result	Equivalent to perl's \$@ variable.
  *				Stringified version of parameter perl code
@@ -161,6 +171,59 @@ struct perlresult {
 };
 
 
+/*!
+ * @struct pperl_value
+ *
+ * A C value passed to or returned from perl by pperl_call().
+ *
+ *	@param	pv_type		Which of the members below holds the value.
+ *
+ *	@param	pv_int		Value if \a pv_type is PPERL_INT.
+ *
+ *	@param	pv_double	Value if \a pv_type is PPERL_DOUBLE.
+ *
+ *	@param	pv_str		Value if \a pv_type is PPERL_STRING; a byte
+ *				string which need not be nul-terminated.
+ *
+ *	@param	pv_len		Length of \a pv_str in bytes.
+ */
+/*!
+ * @struct pperl_output
+ *
+ * Buffer output is captured into by pperl_run_capture().  The buffer is
+ * owned by the caller, who may reuse the structure for later runs (its
+ * buffer is then reused as is) or take the buffer and free(3) it.
+ *
+ *	@param	po_buf		Captured output; not nul-terminated.  NULL if
+ *				no buffer has been allocated yet.
+ *
+ *	@param	po_len		Number of bytes of output in \a po_buf.
+ *
+ *	@param	po_size		Number of bytes allocated to \a po_buf.
+ */
+struct pperl_output {
+	char			*po_buf;
+	size_t			 po_len;
+	size_t			 po_size;
+};
+
+
+enum pperl_valtype {
+	PPERL_UNDEF		= 0,
+	PPERL_INT,
+	PPERL_DOUBLE,
+	PPERL_STRING
+};
+
+struct pperl_value {
+	enum pperl_valtype	 pv_type;
+	int64_t			 pv_int;
+	double			 pv_double;
+	const char		*pv_str;
+	size_t			 pv_len;
+};
+
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -205,6 +268,7 @@ extern void		 pperl_env_setv(perlenv_t penv, const char *name,
 extern const char	*pperl_env_get(const perlenv_t penv,
 				       const char *name);
 extern void		 pperl_env_unset(perlenv_t penv, const char *name);
+extern void		 pperl_env_reset(perlenv_t penv);
 extern void		 pperl_env_destroy(perlenv_t *penvp);
 
 
@@ -214,13 +278,38 @@ extern void		 pperl_args_append(perlargs_t pargs, const char *arg);
 extern void		 pperl_args_append_printf(perlargs_t pargs,
 						  const char *fmt, ...)
 			     __attribute__ ((format (printf, 2, 3)));
+extern void		 pperl_args_reset(perlargs_t pargs);
 extern void		 pperl_args_destroy(perlargs_t *pargsp);
 
 
+extern perlrequest_t	 pperl_request_new(bool tainted);
+extern void		 pperl_request_arg(perlrequest_t req, const char *arg);
+extern void		 pperl_request_env(perlrequest_t req, const char *name,
+					   const char *value);
+extern void		 pperl_request_stdin(perlrequest_t req,
+					     const void *buf, size_t len);
+extern void		 pperl_request_body(perlrequest_t req,
+					    const void *buf, size_t len);
+extern void		 pperl_request_run(perlcode_t pc, perlrequest_t req,
+					   struct perlresult *result);
+extern void		 pperl_request_free(perlrequest_t *reqp);
+
+
 typedef size_t (pperl_io_read_t)(char *buf, size_t buflen, intptr_t data);
 typedef size_t (pperl_io_write_t)(const char *buf, size_t buflen,
 				  intptr_t data);
 typedef void (pperl_io_close_t)(intptr_t);
+typedef void (pperl_io_send_t)(const char *buf, size_t buflen,
+			       perliobuf_t iob, intptr_t data);
+typedef ssize_t (pperl_io_sendfile_t)(int fd, off_t offset, size_t len,
+				      intptr_t data);
+
+/*!
+ * Value returned by an I/O callback to indicate that it cannot make any
+ * progress without blocking.  Code running in a fiber is suspended until
+ * the fiber is resumed; otherwise the I/O operation fails with EAGAIN.
+ */
+#define	PPERL_IO_WOULDBLOCK	((size_t)-1)
 
 extern void		 pperl_io_override(perlinterp_t interp,
 					   const char *name,
@@ -228,6 +317,69 @@ extern void		 pperl_io_override(perlinterp_t interp,
 					   pperl_io_write_t *onWrite,
 					   pperl_io_close_t *onClose,
 					   intptr_t data);
+extern void		 pperl_io_override_send(perlinterp_t interp,
+						const char *name,
+						pperl_io_send_t *onSend);
+extern void		 pperl_iobuf_release(perliobuf_t *iobp);
+extern void		 pperl_io_override_sendfile(perlinterp_t interp,
+						    const char *name,
+						    pperl_io_sendfile_t *onSendfile);
+
+
+/*!
+ * States returned by pperl_fiber_resume().
+ */
+enum pperl_fiber_state {
+	PPERL_FIBER_BLOCKED,	/*!< Parked waiting on an I/O callback. */
+	PPERL_FIBER_DONE	/*!< Finished running. */
+};
+
+extern perlfiber_t	 pperl_fiber_new(perlcode_t pc, perlargs_t pargs,
+					 perlenv_t penv, size_t stacksize);
+extern enum pperl_fiber_state pperl_fiber_resume(perlfiber_t fiber,
+					struct perlresult *result);
+extern void		 pperl_fiber_destroy(perlfiber_t *fiberp);
+
+
+/*!
+ * @struct pperl_zygote_stats
+ *
+ * Counters reported by pperl_zygote_stats().
+ *
+ *	@param	pzs_runs	Number of requests run.
+ *
+ *	@param	pzs_spare_hits	Number of requests handed to a spare child
+ *				rather than waiting on a fork.
+ *
+ *	@param	pzs_forks	Number of children forked, spares included.
+ *
+ *	@param	pzs_crashes	Number of children which exited without
+ *				reporting a result.
+ *
+ *	@param	pzs_fork_usec	Total microseconds the parent spent in fork(2).
+ *
+ *	@param	pzs_fork_max_usec Longest single fork(2), in microseconds.
+ *
+ *	@param	pzs_spares	Number of spare children currently ready.
+ */
+struct pperl_zygote_stats {
+	uint64_t		 pzs_runs;
+	uint64_t		 pzs_spare_hits;
+	uint64_t		 pzs_forks;
+	uint64_t		 pzs_crashes;
+	uint64_t		 pzs_fork_usec;
+	uint64_t		 pzs_fork_max_usec;
+	u_int			 pzs_spares;
+};
+
+extern perlzygote_t	 pperl_zygote_new(perlinterp_t interp, int spares);
+extern void		 pperl_zygote_run(perlzygote_t pz, perlcode_t pc,
+					  perlargs_t pargs, perlenv_t penv,
+					  const int fds[3],
+					  struct perlresult *result);
+extern void		 pperl_zygote_stats(perlzygote_t pz,
+					    struct pperl_zygote_stats *stats);
+extern void		 pperl_zygote_destroy(perlzygote_t *pzp);
 
 
 extern void		 pperl_incpath_add(perlinterp_t interp,
@@ -238,6 +390,55 @@ extern void		 pperl_load_module(perlinterp_t interp,
 					   perlenv_t penv,
 					   struct perlresult *result);
 
+extern void		 pperl_manifest_record(perlinterp_t interp,
+					       const char *path,
+					       struct perlresult *result);
+extern void		 pperl_preload_manifest(perlinterp_t interp,
+						const char *path,
+						perlenv_t penv,
+						struct perlresult *result);
+
+/*!
+ * @struct pperl_hwm
+ *
+ * High-water marks of the perl interpreter's internal stacks and of the
+ * number of scalars allocated by code run in it; see pperl_hwm_get().
+ *
+ *	@param	ph_stack	Entries in the argument stack.
+ *
+ *	@param	ph_tmps		Entries in the temporaries (mortals) stack.
+ *
+ *	@param	ph_savestack	Entries in the save (local) stack.
+ *
+ *	@param	ph_scopestack	Entries in the scope stack.
+ *
+ *	@param	ph_svs		Scalars allocated in the interpreter's arenas.
+ */
+struct pperl_hwm {
+	size_t		 ph_stack;
+	size_t		 ph_tmps;
+	size_t		 ph_savestack;
+	size_t		 ph_scopestack;
+	size_t		 ph_svs;
+};
+
+extern void		 pperl_hwm_get(perlinterp_t interp,
+				       struct pperl_hwm *hwm);
+extern void		 pperl_hwm_save(perlinterp_t interp, const char *path,
+					struct perlresult *result);
+extern void		 pperl_hwm_load(perlinterp_t interp, const char *path,
+					struct perlresult *result);
+
+extern void		 pperl_profile_require(perlinterp_t interp,
+					       bool enable);
+extern void		 pperl_profile_report(perlinterp_t interp, FILE *fp);
+
+extern void		 pperl_module_reload(perlinterp_t interp,
+					     int interval);
+extern void		 pperl_module_check(perlinterp_t interp,
+					    perlenv_t penv,
+					    struct perlresult *result);
+
 
 extern perlcode_t	 pperl_load(perlinterp_t interp,
 				    const char *name, perlenv_t penv,
@@ -246,7 +447,83 @@ extern perlcode_t	 pperl_load(perlinterp_t interp,
 extern void		 pperl_run(perlcode_t pc,
 				   perlargs_t pargs, perlenv_t penv,
 				   struct perlresult *result);
+extern void		 pperl_run_handler(perlcode_t pc,
+					   const char *handler,
+					   perlargs_t pargs, perlenv_t penv,
+					   struct perlresult *result);
+extern void		 pperl_run_chain(perlcode_t *pcv, int npc,
+					 perlargs_t pargs, perlenv_t penv,
+					 struct perlresult *result);
+extern void		 pperl_run_capture(perlcode_t pc,
+					   perlargs_t pargs, perlenv_t penv,
+					   struct pperl_output *out,
+					   struct pperl_output *err,
+					   struct perlresult *result);
+
+/*!
+ * @struct pperl_cache_stats
+ *
+ * Snapshot of a cache's counters; see pperl_cache_stats().
+ *
+ *	@param	pcs_hits	Runs served from the cache.
+ *
+ *	@param	pcs_coalesced	Runs served by waiting for an identical run
+ *				already in progress.
+ *
+ *	@param	pcs_misses	Runs which had to execute the code.
+ *
+ *	@param	pcs_evicted	Cached output evicted to stay within the
+ *				cache's memory limit.
+ *
+ *	@param	pcs_bytes	Memory currently used by cached output.
+ */
+struct pperl_cache_stats {
+	uint64_t	 pcs_hits;
+	uint64_t	 pcs_coalesced;
+	uint64_t	 pcs_misses;
+	uint64_t	 pcs_evicted;
+	size_t		 pcs_bytes;
+};
+
+extern perlcache_t	 pperl_cache_new(size_t maxbytes, u_int ttl_msec);
+extern void		 pperl_cache_env(perlcache_t cache, const char *name);
+extern void		 pperl_cache_run(perlcache_t cache, perlcode_t pc,
+					 perlargs_t pargs, perlenv_t penv,
+					 struct pperl_output *out,
+					 struct perlresult *result);
+extern void		 pperl_cache_purge(perlcache_t cache);
+extern void		 pperl_cache_stats(perlcache_t cache,
+					   struct pperl_cache_stats *stats);
+extern void		 pperl_cache_free(perlcache_t *cachep);
+
+extern int		 pperl_call(perlcode_t pc, const char *sub,
+				    const struct pperl_value *argv, int argc,
+				    struct pperl_value *retv, int retmax,
+				    struct perlresult *result);
 extern void		 pperl_unload(perlcode_t *pcp);
+extern void		 pperl_unload_many(perlcode_t *pcv, int npc);
+extern void		 pperl_run_timeout(perlinterp_t interp, u_int msec);
+
+typedef void (pperl_complete_t)(const struct perlresult *result,
+				intptr_t data);
+
+extern void		 pperl_run_oncomplete(perlinterp_t interp,
+					      pperl_complete_t *onComplete,
+					      intptr_t data);
+extern void		 pperl_cancel(perlinterp_t interp);
+extern bool		 pperl_code_stale(const perlcode_t pc);
+extern perlcode_t	 pperl_code_find(perlinterp_t interp,
+					 const char *name);
+extern void		 pperl_code_budget(perlinterp_t interp, size_t bytes);
+extern size_t		 pperl_code_footprint(const perlcode_t pc);
+extern void		 pperl_lazy_compile(perlinterp_t interp, bool enable);
+extern int		 pperl_warmup(perlinterp_t interp, perlenv_t penv,
+				      int usec);
+
+extern void		 pperl_route_add(perlinterp_t interp,
+					 const char *prefix, perlcode_t pc);
+extern perlcode_t	 pperl_route_lookup(perlinterp_t interp,
+					    const char *path);
 
 
 extern perlcode_t	 pperl_load_file(perlinterp_t interp, const char *path,
@@ -256,6 +533,137 @@ extern perlcode_t	 pperl_load_fd(perlinterp_t interp, const char *name,
 				       perlenv_t penv, int fd,
 				       struct perlresult *result);
 
+
+/*!
+ * pperl_worker_init_t - Executor worker initialization callback.
+ *
+ *	Invoked on each of an executor's worker threads with the worker's
+ *	newly-created interpreter and index; should load the code the worker
+ *	will run.  Returns false if the worker could not be initialized.
+ */
+typedef bool (pperl_worker_init_t)(perlinterp_t interp, int worker,
+				   intptr_t data);
+
+/*!
+ * pperl_job_done_t - Executor job completion callback.
+ *
+ *	Invoked on the worker thread which ran the job once it completes.
+ *	The result remains valid until the job is freed.
+ */
+typedef void (pperl_job_done_t)(perljob_t job,
+				const struct perlresult *result,
+				intptr_t data);
+
+/*!
+ * @struct pperl_executor_stats
+ *
+ * Snapshot of an executor's counters; see pperl_executor_stats().
+ *
+ *	@param	pes_workers	Number of worker threads.
+ *
+ *	@param	pes_depth	Number of jobs currently queued (across all
+ *				workers).
+ *
+ *	@param	pes_submitted	Number of jobs accepted by
+ *				pperl_executor_submit().
+ *
+ *	@param	pes_rejected	Number of jobs rejected because the queues
+ *				were full.
+ *
+ *	@param	pes_shed	Number of jobs dropped because they were
+ *				queued too long; see pperl_executor_shed().
+ *
+ *	@param	pes_completed	Number of jobs completed (including those
+ *				shed).
+ *
+ *	@param	pes_wait_usec	Total microseconds completed jobs spent
+ *				queued.
+ *
+ *	@param	pes_wait_max_usec Longest any job spent queued.
+ */
+struct pperl_executor_stats {
+	int		 pes_workers;
+	u_int		 pes_depth;
+	uint64_t	 pes_submitted;
+	uint64_t	 pes_rejected;
+	uint64_t	 pes_shed;
+	uint64_t	 pes_completed;
+	uint64_t	 pes_wait_usec;
+	uint64_t	 pes_wait_max_usec;
+};
+
+/*!
+ * @struct pperl_shard_stats
+ *
+ * Snapshot of one executor worker's counters; see
+ * pperl_executor_shard_stats().
+ *
+ *	@param	pss_cpu		CPU the worker is pinned to; -1 if it isn't.
+ *
+ *	@param	pss_node	NUMA node the worker's memory is allocated
+ *				from; -1 if unknown.
+ *
+ *	@param	pss_depth	Number of jobs queued for the worker.
+ *
+ *	@param	pss_jobs	Number of jobs the worker has run.
+ *
+ *	@param	pss_hot		Number of jobs routed to the worker because
+ *				it had recently run the same code.
+ *
+ *	@param	pss_stolen	Number of jobs the worker took from other
+ *				workers' queues while idle.
+ *
+ *	@param	pss_busy_usec	Microseconds the worker spent running jobs.
+ *
+ *	@param	pss_uptime_usec	Microseconds since the worker started;
+ *				utilization is \a pss_busy_usec divided by this.
+ */
+struct pperl_shard_stats {
+	int		 pss_cpu;
+	int		 pss_node;
+	u_int		 pss_depth;
+	uint64_t	 pss_jobs;
+	uint64_t	 pss_hot;
+	uint64_t	 pss_stolen;
+	uint64_t	 pss_busy_usec;
+	uint64_t	 pss_uptime_usec;
+};
+
+extern perlexecutor_t	 pperl_executor_new(const char *procname,
+					    enum pperl_newflags flags,
+					    int nworkers, int depth,
+					    pperl_worker_init_t *oninit,
+					    intptr_t data);
+extern perlexecutor_t	 pperl_executor_new_pinned(const char *procname,
+					    enum pperl_newflags flags,
+					    const int *cpus, int nworkers,
+					    int depth,
+					    pperl_worker_init_t *oninit,
+					    intptr_t data);
+extern void		 pperl_executor_destroy(perlexecutor_t *pexp);
+extern void		 pperl_executor_shed(perlexecutor_t pex,
+					     uint64_t maxwait_usec);
+extern int		 pperl_executor_submit(perlexecutor_t pex,
+					       perljob_t job,
+					       pperl_job_done_t *ondone,
+					       intptr_t data);
+extern void		 pperl_executor_stats(perlexecutor_t pex,
+					struct pperl_executor_stats *stats);
+extern int		 pperl_executor_shard_stats(perlexecutor_t pex,
+					struct pperl_shard_stats *stats,
+					int nstats);
+
+extern perljob_t	 pperl_job_new(const char *name);
+extern void		 pperl_job_arg(perljob_t job, const char *arg);
+extern void		 pperl_job_env(perljob_t job, const char *name,
+				       const char *value);
+extern void		 pperl_job_stdin(perljob_t job, const void *buf,
+					 size_t len);
+extern void		 pperl_job_wait(perljob_t job,
+					struct perlresult *result);
+extern uint64_t		 pperl_job_wait_usec(const perljob_t job);
+extern void		 pperl_job_free(perljob_t *jobp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,6 +28,7 @@
 #include <unistd.h>
 
 #define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
 #include <EXTERN.h>
 #include <perl.h>
 
@@ -84,24 +85,38 @@ pperl_args_new(perlinterp_t interp, bool tainted, int argc, const char **argv)
 
 	assert(argc >= 0);
 
-	pargs = pperl_malloc(sizeof(*pargs));
-	pargs->pa_interp = interp;
-	pargs->pa_tainted = tainted;
+	/*
+	 * Reuse a previously destroyed argument list if there is one; its
+	 * buffers have already grown to fit typical requests, so in the
+	 * steady state no memory needs to be allocated at all.
+	 */
+	pargs = LIST_FIRST(&interp->pi_args_free);
+	if (pargs != NULL) {
+		LIST_REMOVE(pargs, pa_link);
+		interp->pi_args_nfree--;
+		pargs->pa_tainted = tainted;
+		pperl_args_reset(pargs);
+	}
+	else {
+		pargs = pperl_malloc(sizeof(*pargs));
+		pargs->pa_interp = interp;
+		pargs->pa_tainted = tainted;
 
-	pargs->pa_argc = 0;
-	pargs->pa_arglenv_size = ROUNDUP(argc, 4);
-	if (pargs->pa_arglenv_size == 0)
-		pargs->pa_arglenv_size = 4;
+		pargs->pa_argc = 0;
+		pargs->pa_arglenv_size = ROUNDUP(argc, 4);
+		if (pargs->pa_arglenv_size == 0)
+			pargs->pa_arglenv_size = 4;
 
-	pargs->pa_arglenv = pperl_malloc(pargs->pa_arglenv_size *
-					 sizeof(size_t));
+		pargs->pa_arglenv = pperl_malloc(pargs->pa_arglenv_size *
+						 sizeof(size_t));
 
-	pargs->pa_strbuf_len = 0;
-	pargs->pa_strbuf_size = ROUNDUP(argc * 20, 32);
-	if (pargs->pa_strbuf_size == 0)
-		pargs->pa_strbuf_size = 32;
+		pargs->pa_strbuf_len = 0;
+		pargs->pa_strbuf_size = ROUNDUP(argc * 20, 32);
+		if (pargs->pa_strbuf_size == 0)
+			pargs->pa_strbuf_size = 32;
 
-	pargs->pa_strbuf = pperl_malloc(pargs->pa_strbuf_size);
+		pargs->pa_strbuf = pperl_malloc(pargs->pa_strbuf_size);
+	}
 
 	for (; argc > 0; argc--, argv++)
 		pperl_args_append(pargs, *argv);
@@ -115,6 +130,9 @@ pperl_args_new(perlinterp_t interp, bool tainted, int argc, const char **argv)
 /*
  * pperl_args_destroy() - Free all memory allocated to an argument list.
  *
+ *	A limited number of destroyed lists are kept, along with their
+ *	buffers, to be handed out again by pperl_args_new().
+ *
  *	@param	pargsp		Pointer to argument list to free.
  *
  *	@post	*pargsp is set to NULL.
@@ -124,15 +142,60 @@ void
 pperl_args_destroy(perlargs_t *pargsp)
 {
 	perlargs_t pargs = *pargsp;
+	perlinterp_t interp = pargs->pa_interp;
 
 	*pargsp = NULL;
 	LIST_REMOVE(pargs, pa_link);
+
+	if (interp->pi_args_nfree < PPERL_POOL_MAX) {
+		LIST_INSERT_HEAD(&interp->pi_args_free, pargs, pa_link);
+		interp->pi_args_nfree++;
+		return;
+	}
+
 	free(pargs->pa_strbuf);
 	free(pargs->pa_arglenv);
 	free(pargs);
 }
 
 
+/*!
+ * pperl_args_reset() - Remove all arguments from an argument list.
+ *
+ *	Lets an argument list be refilled for another request without
+ *	destroying and recreating it; the list's buffers are kept.
+ *
+ *	@param	pargs		Argument list to empty.
+ */
+void
+pperl_args_reset(perlargs_t pargs)
+{
+
+	pargs->pa_argc = 0;
+	pargs->pa_strbuf_len = 0;
+}
+
+
+/*
+ * pperl_args_purge() - Free the argument lists kept for reuse.
+ *
+ *	Called by pperl_destroy().
+ */
+void
+pperl_args_purge(perlinterp_t interp)
+{
+	perlargs_t pargs;
+
+	while ((pargs = LIST_FIRST(&interp->pi_args_free)) != NULL) {
+		LIST_REMOVE(pargs, pa_link);
+		free(pargs->pa_strbuf);
+		free(pargs->pa_arglenv);
+		free(pargs);
+	}
+	interp->pi_args_nfree = 0;
+}
+
+
 /*
  * pperl_args_append() - Append a string to the given argument list.
  *
@@ -223,7 +286,7 @@ pperl_args_append_printf(perlargs_t pargs, const char *fmt, ...)
  *				If NULL, \@ARGV is set to an empty array.
  */
 void
-pperl_args_populate(perlargs_t pargs)
+pperl_args_populate(pTHX_ perlargs_t pargs)
 {
 	AV *perlargv;
 	SV *arg_sv;
@@ -245,7 +308,7 @@ pperl_args_populate(perlargs_t pargs)
 	if (pargs == NULL)
 		return;
 
-	assert(pargs->pa_interp->pi_perl == PERL_GET_CONTEXT);
+	assert(pargs->pa_interp->pi_perl == aTHX);
 
 	/*
 	 * Propogate argument's tainted flag to perl.  This lets the caller
@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+#include "sbuf.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+#define	CACHE_BUCKETS	1024	/* Hash buckets; must be a power of two. */
+
+
+/*
+ * @struct pperl_cache_entry
+ *
+ * Output of one run, or a run in progress that identical requests are
+ * waiting for.
+ *
+ *	@param	ce_key		Key the output was produced for; see
+ *				pperl_cache_key().
+ *
+ *	@param	ce_refs		Number of references: one from the hash table
+ *				while the entry is in it, plus one for each
+ *				thread waiting for the entry's run to finish.
+ *
+ *	@param	ce_pending	Set while the entry's run is in progress.
+ *
+ *	@param	ce_failed	Set if the run's result could not be cached;
+ *				threads which waited for it run the code
+ *				themselves.
+ *
+ *	@param	ce_expires	Clock reading after which the entry is stale.
+ *
+ *	@param	ce_size		Memory charged to the cache for the entry.
+ */
+struct pperl_cache_entry {
+	char				*ce_key;
+	size_t				 ce_keylen;
+	uint32_t			 ce_hash;
+	u_int				 ce_refs;
+	bool				 ce_pending;
+	bool				 ce_failed;
+	uint64_t			 ce_expires;
+	char				*ce_output;
+	size_t				 ce_outlen;
+	int				 ce_status;
+	size_t				 ce_size;
+	LIST_ENTRY(pperl_cache_entry)	 ce_hash_link;
+	TAILQ_ENTRY(pperl_cache_entry)	 ce_lru_link;
+};
+
+
+/*
+ * @struct perlcache
+ *
+ * Cache of the output of runs, shared by any number of interpreters and
+ * threads.
+ *
+ *	@param	pcache_lock	Protects everything below.
+ *
+ *	@param	pcache_done	Signalled whenever a pending entry's run
+ *				finishes.
+ *
+ *	@param	pcache_envv	Names of the environment variables which are
+ *				part of the key.
+ *
+ *	@param	pcache_lru	Entries in the hash table, most recently used
+ *				first.
+ *
+ *	@param	pcache_stats	Counters reported by pperl_cache_stats().
+ */
+struct perlcache {
+	pthread_mutex_t				 pcache_lock;
+	pthread_cond_t				 pcache_done;
+	size_t					 pcache_maxbytes;
+	size_t					 pcache_bytes;
+	uint64_t				 pcache_ttl_usec;
+	char					**pcache_envv;
+	int					 pcache_envc;
+	LIST_HEAD(, pperl_cache_entry)		 pcache_hash[CACHE_BUCKETS];
+	TAILQ_HEAD(pperl_cache_lru, pperl_cache_entry) pcache_lru;
+	struct pperl_cache_stats		 pcache_stats;
+};
+
+
+static void	 pperl_cache_key(perlcache_t cache, struct sbuf *sb,
+				 perlcode_t pc, perlargs_t pargs,
+				 perlenv_t penv);
+static uint32_t	 pperl_cache_hash(const char *key, size_t len);
+static struct pperl_cache_entry *pperl_cache_lookup(perlcache_t cache,
+				 const char *key, size_t len, uint32_t hash);
+static void	 pperl_cache_remove(perlcache_t cache,
+				    struct pperl_cache_entry *ce);
+static void	 pperl_cache_release(struct pperl_cache_entry *ce);
+static void	 pperl_cache_copy(const struct pperl_cache_entry *ce,
+				  struct pperl_output *out,
+				  struct perlresult *result);
+
+
+/*!
+ * pperl_cache_new() - Create a cache of run output.
+ *
+ *	Many scripts are pure functions of their arguments and a few
+ *	environment variables.  Running them through pperl_cache_run()
+ *	rather than pperl_run_capture() saves their output and exit status,
+ *	and serves later runs with the same arguments and environment from
+ *	the cache.  Identical runs which arrive while the first is still
+ *	in progress wait for it rather than running the code again.
+ *
+ *	Code is identified by name (see pperl_code_find()), so one cache may
+ *	be shared by any number of interpreters, e.g. all of an executor's
+ *	workers.  Caches may be used from any thread.
+ *
+ *	@param	maxbytes	Limit on the memory used by cached output;
+ *				least recently used output is evicted to stay
+ *				within it.
+ *
+ *	@param	ttl_msec	How long output remains valid, in milliseconds.
+ *
+ *	@return	New, empty cache.  Environment variables which affect the
+ *		output must be declared with pperl_cache_env() before the
+ *		cache is used.
+ */
+perlcache_t
+pperl_cache_new(size_t maxbytes, u_int ttl_msec)
+{
+	perlcache_t cache;
+	int i;
+
+	cache = pperl_malloc(sizeof(*cache));
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_init(&cache->pcache_lock, NULL);
+	pthread_cond_init(&cache->pcache_done, NULL);
+	cache->pcache_maxbytes = maxbytes;
+	cache->pcache_ttl_usec = (uint64_t)ttl_msec * 1000;
+	for (i = 0; i < CACHE_BUCKETS; i++)
+		LIST_INIT(&cache->pcache_hash[i]);
+	TAILQ_INIT(&cache->pcache_lru);
+
+	return (cache);
+}
+
+
+/*!
+ * pperl_cache_env() - Make an environment variable part of a cache's key.
+ *
+ *	Runs are only served from the cache if the declared environment
+ *	variables had the same values (or were likewise unset) when the
+ *	output was cached.  Other environment variables are ignored.
+ */
+void
+pperl_cache_env(perlcache_t cache, const char *name)
+{
+
+	cache->pcache_envv = pperl_realloc(cache->pcache_envv,
+			(cache->pcache_envc + 1) * sizeof(*cache->pcache_envv));
+	cache->pcache_envv[cache->pcache_envc++] = pperl_strdup(name);
+}
+
+
+/*!
+ * pperl_cache_run() - Execute loaded perl code, or serve it from a cache.
+ *
+ *	Behaves as pperl_run_capture() (without capturing STDERR), except that
+ *	if the same code was run recently with the same arguments and
+ *	declared environment variables, its output and exit status are
+ *	copied from the cache instead.  Only runs which complete without
+ *	error are cached.
+ *
+ *	@param	cache		Cache to look the run up in and store it in.
+ *
+ *	@param	pc		The perl code to run.
+ *
+ *	@param	pargs		Argument list; see pperl_run().
+ *
+ *	@param	penv		Environment variable list; see pperl_run().
+ *
+ *	@param	out		Buffer the output is captured or copied into;
+ *				see pperl_run_capture().
+ *
+ *	@param	result		If non-NULL, populated with the exit status
+ *				and/or error message returned by the code.
+ */
+void
+pperl_cache_run(perlcache_t cache, perlcode_t pc, perlargs_t pargs,
+		perlenv_t penv, struct pperl_output *out,
+		struct perlresult *result)
+{
+	struct perlresult dummy_result;
+	struct pperl_cache_entry *ce;
+	struct sbuf key_sb;
+	const char *key;
+	size_t keylen;
+	uint32_t hash;
+	uint64_t now;
+
+	assert(out != NULL);
+
+	if (result == NULL)
+		result = &dummy_result;
+
+	sbuf_new(&key_sb, NULL, 256, SBUF_AUTOEXTEND);
+	pperl_cache_key(cache, &key_sb, pc, pargs, penv);
+	sbuf_finish(&key_sb);
+	key = sbuf_data(&key_sb);
+	keylen = sbuf_len(&key_sb);
+	hash = pperl_cache_hash(key, keylen);
+
+	pthread_mutex_lock(&cache->pcache_lock);
+
+	for (;;) {
+		ce = pperl_cache_lookup(cache, key, keylen, hash);
+		if (ce == NULL)
+			break;
+
+		if (ce->ce_pending) {
+			/* Wait for the identical run in progress. */
+			ce->ce_refs++;
+			while (ce->ce_pending)
+				pthread_cond_wait(&cache->pcache_done,
+						  &cache->pcache_lock);
+			if (ce->ce_failed) {
+				/*
+				 * Its result wasn't cached.  Run the code
+				 * without a pending entry of our own, so the
+				 * other waiters don't queue up behind us one
+				 * at a time.
+				 */
+				cache->pcache_stats.pcs_misses++;
+				pperl_cache_release(ce);
+				pthread_mutex_unlock(&cache->pcache_lock);
+				sbuf_delete(&key_sb);
+				pperl_run_capture(pc, pargs, penv, out, NULL,
+						  result);
+				return;
+			}
+			cache->pcache_stats.pcs_coalesced++;
+			pperl_cache_copy(ce, out, result);
+			pperl_cache_release(ce);
+			pthread_mutex_unlock(&cache->pcache_lock);
+			sbuf_delete(&key_sb);
+			return;
+		}
+
+		if (pperl_clock() >= ce->ce_expires) {
+			pperl_cache_remove(cache, ce);
+			break;
+		}
+
+		cache->pcache_stats.pcs_hits++;
+		TAILQ_REMOVE(&cache->pcache_lru, ce, ce_lru_link);
+		TAILQ_INSERT_HEAD(&cache->pcache_lru, ce, ce_lru_link);
+		pperl_cache_copy(ce, out, result);
+		pthread_mutex_unlock(&cache->pcache_lock);
+		sbuf_delete(&key_sb);
+		return;
+	}
+
+	/*
+	 * Not cached; add a pending entry so that identical runs arriving
+	 * in the meantime wait for this one, and run the code.
+	 */
+	cache->pcache_stats.pcs_misses++;
+	ce = pperl_malloc(sizeof(*ce));
+	memset(ce, 0, sizeof(*ce));
+	ce->ce_key = pperl_malloc(keylen);
+	memcpy(ce->ce_key, key, keylen);
+	ce->ce_keylen = keylen;
+	ce->ce_hash = hash;
+	ce->ce_refs = 1;
+	ce->ce_pending = true;
+	LIST_INSERT_HEAD(&cache->pcache_hash[hash & (CACHE_BUCKETS - 1)], ce,
+			 ce_hash_link);
+	TAILQ_INSERT_HEAD(&cache->pcache_lru, ce, ce_lru_link);
+
+	pthread_mutex_unlock(&cache->pcache_lock);
+	sbuf_delete(&key_sb);
+
+	pperl_run_capture(pc, pargs, penv, out, NULL, result);
+
+	pthread_mutex_lock(&cache->pcache_lock);
+
+	ce->ce_pending = false;
+	ce->ce_size = sizeof(*ce) + ce->ce_keylen + out->po_len;
+	if (result->pperl_errmsg != NULL || result->pperl_errno != 0 ||
+	    ce->ce_size > cache->pcache_maxbytes) {
+		ce->ce_failed = true;
+		ce->ce_size = 0;
+		pperl_cache_remove(cache, ce);
+	}
+	else {
+		now = pperl_clock();
+		ce->ce_expires = now + cache->pcache_ttl_usec;
+		ce->ce_status = result->pperl_status;
+		ce->ce_outlen = out->po_len;
+		ce->ce_output = pperl_malloc(out->po_len + 1);
+		memcpy(ce->ce_output, out->po_buf, out->po_len);
+		cache->pcache_bytes += ce->ce_size;
+
+		/* Evict least recently used output to stay within budget. */
+		while (cache->pcache_bytes > cache->pcache_maxbytes) {
+			struct pperl_cache_entry *victim;
+
+			TAILQ_FOREACH_REVERSE(victim, &cache->pcache_lru,
+					      pperl_cache_lru, ce_lru_link)
+				if (!victim->ce_pending && victim != ce)
+					break;
+			if (victim == NULL)
+				break;
+			cache->pcache_stats.pcs_evicted++;
+			pperl_cache_remove(cache, victim);
+		}
+	}
+
+	pthread_cond_broadcast(&cache->pcache_done);
+	pthread_mutex_unlock(&cache->pcache_lock);
+}
+
+
+/*!
+ * pperl_cache_purge() - Discard all output in a cache.
+ *
+ *	Typically called after code has been reloaded, as output cached from
+ *	the old code may no longer be valid.  Runs in progress are unaffected.
+ */
+void
+pperl_cache_purge(perlcache_t cache)
+{
+	struct pperl_cache_entry *ce, *next;
+
+	pthread_mutex_lock(&cache->pcache_lock);
+	for (ce = TAILQ_FIRST(&cache->pcache_lru); ce != NULL; ce = next) {
+		next = TAILQ_NEXT(ce, ce_lru_link);
+		if (!ce->ce_pending)
+			pperl_cache_remove(cache, ce);
+	}
+	pthread_mutex_unlock(&cache->pcache_lock);
+}
+
+
+/*!
+ * pperl_cache_stats() - Get a snapshot of a cache's counters.
+ */
+void
+pperl_cache_stats(perlcache_t cache, struct pperl_cache_stats *stats)
+{
+
+	pthread_mutex_lock(&cache->pcache_lock);
+	*stats = cache->pcache_stats;
+	stats->pcs_bytes = cache->pcache_bytes;
+	pthread_mutex_unlock(&cache->pcache_lock);
+}
+
+
+/*!
+ * pperl_cache_free() - Free a cache.
+ *
+ *	The cache must not be in use by any thread.
+ *
+ *	@param	cachep		Pointer to cache to free.
+ *
+ *	@post	*cachep is set to NULL.
+ */
+void
+pperl_cache_free(perlcache_t *cachep)
+{
+	perlcache_t cache = *cachep;
+	struct pperl_cache_entry *ce;
+	int i;
+
+	*cachep = NULL;
+
+	while ((ce = TAILQ_FIRST(&cache->pcache_lru)) != NULL) {
+		assert(!ce->ce_pending);
+		pperl_cache_remove(cache, ce);
+	}
+
+	for (i = 0; i < cache->pcache_envc; i++)
+		free(cache->pcache_envv[i]);
+	free(cache->pcache_envv);
+
+	pthread_cond_destroy(&cache->pcache_done);
+	pthread_mutex_destroy(&cache->pcache_lock);
+	free(cache);
+}
+
+
+/*
+ * pperl_cache_key() - Build the key identifying a run.
+ *
+ *	The key is made up of the code's name, its arguments, and the
+ *	values of the cache's declared environment variables, each
+ *	preceded by its length so that no two runs can share a key.
+ */
+void
+pperl_cache_key(perlcache_t cache, struct sbuf *sb, perlcode_t pc,
+		perlargs_t pargs, perlenv_t penv)
+{
+	const char *arg, *value;
+	STRLEN len;
+	SV **svp;
+	int i;
+	dTHXa(pc->pc_interp->pi_perl);
+
+	sbuf_printf(sb, "%zu:%s", strlen(pc->pc_name), pc->pc_name);
+
+	if (pargs != NULL) {
+		sbuf_printf(sb, "%d:", pargs->pa_argc);
+		arg = pargs->pa_strbuf;
+		for (i = 0; i < pargs->pa_argc; i++) {
+			sbuf_printf(sb, "%zu:", pargs->pa_arglenv[i]);
+			sbuf_bcat(sb, arg, pargs->pa_arglenv[i]);
+			arg += pargs->pa_arglenv[i];
+		}
+	}
+	else
+		sbuf_cat(sb, "0:");
+
+	for (i = 0; i < cache->pcache_envc; i++) {
+		svp = NULL;
+		if (penv != NULL)
+			svp = hv_fetch(penv->pe_envhash, cache->pcache_envv[i],
+				       strlen(cache->pcache_envv[i]), FALSE);
+		if (svp == NULL || !SvOK(*svp)) {
+			sbuf_cat(sb, "-");
+			continue;
+		}
+		value = SvPV(*svp, len);
+		sbuf_printf(sb, "%zu:", (size_t)len);
+		sbuf_bcat(sb, value, len);
+	}
+}
+
+
+/*
+ * pperl_cache_hash() - FNV-1a hash of a key.
+ */
+uint32_t
+pperl_cache_hash(const char *key, size_t len)
+{
+	const u_char *pos;
+	uint32_t hash;
+
+	hash = 2166136261U;
+	for (pos = (const u_char *)key; len > 0; pos++, len--) {
+		hash ^= *pos;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+
+/*
+ * pperl_cache_lookup() - Find the entry for a key.
+ *
+ *	@note	Called with the cache's lock held.
+ */
+struct pperl_cache_entry *
+pperl_cache_lookup(perlcache_t cache, const char *key, size_t len,
+		   uint32_t hash)
+{
+	struct pperl_cache_entry *ce;
+
+	LIST_FOREACH(ce, &cache->pcache_hash[hash & (CACHE_BUCKETS - 1)],
+		     ce_hash_link)
+		if (ce->ce_hash == hash && ce->ce_keylen == len &&
+		    memcmp(ce->ce_key, key, len) == 0)
+			return (ce);
+
+	return (NULL);
+}
+
+
+/*
+ * pperl_cache_remove() - Remove an entry from a cache.
+ *
+ *	The entry is freed once no thread is waiting for it.
+ *
+ *	@note	Called with the cache's lock held.
+ */
+void
+pperl_cache_remove(perlcache_t cache, struct pperl_cache_entry *ce)
+{
+
+	LIST_REMOVE(ce, ce_hash_link);
+	TAILQ_REMOVE(&cache->pcache_lru, ce, ce_lru_link);
+	cache->pcache_bytes -= ce->ce_size;
+	pperl_cache_release(ce);
+}
+
+
+/*
+ * pperl_cache_release() - Drop a reference to an entry.
+ *
+ *	@note	Called with the cache's lock held.
+ */
+void
+pperl_cache_release(struct pperl_cache_entry *ce)
+{
+
+	assert(ce->ce_refs > 0);
+	if (--ce->ce_refs > 0)
+		return;
+
+	free(ce->ce_key);
+	free(ce->ce_output);
+	free(ce);
+}
+
+
+/*
+ * pperl_cache_copy() - Copy cached output and status to the caller.
+ */
+void
+pperl_cache_copy(const struct pperl_cache_entry *ce, struct pperl_output *out,
+		 struct perlresult *result)
+{
+
+	if (ce->ce_outlen > out->po_size) {
+		out->po_size = ce->ce_outlen;
+		out->po_buf = pperl_realloc(out->po_buf, out->po_size);
+	}
+	if (ce->ce_outlen > 0)
+		memcpy(out->po_buf, ce->ce_output, ce->ce_outlen);
+	out->po_len = ce->ce_outlen;
+
+	pperl_result_clear(result);
+	result->pperl_status = ce->ce_status;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+static SV	*pperl_value_sv(pTHX_ const struct pperl_value *val);
+static void	 pperl_value_set(pTHX_ perlinterp_t interp,
+				 struct pperl_value *val, SV *sv);
+
+
+/*!
+ * pperl_call() - Call a subroutine in loaded code with C values.
+ *
+ *	A lightweight alternative to pperl_run_handler() for calling perl
+ *	from tight loops (e.g. using perl to evaluate rules or transform
+ *	records).  The arguments are passed directly as \@_ and the values
+ *	the subroutine returns (in list context) are converted straight to
+ *	C values; nothing passes through \@ARGV, \%ENV, or strings.
+ *
+ *	To keep each call cheap, \@ARGV and \%ENV are left as they are, the
+ *	prologue and epilogue hooks are not run, and the current directory
+ *	is not saved and restored.  As with pperl_run_handler(), the code's
+ *	body is run (via pperl_run()) before the first call to initialize
+ *	it, and the subroutine is looked up once and cached.  Timeouts set
+ *	with pperl_run_timeout() still apply.
+ *
+ *	String arguments are not copied: the subroutine sees read-only
+ *	scalars referring to the caller's buffers, which need only remain
+ *	valid until pperl_call() returns.  Code which wants to keep such a
+ *	value must copy it (e.g. "my ($s) = @_;"), not take a reference to
+ *	it.
+ *
+ *	@param	pc		Code the subroutine is defined in.
+ *
+ *	@param	sub		Name of the subroutine, without a package
+ *				qualifier.
+ *
+ *	@param	argv		Values to pass in \@_.
+ *
+ *	@param	argc		Number of values in \a argv.
+ *
+ *	@param	retv		Populated with the values returned.  String
+ *				values refer to perl's storage and remain valid
+ *				until the next pperl_call() in the same
+ *				interpreter.
+ *
+ *	@param	retmax		Number of entries in \a retv; any further
+ *				values returned are discarded.
+ *
+ *	@param	result		If non-NULL, populated with the exit status
+ *				and/or error message of the call.
+ *
+ *	@return	Number of values the subroutine returned (which may exceed
+ *		\a retmax), or -1 if it raised an error or doesn't exist.
+ */
+int
+pperl_call(perlcode_t pc, const char *sub, const struct pperl_value *argv,
+	   int argc, struct pperl_value *retv, int retmax,
+	   struct perlresult *result)
+{
+	const perlinterp_t interp = pc->pc_interp;
+	struct perlresult dummy_result;
+	PerlInterpreter *orig_perl;
+	SV *sub_sv;
+	SV **retsvp;
+	int count, i;
+	int interrupted;
+	dTHXa(interp->pi_perl);
+	dSP;
+
+	if (result == NULL)
+		result = &dummy_result;
+	pperl_result_clear(result);
+
+	/* Perl's stacks are in use by a parked fiber; see pperl_fiber_new(). */
+	if (pperl_fiber_parked(interp)) {
+		pperl_seterr(interp, EBUSY, result);
+		return (-1);
+	}
+
+	/* Run the code's body first to set up whatever the sub relies on. */
+	if (pc->pc_sv == NULL || !pc->pc_initialized) {
+		pperl_run(pc, NULL, NULL, result);
+		if (!pc->pc_initialized)
+			return (-1);
+		SPAGAIN;
+	}
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	/* Release the values returned by the previous call. */
+	if (interp->pi_call_av != NULL)
+		av_clear(interp->pi_call_av);
+	else
+		interp->pi_call_av = newAV();
+
+	sub_sv = pperl_handler_find(aTHX_ pc, sub);
+	if (sub_sv == NULL) {
+		pperl_log(LOG_ERR, "%s: no subroutine %s", pc->pc_name, sub);
+		PERL_SET_CONTEXT(orig_perl);
+		pperl_seterr(interp, ENOENT, result);
+		return (-1);
+	}
+
+	ENTER;
+	SAVETMPS;
+
+	PUSHMARK(SP);
+	EXTEND(SP, argc);
+	for (i = 0; i < argc; i++)
+		PUSHs(sv_2mortal(pperl_value_sv(aTHX_ &argv[i])));
+	PUTBACK;
+
+	pperl_cancel_arm(interp);
+	count = call_sv(sub_sv, G_ARRAY|G_EVAL);
+	interrupted = pperl_cancel_disarm(interp);
+
+	SPAGAIN;
+	retsvp = SP - count + 1;
+	for (i = 0; i < count && i < retmax; i++)
+		pperl_value_set(aTHX_ interp, &retv[i], retsvp[i]);
+	SP -= count;
+	PUTBACK;
+
+	FREETMPS;
+	LEAVE;
+
+	result->pperl_status = STATUS_CURRENT;
+	result->pperl_errno = interrupted;
+	if (SvTRUE(ERRSV)) {
+		result->pperl_errmsg = SvPVX(ERRSV);
+		pperl_log(LOG_DEBUG, "%s(%s): %s",
+			  __func__, pc->pc_name, result->pperl_errmsg);
+		count = -1;
+	}
+
+	PERL_SET_CONTEXT(orig_perl);
+
+	return (count);
+}
+
+
+/*
+ * pperl_value_sv() - Create a perl scalar from a C value.
+ *
+ *	Strings are wrapped rather than copied; see pperl_call().
+ */
+SV *
+pperl_value_sv(pTHX_ const struct pperl_value *val)
+{
+	SV *sv;
+
+	switch (val->pv_type) {
+	case PPERL_INT:
+		return (newSViv(val->pv_int));
+
+	case PPERL_DOUBLE:
+		return (newSVnv(val->pv_double));
+
+	case PPERL_STRING:
+		sv = newSV(0);
+		sv_upgrade(sv, SVt_PV);
+		SvPV_set(sv, ignoreconst(val->pv_str));
+		SvCUR_set(sv, val->pv_len);
+		SvLEN_set(sv, 0);
+		SvPOK_only(sv);
+		SvREADONLY_on(sv);
+		return (sv);
+
+	case PPERL_UNDEF:
+	default:
+		return (newSV(0));
+	}
+}
+
+
+/*
+ * pperl_value_set() - Convert a returned perl scalar to a C value.
+ *
+ *	Numbers are returned as numbers if perl has them in numeric form,
+ *	strings by reference to perl's own buffer; the scalar is kept alive
+ *	until the next pperl_call() so the reference remains valid.
+ */
+void
+pperl_value_set(pTHX_ perlinterp_t interp, struct pperl_value *val, SV *sv)
+{
+	STRLEN len;
+
+	memset(val, 0, sizeof(*val));
+
+	if (!SvOK(sv))
+		val->pv_type = PPERL_UNDEF;
+	else if (SvIOK(sv) && !SvIsUV(sv)) {
+		val->pv_type = PPERL_INT;
+		val->pv_int = SvIVX(sv);
+	}
+	else if (SvNOK(sv) || SvIOK(sv)) {
+		val->pv_type = PPERL_DOUBLE;
+		val->pv_double = SvNV(sv);
+	}
+	else {
+		val->pv_type = PPERL_STRING;
+		val->pv_str = SvPV(sv, len);
+		val->pv_len = len;
+		av_push(interp->pi_call_av, SvREFCNT_inc(sv));
+	}
+}
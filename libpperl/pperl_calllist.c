@@ -30,6 +30,7 @@
 #include <unistd.h>
 
 #define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
 #include <EXTERN.h>
 #include <XSUB.h>
 #include <perl.h>
@@ -55,7 +56,7 @@
  *				call list will be removed.
  */
 void
-pperl_calllist_clear(AV *calllist, const HV *pkgstash)
+pperl_calllist_clear(pTHX_ AV *calllist, const HV *pkgstash)
 {
 	SV *sv;
 	int max;
@@ -136,7 +137,7 @@ pperl_calllist_clear(AV *calllist, const HV *pkgstash)
  *		the perl environment.
  */
 void
-pperl_calllist_run(AV *calllist, const HV *pkgstash,
+pperl_calllist_run(pTHX_ AV *calllist, const HV *pkgstash,
 		   enum pperl_calllist_flags flags)
 {
 	HV *cstash;
@@ -223,3 +224,172 @@ pperl_calllist_run(AV *calllist, const HV *pkgstash,
 			break;
 	}
 }
+
+
+/*!
+ * pperl_calllist_stashset() - Create a set of perl packages for use with
+ *			       pperl_calllist_clear_set() and
+ *			       pperl_calllist_run_set().
+ *
+ *	The set is a perl hash keyed by the address of each package's stash;
+ *	checking whether a call list entry belongs to any package in the set
+ *	is a single hash lookup, so a call list need only be scanned once no
+ *	matter how many packages are in the set.
+ *
+ *	@return	Empty set; the caller owns the reference.
+ */
+HV *
+pperl_calllist_stashset(pTHX)
+{
+
+	return newHV();
+}
+
+
+/*!
+ * pperl_calllist_stashset_add() - Add a package to a set of packages.
+ *
+ *	@param	set		Set returned by pperl_calllist_stashset().
+ *
+ *	@param	pkgstash	Package to add.
+ *
+ *	@param	name		Value to set \$0 to while running code blocks
+ *				in the package.
+ */
+void
+pperl_calllist_stashset_add(pTHX_ HV *set, const HV *pkgstash, const char *name)
+{
+
+	hv_store(set, (const char *)&pkgstash, sizeof(pkgstash),
+		 newSVpv(name, 0), 0);
+}
+
+
+/*
+ * pperl_calllist_stashset_find() - Lookup the value associated with the
+ *				    package the given code block resides in.
+ */
+static inline
+SV *
+pperl_calllist_stashset_find(pTHX_ HV *set, SV *sv)
+{
+	const HV *cstash;
+	SV **svp;
+
+	assert(SvTYPE(sv) == SVt_PVCV);
+	cstash = CvSTASH((CV *)sv);
+
+	svp = hv_fetch(set, (const char *)&cstash, sizeof(cstash), FALSE);
+	return (svp != NULL ? *svp : NULL);
+}
+
+
+/*!
+ * pperl_calllist_clear_set() - Remove all references to any of a set of
+ *				packages from a perl call list.
+ *
+ *	Equivalent to calling pperl_calllist_clear() for each package in the
+ *	set, but in a single pass over the call list.
+ *
+ *	@param	calllist	Perl call list to iterate over.
+ *
+ *	@param	set		Set of packages whose code blocks are to be
+ *				removed; see pperl_calllist_stashset().
+ */
+void
+pperl_calllist_clear_set(pTHX_ AV *calllist, HV *set)
+{
+	SV **array;
+	SV *sv;
+	int max;
+	int i, j;
+
+	/* Nothing to do if the call list is empty. */
+	if (calllist == NULL || (max = av_len(calllist)) == -1)
+		return;
+
+	/*
+	 * Compact the array in place, keeping only entries which live
+	 * outside of the set of packages.
+	 */
+	array = AvARRAY(calllist);
+	for (i = j = 0; i <= max; i++) {
+		sv = array[i];
+		if (sv != NULL && sv != &PL_sv_undef &&
+		    pperl_calllist_stashset_find(aTHX_ set, sv) != NULL) {
+			SvREFCNT_dec(sv);
+			continue;
+		}
+		array[j++] = sv;
+	}
+
+	for (i = j; i <= max; i++)
+		array[i] = NULL;
+	AvFILLp(calllist) = j - 1;
+}
+
+
+/*!
+ * pperl_calllist_run_set() - Run all call list entries which are in any of a
+ *			      set of perl packages.
+ *
+ *	Equivalent to calling pperl_calllist_run() with CONTINUE_ON_ERROR for
+ *	each package in the set, but in a single pass over the call list.
+ *	Code blocks are run in call list order rather than grouped by
+ *	package.  \$0 is set to the name associated with each block's package
+ *	before it is run.
+ *
+ *	@param	calllist	Perl call list to iterate over.
+ *
+ *	@param	set		Set of packages whose code blocks are to be
+ *				run; see pperl_calllist_stashset().
+ *
+ *	@note	Must be called within an ENTER/LEAVE block after
+ *		pperl_setvars() (which localizes \$0).
+ */
+void
+pperl_calllist_run_set(pTHX_ AV *calllist, HV *set)
+{
+	SV *zero_sv;
+	SV *name_sv;
+	SV *lastname_sv;
+	SV **svp;
+	SV *sv;
+	int i;
+	dSP;
+
+	if (calllist == NULL)
+		return;
+
+	zero_sv = GvSV(gv_fetchpv("0", TRUE, SVt_PV));
+	lastname_sv = NULL;
+
+	for (i = 0; i <= av_len(calllist); i++) {
+		I32 oldscope;
+
+		/* Retrieve the next element in the call list array. */
+		svp = av_fetch(calllist, i, FALSE);
+		if (svp == NULL || *svp == &PL_sv_undef)
+			continue;
+		sv = *svp;
+
+		name_sv = pperl_calllist_stashset_find(aTHX_ set, sv);
+		if (name_sv == NULL)
+			continue;
+
+		if (name_sv != lastname_sv) {
+			sv_setsv_mg(zero_sv, name_sv);
+			lastname_sv = name_sv;
+		}
+
+		oldscope = PL_scopestack_ix;
+
+		PUSHMARK(SP);
+		call_sv(sv, G_EVAL|G_VOID|G_DISCARD|G_KEEPERR);
+
+		/* Ensure we return the same scope we started in. */
+		while (PL_scopestack_ix > oldscope) {
+			LEAVE;
+		}
+	}
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*
+ * Signal number used to make perl call into pperl_sighandler().  We never
+ * actually deliver the signal; we just mark it pending in the target
+ * interpreter so perl's safe signal dispatch picks it up at its next safe
+ * point.  Genuine SIGALRMs are passed through to perl's own handler.
+ */
+#define	PPERL_CANCEL_SIGNAL	SIGALRM
+
+
+#ifdef PERL_USE_3ARG_SIGHANDLER
+static Signal_t	 pperl_sighandler(int sig, Siginfo_t *info, void *uap);
+#else
+static Signal_t	 pperl_sighandler(int sig);
+#endif
+static void	 pperl_interrupt(perlinterp_t interp, int reason);
+static void	*pperl_watchdog_main(void *arg);
+static void	 pperl_watchdog_atfork(void);
+static void	 pperl_watchdog_child(void);
+
+
+/*
+ * State of the watchdog thread which interrupts runs that pass their
+ * deadline.  Armed interpreters are kept sorted by deadline so the thread
+ * only ever has to look at the head of the queue.
+ */
+static pthread_mutex_t	 watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 watchdog_cond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(, perlinterp) watchdog_head =
+			 TAILQ_HEAD_INITIALIZER(watchdog_head);
+static bool		 watchdog_running = false;
+static pthread_once_t	 watchdog_once = PTHREAD_ONCE_INIT;
+
+
+/*!
+ * pperl_run_timeout() - Limit how long code may run.
+ *
+ *	Sets a deadline for every subsequent pperl_run() in the interpreter.
+ *	When a run exceeds it, the code is interrupted at perl's next safe
+ *	point (between opcodes) as if it had died; epilogue hooks still run
+ *	and the result's pperl_errno is set to ETIMEDOUT.  The interruption
+ *	cannot be caught by an eval block in the code.
+ *
+ *	@note	Perl only checks for interruptions between opcodes, so code
+ *		blocked in a system call (e.g. sleep or a socket read) is not
+ *		interrupted until the call returns.
+ *
+ *	@param	interp		Interpreter to limit.
+ *
+ *	@param	msec		Maximum number of milliseconds each run may
+ *				take; zero for no limit.
+ */
+void
+pperl_run_timeout(perlinterp_t interp, u_int msec)
+{
+
+	interp->pi_timeout_msec = msec;
+}
+
+
+/*!
+ * pperl_cancel() - Cancel code running in an interpreter.
+ *
+ *	May be called from any thread.  The code currently being run by
+ *	pperl_run() is interrupted at perl's next safe point as described for
+ *	pperl_run_timeout(), except the result's pperl_errno is ECANCELED.
+ *	Has no effect if the interpreter isn't running any code.
+ *
+ *	@param	interp		Interpreter to cancel code in.
+ */
+void
+pperl_cancel(perlinterp_t interp)
+{
+
+	pthread_mutex_lock(&watchdog_lock);
+	if (interp->pi_running)
+		pperl_interrupt(interp, ECANCELED);
+	pthread_mutex_unlock(&watchdog_lock);
+}
+
+
+/*!
+ * pperl_cancel_init() - Prepare a new interpreter to be interrupted.
+ *
+ *	Installs pperl_sighandler() as the interpreter's signal dispatcher.
+ */
+void
+pperl_cancel_init(perlinterp_t interp)
+{
+	dTHXa(interp->pi_perl);
+
+	interp->pi_sighandler = PL_sighandlerp;
+	PL_sighandlerp = pperl_sighandler;
+
+	pthread_once(&watchdog_once, pperl_watchdog_atfork);
+}
+
+
+/*!
+ * pperl_cancel_arm() - Note the start of a run.
+ *
+ *	Makes the interpreter eligible for pperl_cancel() and, if a timeout
+ *	has been set, schedules it to be interrupted when the run's deadline
+ *	passes.  Must be called with the interpreter as the current perl
+ *	context.
+ */
+void
+pperl_cancel_arm(perlinterp_t interp)
+{
+	perlinterp_t next;
+	int error;
+
+	pthread_mutex_lock(&watchdog_lock);
+
+	assert(!interp->pi_running);
+	interp->pi_running = true;
+	interp->pi_cancel = 0;
+
+	if (interp->pi_timeout_msec == 0) {
+		pthread_mutex_unlock(&watchdog_lock);
+		return;
+	}
+
+	if (!watchdog_running) {
+		pthread_t thread;
+
+		error = pthread_create(&thread, NULL, pperl_watchdog_main, NULL);
+		if (error != 0) {
+			errno = error;
+			pperl_fatal(EX_OSERR, "pthread_create: %m");
+		}
+		pthread_detach(thread);
+		watchdog_running = true;
+	}
+
+	interp->pi_deadline = pperl_clock() +
+			      (uint64_t)interp->pi_timeout_msec * 1000;
+
+	TAILQ_FOREACH(next, &watchdog_head, pi_watchdog_link) {
+		if (next->pi_deadline > interp->pi_deadline)
+			break;
+	}
+	if (next != NULL)
+		TAILQ_INSERT_BEFORE(next, interp, pi_watchdog_link);
+	else
+		TAILQ_INSERT_TAIL(&watchdog_head, interp, pi_watchdog_link);
+	interp->pi_armed = true;
+
+	/* Wake the watchdog if its next deadline just got earlier. */
+	if (TAILQ_FIRST(&watchdog_head) == interp)
+		pthread_cond_signal(&watchdog_cond);
+
+	pthread_mutex_unlock(&watchdog_lock);
+}
+
+
+/*!
+ * pperl_cancel_disarm() - Note the end of a run.
+ *
+ *	Once this returns, the interpreter will not be interrupted until the
+ *	next call to pperl_cancel_arm().
+ *
+ *	@return	Zero if the run completed normally; ETIMEDOUT if it passed
+ *		its deadline or ECANCELED if it was cancelled.
+ */
+int
+pperl_cancel_disarm(perlinterp_t interp)
+{
+	int reason;
+	dTHXa(interp->pi_perl);
+
+	pthread_mutex_lock(&watchdog_lock);
+
+	if (interp->pi_armed) {
+		TAILQ_REMOVE(&watchdog_head, interp, pi_watchdog_link);
+		interp->pi_armed = false;
+	}
+	interp->pi_running = false;
+
+	reason = interp->pi_cancel;
+	interp->pi_cancel = 0;
+
+	pthread_mutex_unlock(&watchdog_lock);
+
+	/*
+	 * The interruption is re-posted each time it fires (see
+	 * pperl_sighandler()); don't let the leftover fire in later code.
+	 */
+	if (reason != 0 && PL_psig_pend != NULL)
+		PL_psig_pend[PPERL_CANCEL_SIGNAL] = 0;
+
+	return (reason);
+}
+
+
+/*
+ * pperl_interrupt() - Make an interpreter croak at its next safe point.
+ *
+ *	May be called from any thread with watchdog_lock held.  Perl checks
+ *	its pending signal count between opcodes and, finding one, calls the
+ *	interpreter's signal dispatcher: pperl_sighandler().
+ */
+void
+pperl_interrupt(perlinterp_t interp, int reason)
+{
+	dTHXa(interp->pi_perl);
+
+	if (interp->pi_cancel != 0)
+		return;
+
+	interp->pi_cancel = reason;
+	__sync_synchronize();
+
+	if (PL_psig_pend != NULL)
+		PL_psig_pend[PPERL_CANCEL_SIGNAL]++;
+	PL_sig_pending = 1;
+}
+
+
+/*
+ * pperl_sighandler() - Signal dispatcher installed in every interpreter.
+ *
+ *	If the current run has been interrupted, raises an exception in place
+ *	of running perl's handler.  The interruption is re-posted so the next
+ *	safe point raises it again; this keeps an eval block in the running
+ *	code from simply swallowing the exception and carrying on.
+ */
+Signal_t
+#ifdef PERL_USE_3ARG_SIGHANDLER
+pperl_sighandler(int sig, Siginfo_t *info, void *uap)
+#else
+pperl_sighandler(int sig)
+#endif
+{
+	dTHX;			/* Signal dispatch has no context to pass. */
+	perlinterp_t interp = pperl_current_interp(aTHX);
+	int reason;
+
+	/* Interpreter state is gone (e.g. during destruction); defer to perl. */
+	if (interp == NULL) {
+#ifdef PERL_USE_3ARG_SIGHANDLER
+		Perl_sighandler(sig, info, uap);
+#else
+		Perl_sighandler(sig);
+#endif
+		return;
+	}
+
+	reason = interp->pi_cancel;
+	if (sig != PPERL_CANCEL_SIGNAL || reason == 0) {
+#ifdef PERL_USE_3ARG_SIGHANDLER
+		(*interp->pi_sighandler)(sig, info, uap);
+#else
+		(*interp->pi_sighandler)(sig);
+#endif
+		return;
+	}
+
+	if (PL_psig_pend != NULL)
+		PL_psig_pend[PPERL_CANCEL_SIGNAL]++;
+	PL_sig_pending = 1;
+
+	croak("%s", reason == ETIMEDOUT ? "run timed out" : "run cancelled");
+}
+
+
+/*
+ * pperl_watchdog_main() - Body of the thread which enforces deadlines.
+ */
+void *
+pperl_watchdog_main(void *arg)
+{
+	perlinterp_t interp;
+	struct timespec abstime;
+	struct timeval now;
+	uint64_t clock, wait;
+
+	(void)arg;
+
+	pthread_mutex_lock(&watchdog_lock);
+
+	for (;;) {
+		interp = TAILQ_FIRST(&watchdog_head);
+		if (interp == NULL) {
+			pthread_cond_wait(&watchdog_cond, &watchdog_lock);
+			continue;
+		}
+
+		clock = pperl_clock();
+		if (clock >= interp->pi_deadline) {
+			TAILQ_REMOVE(&watchdog_head, interp, pi_watchdog_link);
+			interp->pi_armed = false;
+			pperl_log(LOG_WARNING, "interrupting run in %p: "
+				  "timed out", interp);
+			pperl_interrupt(interp, ETIMEDOUT);
+			continue;
+		}
+
+		/*
+		 * Condition variables time out against the realtime clock
+		 * while deadlines are kept against the monotonic clock, so
+		 * convert the remaining time into an absolute realtime.
+		 */
+		wait = interp->pi_deadline - clock;
+		gettimeofday(&now, NULL);
+		abstime.tv_sec = now.tv_sec + wait / 1000000;
+		abstime.tv_nsec = now.tv_usec * 1000 + (wait % 1000000) * 1000;
+		if (abstime.tv_nsec >= 1000000000) {
+			abstime.tv_sec++;
+			abstime.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&watchdog_cond, &watchdog_lock, &abstime);
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+
+/*
+ * pperl_watchdog_atfork() - Arrange for forked children to reset the
+ *			     watchdog state.
+ */
+void
+pperl_watchdog_atfork(void)
+{
+
+	pthread_atfork(NULL, NULL, pperl_watchdog_child);
+}
+
+
+/*
+ * pperl_watchdog_child() - Reset the watchdog state in a forked child.
+ *
+ *	The watchdog thread isn't duplicated by fork(2) and may have held its
+ *	lock at the time, so start over as if it had never run; the child
+ *	starts its own thread if it arms a deadline.  Runs the parent had
+ *	armed don't exist in the child.
+ */
+void
+pperl_watchdog_child(void)
+{
+	perlinterp_t interp;
+
+	pthread_mutex_init(&watchdog_lock, NULL);
+	pthread_cond_init(&watchdog_cond, NULL);
+	while ((interp = TAILQ_FIRST(&watchdog_head)) != NULL) {
+		TAILQ_REMOVE(&watchdog_head, interp, pi_watchdog_link);
+		interp->pi_armed = false;
+	}
+	watchdog_running = false;
+}
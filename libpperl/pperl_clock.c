@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sysexits.h>
+#include <time.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*!
+ * pperl_clock() - Read a monotonic clock.
+ *
+ *	This is an internal interface used by libpperl to measure elapsed
+ *	time (e.g. how long code took to compile).  The returned value has
+ *	no meaning on its own; only the difference between two readings is
+ *	meaningful.
+ *
+ *	@return	Current value of the system's monotonic clock, in
+ *		microseconds.
+ */
+uint64_t
+pperl_clock(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		pperl_fatal(EX_OSERR, "clock_gettime: %m");
+
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
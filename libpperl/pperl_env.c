@@ -28,6 +28,7 @@
 #include <unistd.h>
 
 #define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
 #include <EXTERN.h>
 #include <perl.h>
 
@@ -69,15 +70,23 @@
 perlenv_t
 pperl_env_new(perlinterp_t interp, bool tainted, int envc, const char **envp)
 {
-	PerlInterpreter *orig_perl;
 	perlenv_t penv;
+	dTHXa(interp->pi_perl);
 
-	orig_perl = PERL_GET_CONTEXT;
-	PERL_SET_CONTEXT(interp->pi_perl);
-
-	penv = pperl_malloc(sizeof(*penv));
-	penv->pe_interp = interp;
-	penv->pe_envhash = newHV();
+	/*
+	 * Reuse a previously destroyed environment list if there is one; its
+	 * hash keeps the bucket array sized for earlier requests.
+	 */
+	penv = LIST_FIRST(&interp->pi_env_free);
+	if (penv != NULL) {
+		LIST_REMOVE(penv, pe_link);
+		interp->pi_env_nfree--;
+	}
+	else {
+		penv = pperl_malloc(sizeof(*penv));
+		penv->pe_interp = interp;
+		penv->pe_envhash = newHV();
+	}
 	penv->pe_tainted = tainted;
 
 	if (envp == NULL)
@@ -102,8 +111,6 @@ pperl_env_new(perlinterp_t interp, bool tainted, int envc, const char **envp)
 
 	LIST_INSERT_HEAD(&interp->pi_env_head, penv, pe_link);
 
-	PERL_SET_CONTEXT(orig_perl);
-
 	return (penv);
 }
 
@@ -111,6 +118,9 @@ pperl_env_new(perlinterp_t interp, bool tainted, int envc, const char **envp)
 /*!
  * pperl_env_destroy() - Free all memory allocated to an environment list.
  *
+ *	A limited number of destroyed lists are kept, emptied but with their
+ *	hashes intact, to be handed out again by pperl_env_new().
+ *
  *	@param	penvp		Pointer to environment list to free.
  *
  *	@post	*penvp is set to NULL.
@@ -118,18 +128,61 @@ pperl_env_new(perlinterp_t interp, bool tainted, int envc, const char **envp)
 void
 pperl_env_destroy(perlenv_t *penvp)
 {
-	PerlInterpreter *orig_perl;
 	perlenv_t penv = *penvp;
-
-	orig_perl = PERL_GET_CONTEXT;
-	PERL_SET_CONTEXT(penv->pe_interp->pi_perl);
+	perlinterp_t interp = penv->pe_interp;
+	dTHXa(interp->pi_perl);
 
 	*penvp = NULL;
 	LIST_REMOVE(penv, pe_link);
+
+	if (interp->pi_env_nfree < PPERL_POOL_MAX) {
+		pperl_env_reset(penv);
+		LIST_INSERT_HEAD(&interp->pi_env_free, penv, pe_link);
+		interp->pi_env_nfree++;
+		return;
+	}
+
 	SvREFCNT_dec(penv->pe_envhash);
 	free(penv);
+}
+
+
+/*!
+ * pperl_env_reset() - Remove all variables from an environment list.
+ *
+ *	Lets an environment list be refilled for another request without
+ *	destroying and recreating it.  The hash's bucket array is kept, so
+ *	refilling it with a similar number of variables doesn't need to grow
+ *	it again.
+ *
+ *	@param	penv		Environment list to empty.
+ */
+void
+pperl_env_reset(perlenv_t penv)
+{
+	dTHXa(penv->pe_interp->pi_perl);
+
+	hv_clear(penv->pe_envhash);
+}
 
-	PERL_SET_CONTEXT(orig_perl);
+
+/*
+ * pperl_env_purge() - Free the environment lists kept for reuse.
+ *
+ *	Called by pperl_destroy().
+ */
+void
+pperl_env_purge(perlinterp_t interp)
+{
+	perlenv_t penv;
+	dTHXa(interp->pi_perl);
+
+	while ((penv = LIST_FIRST(&interp->pi_env_free)) != NULL) {
+		LIST_REMOVE(penv, pe_link);
+		SvREFCNT_dec(penv->pe_envhash);
+		free(penv);
+	}
+	interp->pi_env_nfree = 0;
 }
 
 
@@ -145,18 +198,13 @@ pperl_env_destroy(perlenv_t *penvp)
 void
 pperl_env_set(perlenv_t penv, const char *name, const char *value)
 {
-	PerlInterpreter *orig_perl;
 	SV *val_sv;
 	size_t namelen;
-
-	orig_perl = PERL_GET_CONTEXT;
-	PERL_SET_CONTEXT(penv->pe_interp->pi_perl);
+	dTHXa(penv->pe_interp->pi_perl);
 
 	namelen = strlen(name);
 	val_sv = newSVpv(value, 0);
 	hv_store(penv->pe_envhash, name, namelen, val_sv, 0);
-
-	PERL_SET_CONTEXT(orig_perl);
 }
 
 
@@ -228,23 +276,18 @@ pperl_env_setv(perlenv_t penv, const char *name, const char *fmt, va_list ap)
 const char *
 pperl_env_get(const perlenv_t penv, const char *name)
 {
-	PerlInterpreter *orig_perl;
 	SV **val_svp;
 	const char *result;
 	size_t namelen;
+	dTHXa(penv->pe_interp->pi_perl);
 
 	result = NULL;
 
-	orig_perl = PERL_GET_CONTEXT;
-	PERL_SET_CONTEXT(penv->pe_interp->pi_perl);
-
 	namelen = strlen(name);
 	val_svp = hv_fetch(penv->pe_envhash, name, namelen, 0);
 	if (val_svp != NULL)
 		result = SvPV_nolen(*val_svp);
 
-	PERL_SET_CONTEXT(orig_perl);
-
 	return (result);
 }
 
@@ -263,16 +306,42 @@ pperl_env_get(const perlenv_t penv, const char *name)
 void
 pperl_env_unset(perlenv_t penv, const char *name)
 {
-	PerlInterpreter *orig_perl;
 	size_t namelen;
-
-	orig_perl = PERL_GET_CONTEXT;
-	PERL_SET_CONTEXT(penv->pe_interp->pi_perl);
+	dTHXa(penv->pe_interp->pi_perl);
 
 	namelen = strlen(name);
 	hv_delete(penv->pe_envhash, name, namelen, G_DISCARD);
+}
+
+
+/*!
+ * pperl_env_detach() - Disconnect a new interpreter's \%ENV from environ.
+ *
+ *	Perl's \%ENV hash normally writes through to the process-wide
+ *	environ array, which several interpreters on different threads
+ *	cannot share.  Strip that magic so \%ENV becomes a plain hash owned
+ *	by the interpreter; pperl_env_populate() then only ever touches the
+ *	interpreter's own copy.
+ *
+ *	@note	Child processes started by perl code (system, exec, pipes)
+ *		inherit the process environment rather than \%ENV.  See
+ *		pperl_env_export() for code run by a zygote.
+ */
+void
+pperl_env_detach(pTHX)
+{
+	HV *envhash_hv;
+	HE *entry;
+
+	PL_envgv = gv_fetchpv("ENV", TRUE, SVt_PVHV);
+	GvMULTI_on(PL_envgv);
+	envhash_hv = GvHVn(PL_envgv);
+
+	sv_unmagic((SV *)envhash_hv, PERL_MAGIC_env);
 
-	PERL_SET_CONTEXT(orig_perl);
+	hv_iterinit(envhash_hv);
+	while ((entry = hv_iternext(envhash_hv)) != NULL)
+		sv_unmagic(HeVAL(entry), PERL_MAGIC_envelem);
 }
 
 
@@ -284,28 +353,21 @@ pperl_env_unset(perlenv_t penv, const char *name)
  *	Saves the original environment to be restored when LEAVE statement
  *	encountered.
  *
+ *	\%ENV was detached from environ when the interpreter was created
+ *	(see pperl_env_detach()), so this neither reads nor changes the
+ *	process environment and is safe with interpreters on other threads.
+ *
  *	@param	penv		Environment variable list to populate \%ENV
  *				from.  If NULL,  \%ENV is set to an empty hash.
  *
  *	@note	Must be called inside an ENTER/LEAVE block.
- *
- *	@warning
- *		Perl's \%ENV hash manipulates the global process environ
- *		variable directly.  While the original contents of environ
- *		are restored after the perl code is executed, this behavior
- *		precludes using an embedded perl interpreter in an threaded
- *		program if more than one thread may manipulate the global
- *		environ variable.  Blame perl.
  */
 void
-pperl_env_populate(perlenv_t penv)
+pperl_env_populate(pTHX_ perlenv_t penv)
 {
 	HV *envhash_hv;
 	HE *entry;
 	SV *val_sv;
-	char **newenviron;
-	int count;
-	int i;
 
 	/*
 	 * Ensure that perl's global PL_envgv pointer refers to the symbol
@@ -315,57 +377,14 @@ pperl_env_populate(perlenv_t penv)
 	GvMULTI_on(PL_envgv);		/* XXX May not be necessary. */
 
 	/*
-	 * If there is no environment to install, simply saving the original
-	 * %ENV hash will leave us with a localized empty %ENV hash.
-	 */
-	if (penv == NULL) {
-		save_hash(PL_envgv);
-		return;
-	}
-
-	/*
-	 * Make a copy of the original environment.  Perl will clear out the
-	 * global environ variable when it creates the empty local copy in
-	 * save_hash().  Technically, it would then refill it as we put
-	 * keys into the %ENV hash, but it does so fairly inefficiently.
-	 * Instead, we disable perl's %ENV magic so we can copy the environment
-	 * ourself and then renable the magic later.  Yes, perl really calls
-	 * it "magic".
-	 *
-	 * Note: If we ever implement the copy-on-dirty optimization described
-	 *	 in pperl_private.h, we can cache this copy of the environment
-	 *	 too.
-	 */
-	count = HvUSEDKEYS(GvHVn(PL_envgv)) + 1;
-	newenviron = pperl_malloc(count * sizeof(char *));
-	for (i = 0; i < count && environ[i] != NULL; i++) {
-		if (strchr(environ[i], '=') != NULL)
-			newenviron[i] = strdup(environ[i]);
-		else
-			asprintf(&newenviron[i], "%s=", environ[i]);
-
-		if (newenviron[i] == NULL)
-			pperl_fatal(EX_OSERR, "malloc: %m");
-	}
-	newenviron[i] = NULL;
-
-	/*
-	 * Localize %ENV.  This clears the global environ variable as a
-	 * side-effect.
+	 * Localize %ENV.  With its magic gone, this simply leaves us with an
+	 * empty hash; if there is no environment to install, we're done.
 	 */
 	envhash_hv = save_hash(PL_envgv);
+	if (penv == NULL)
+		return;
 
-	assert(penv->pe_interp->pi_perl == PERL_GET_CONTEXT);
-
-	/*
-	 * Clear perl's %ENV magic so it doesn't touch the global environ
-	 * array.  Install our newly-copied environment in place of the empty
-	 * one perl left us with.
-	 */
-	sv_unmagic((SV*)envhash_hv, PERL_MAGIC_env);
-
-	free(environ);
-	environ = newenviron;
+	assert(penv->pe_interp->pi_perl == aTHX);
 
 	/*
 	 * XXX It would be nice if we could do the equivilent of
@@ -386,10 +405,56 @@ pperl_env_populate(perlenv_t penv)
 		hv_store_flags(envhash_hv, HeKEY(entry), HeKLEN(entry),
 			       val_sv, HeHASH(entry), HeKFLAGS(entry));
 	}
+}
 
-	/*
-	 * Reinstate perl's %ENV magic so it can tinker with environ again.
-	 */
-	hv_magic(envhash_hv, Nullgv, PERL_MAGIC_env);
+
+/*!
+ * pperl_env_export() - Make an environment list the process environment.
+ *
+ *	Replaces environ with the contents of \a penv so that child processes
+ *	started by perl code see the same variables as \%ENV.  Only safe in a
+ *	process with no other threads, e.g. a child forked by a zygote.
+ *
+ *	@param	penv		Environment variable list to export; if NULL,
+ *				the environment is emptied.
+ */
+void
+pperl_env_export(perlenv_t penv)
+{
+	char **newenviron;
+	const char *key;
+	STRLEN keylen;
+	HE *entry;
+	I32 count;
+	int i;
+
+	if (penv == NULL) {
+		newenviron = pperl_malloc(sizeof(char *));
+		newenviron[0] = NULL;
+		environ = newenviron;
+		return;
+	}
+
+	{
+		dTHXa(penv->pe_interp->pi_perl);
+
+		count = HvUSEDKEYS(penv->pe_envhash);
+		newenviron = pperl_malloc((count + 1) * sizeof(char *));
+
+		i = 0;
+		hv_iterinit(penv->pe_envhash);
+		while ((entry = hv_iternext(penv->pe_envhash)) != NULL &&
+		       i < count) {
+			key = HePV(entry, keylen);
+			if (asprintf(&newenviron[i], "%.*s=%s", (int)keylen,
+				     key, SvPV_nolen(HeVAL(entry))) < 0)
+				pperl_fatal(EX_OSERR, "asprintf: %m");
+			i++;
+		}
+		newenviron[i] = NULL;
+	}
+
+	/* The old array may belong to libc, so it is leaked rather than freed. */
+	environ = newenviron;
 }
 
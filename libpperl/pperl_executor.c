@@ -0,0 +1,1026 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#ifdef HAVE_SYS_CPUSET_H
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef HAVE_PTHREAD_NP_H
+#include <pthread_np.h>
+#endif
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#ifdef HAVE_NUMA_H
+#include <numa.h>
+#endif
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*
+ * @struct perljob
+ *
+ * A request to run loaded code on one of an executor's worker threads.
+ * Since the job is built before it is known which interpreter will run it,
+ * it refers to the code by name and holds its arguments, environment, and
+ * input in an interpreter-independent request.
+ *
+ *	@param	pj_name		Name of the code to run; see pperl_code_find().
+ *
+ *	@param	pj_hash		Hash of \a pj_name, used to route the job to
+ *				a worker which recently ran the same code.
+ *
+ *	@param	pj_request	Arguments, environment, and input to run the
+ *				code with.
+ *
+ *	@param	pj_ondone	Callback to invoke on completion; NULL if the
+ *				submitter will wait for the job instead.
+ *
+ *	@param	pj_submitted	Clock reading when the job was queued.
+ *
+ *	@param	pj_wait_usec	Time the job spent queued, in microseconds.
+ *
+ *	@param	pj_result	Result of running the job; \a pperl_errmsg
+ *				points to \a pj_errmsg.
+ *
+ *	@param	pj_done		Set (under \a pj_lock) when the job completes.
+ */
+struct perljob {
+	char			 *pj_name;
+	uint32_t		  pj_hash;
+	perlrequest_t		  pj_request;
+
+	pperl_job_done_t	 *pj_ondone;
+	intptr_t		  pj_data;
+
+	uint64_t		  pj_submitted;
+	uint64_t		  pj_wait_usec;
+
+	struct perlresult	  pj_result;
+	char			 *pj_errmsg;
+
+	pthread_mutex_t		  pj_lock;
+	pthread_cond_t		  pj_cond;
+	bool			  pj_done;
+};
+
+
+/*
+ * Number of entries in an executor's table of which worker last ran each
+ * piece of code; must be a power of two.
+ */
+#define	EXECUTOR_HOTSIZE	256
+
+/*
+ * Number of jobs that may be queued for a worker before new jobs for code
+ * it recently ran are sent to a less busy worker instead.
+ */
+#define	EXECUTOR_HOTBACKLOG	2
+
+
+/*
+ * @struct pperl_worker
+ *
+ * A worker thread owned by an executor, along with its private interpreter
+ * and its own queue of jobs (its "shard").
+ *
+ *	@param	pw_cpu		CPU the thread is pinned to; -1 if it isn't.
+ *
+ *	@param	pw_node		NUMA node the interpreter's memory comes from;
+ *				-1 if unknown.
+ *
+ *	@param	pw_queue	Jobs routed to this worker.  Other workers
+ *				steal from it when they are idle.
+ *
+ *	@param	pw_pending	Posted whenever a job may be available to
+ *				this worker; it may be posted spuriously, so
+ *				a wakeup with nothing to do is not an error.
+ *
+ *	@param	pw_busy		Set while the worker is running a job.
+ *
+ *	@param	pw_started	Clock reading when the worker started.
+ */
+struct pperl_worker {
+	perlexecutor_t		 pw_executor;
+	pthread_t		 pw_thread;
+	int			 pw_index;
+	int			 pw_cpu;
+	int			 pw_node;
+	perlinterp_t		 pw_interp;
+	bool			 pw_ready;
+
+	struct pperl_queue	*pw_queue;
+	sem_t			 pw_pending;
+	volatile bool		 pw_busy;
+
+	uint64_t		 pw_started;
+	volatile uint64_t	 pw_jobs;
+	volatile uint64_t	 pw_hot;
+	volatile uint64_t	 pw_stolen;
+	volatile uint64_t	 pw_busy_usec;
+};
+
+
+/*
+ * @struct perlexecutor
+ *
+ * Pool of worker threads, each with its own interpreter and job queue.
+ *
+ *	@param	pex_hot		Which worker most recently ran each piece of
+ *				code, indexed by the low bits of the code's
+ *				name hash.  Each entry holds the full hash in
+ *				its upper 32 bits and the worker index in its
+ *				lower 32 bits, so it can be updated with a
+ *				single atomic store.
+ *
+ *	@param	pex_next	Rotates the worker the least-loaded search
+ *				starts from, so ties are spread evenly.
+ *
+ *	@param	pex_started	Posted by each worker once its interpreter
+ *				has been initialized.
+ *
+ *	@param	pex_shutdown	Set when the executor is being destroyed.
+ *
+ *	@param	pex_submitting	Number of pperl_executor_submit() calls in
+ *				progress; the executor is not torn down until
+ *				it drops to zero.
+ *
+ *	@param	pex_maxwait	Jobs queued longer than this many microseconds
+ *				are shed rather than run; zero if never.
+ */
+struct perlexecutor {
+	volatile uint64_t	 pex_hot[EXECUTOR_HOTSIZE];
+	volatile u_int		 pex_next;
+	sem_t			 pex_started;
+	volatile bool		 pex_shutdown;
+	volatile u_int		 pex_submitting;
+
+	char			*pex_procname;
+	enum pperl_newflags	 pex_flags;
+	pperl_worker_init_t	*pex_oninit;
+	intptr_t		 pex_data;
+
+	struct pperl_worker	*pex_workers;
+	int			 pex_nworkers;
+
+	volatile uint64_t	 pex_maxwait;
+
+	volatile uint64_t	 pex_submitted;
+	volatile uint64_t	 pex_rejected;
+	volatile uint64_t	 pex_shed;
+	volatile uint64_t	 pex_completed;
+	volatile uint64_t	 pex_wait_usec;
+	volatile uint64_t	 pex_wait_max_usec;
+};
+
+
+/*
+ * Perl's interpreter construction and destruction are not thread-safe, so
+ * workers take turns creating and destroying their interpreters.
+ */
+static pthread_mutex_t	 pperl_executor_newlock = PTHREAD_MUTEX_INITIALIZER;
+
+static perlexecutor_t	 pperl_executor_create(const char *procname,
+					       enum pperl_newflags flags,
+					       const int *cpus, bool pin,
+					       int nworkers, int depth,
+					       pperl_worker_init_t *oninit,
+					       intptr_t data);
+static int		 pperl_executor_enqueue(perlexecutor_t pex,
+						perljob_t job);
+static void		*pperl_worker_main(void *arg);
+static void		 pperl_worker_pin(struct pperl_worker *pw);
+static perljob_t	 pperl_worker_next(struct pperl_worker *pw);
+static void		 pperl_worker_run(struct pperl_worker *pw,
+					  perljob_t job);
+static void		 pperl_job_complete(perlexecutor_t pex, perljob_t job,
+					    const struct perlresult *result);
+
+
+/*!
+ * pperl_executor_new() - Create a pool of worker threads to run code on.
+ *
+ *	Each worker thread creates its own interpreter and then calls the
+ *	\a oninit callback to load whatever code it should be able to run
+ *	(typically via pperl_load_file()).  Each worker has its own queue of
+ *	jobs; submitted jobs are routed to a worker which recently ran the
+ *	same code if it isn't backed up, and otherwise to the least busy
+ *	worker.  Idle workers take jobs from busier workers' queues, so
+ *	since any worker may run any job, every worker should load the same
+ *	code.
+ *
+ *	Requires a perl built with support for multiple interpreters
+ *	(-Dusemultiplicity or -Duseithreads).
+ *
+ *	@param	procname	Process name passed to pperl_new() for each
+ *				worker's interpreter.
+ *
+ *	@param	flags		Flags passed to pperl_new() for each worker's
+ *				interpreter.
+ *
+ *	@param	nworkers	Number of worker threads; typically the number
+ *				of CPUs.
+ *
+ *	@param	depth		Maximum number of jobs which may be queued
+ *				waiting for a worker, shared out evenly between
+ *				the workers' queues; once every queue is full,
+ *				further submissions are rejected.
+ *
+ *	@param	oninit		Callback invoked on each worker thread with
+ *				its interpreter and worker index (0 through
+ *				\a nworkers - 1) to load code.  Returning false
+ *				indicates a failure.
+ *
+ *	@param	data		Opaque data passed to \a oninit.
+ *
+ *	@return	New executor, or NULL if any worker failed to initialize.
+ */
+perlexecutor_t
+pperl_executor_new(const char *procname, enum pperl_newflags flags,
+		   int nworkers, int depth, pperl_worker_init_t *oninit,
+		   intptr_t data)
+{
+
+	return (pperl_executor_create(procname, flags, NULL, false,
+				      nworkers, depth, oninit, data));
+}
+
+
+/*!
+ * pperl_executor_new_pinned() - Create a pool of worker threads, each pinned
+ *				 to its own CPU.
+ *
+ *	Like pperl_executor_new(), except that each worker thread is bound to
+ *	a CPU before it creates its interpreter, so the interpreter's memory
+ *	stays in that CPU's caches and, where memory is local to a NUMA node,
+ *	is allocated from that CPU's node.  Where libnuma is available the
+ *	node is requested explicitly; otherwise the operating system's
+ *	first-touch placement has the same effect.
+ *
+ *	If the platform cannot pin threads, a warning is logged and the
+ *	workers run unpinned.
+ *
+ *	@param	cpus		Array of \a nworkers CPU numbers; worker i is
+ *				pinned to cpus[i].  If NULL, worker i is pinned
+ *				to CPU i.
+ *
+ *	See pperl_executor_new() for the remaining parameters.
+ */
+perlexecutor_t
+pperl_executor_new_pinned(const char *procname, enum pperl_newflags flags,
+			  const int *cpus, int nworkers, int depth,
+			  pperl_worker_init_t *oninit, intptr_t data)
+{
+
+	return (pperl_executor_create(procname, flags, cpus, true,
+				      nworkers, depth, oninit, data));
+}
+
+
+/*
+ * pperl_executor_create() - Common code for pperl_executor_new() and
+ *			     pperl_executor_new_pinned().
+ */
+perlexecutor_t
+pperl_executor_create(const char *procname, enum pperl_newflags flags,
+		      const int *cpus, bool pin, int nworkers, int depth,
+		      pperl_worker_init_t *oninit, intptr_t data)
+{
+	perlexecutor_t pex;
+	struct pperl_worker *pw;
+	bool ok;
+	int error;
+	int i;
+
+	assert(nworkers > 0);
+	assert(depth > 0);
+
+	pex = pperl_malloc(sizeof(*pex));
+	memset(pex, 0, sizeof(*pex));
+
+	if (sem_init(&pex->pex_started, 0, 0) < 0)
+		pperl_fatal(EX_OSERR, "sem_init: %m");
+
+	pex->pex_procname = pperl_strdup(procname);
+	pex->pex_flags = flags;
+	pex->pex_oninit = oninit;
+	pex->pex_data = data;
+
+	pex->pex_workers = pperl_malloc(nworkers * sizeof(*pex->pex_workers));
+	memset(pex->pex_workers, 0, nworkers * sizeof(*pex->pex_workers));
+
+	for (i = 0; i < nworkers; i++) {
+		pw = &pex->pex_workers[i];
+		pw->pw_executor = pex;
+		pw->pw_index = i;
+		pw->pw_cpu = !pin ? -1 : cpus != NULL ? cpus[i] : i;
+		pw->pw_node = -1;
+		pw->pw_queue = pperl_queue_new((depth + nworkers - 1) /
+					       nworkers);
+		if (sem_init(&pw->pw_pending, 0, 0) < 0)
+			pperl_fatal(EX_OSERR, "sem_init: %m");
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		pw = &pex->pex_workers[i];
+		error = pthread_create(&pw->pw_thread, NULL,
+				       pperl_worker_main, pw);
+		if (error != 0) {
+			errno = error;
+			pperl_fatal(EX_OSERR, "pthread_create: %m");
+		}
+		pex->pex_nworkers++;
+	}
+
+	/* Wait for all workers to finish initializing. */
+	ok = true;
+	for (i = 0; i < nworkers; i++) {
+		while (sem_wait(&pex->pex_started) < 0 && errno == EINTR)
+			continue;
+	}
+	for (i = 0; i < nworkers; i++)
+		ok &= pex->pex_workers[i].pw_ready;
+
+	if (!ok) {
+		pperl_log(LOG_ERR, "failed to initialize executor workers");
+		pperl_executor_destroy(&pex);
+		return (NULL);
+	}
+
+	return (pex);
+}
+
+
+/*!
+ * pperl_executor_destroy() - Shut down an executor.
+ *
+ *	Stops accepting new jobs, waits for the workers to finish all jobs
+ *	already queued, and then destroys the workers' interpreters.  A job
+ *	submitted concurrently with this call is either run, completed with
+ *	a pperl_errno of ECANCELED, or rejected with ESHUTDOWN; but no call
+ *	to pperl_executor_submit() may begin once this call has returned.
+ *
+ *	@param	pexp		Pointer to executor to destroy.
+ *
+ *	@post	*pexp is set to NULL.
+ */
+void
+pperl_executor_destroy(perlexecutor_t *pexp)
+{
+	perlexecutor_t pex = *pexp;
+	struct pperl_worker *pw;
+	struct perlresult result;
+	perljob_t job;
+	int i;
+
+	*pexp = NULL;
+
+	pex->pex_shutdown = true;
+	__sync_synchronize();
+
+	/*
+	 * Submitters which missed the flag may still be queueing jobs and
+	 * posting to the workers' semaphores; wait for them to finish.
+	 */
+	while (pex->pex_submitting != 0)
+		usleep(1000);
+
+	for (i = 0; i < pex->pex_nworkers; i++)
+		sem_post(&pex->pex_workers[i].pw_pending);
+	for (i = 0; i < pex->pex_nworkers; i++)
+		pthread_join(pex->pex_workers[i].pw_thread, NULL);
+
+	/*
+	 * A job submitted concurrently may have been queued after its
+	 * worker last looked; complete any such stragglers as cancelled.
+	 */
+	for (i = 0; i < pex->pex_nworkers; i++) {
+		pw = &pex->pex_workers[i];
+		while ((job = pperl_queue_pop(pw->pw_queue)) != NULL) {
+			pperl_result_clear(&result);
+			result.pperl_errno = ECANCELED;
+			result.pperl_errmsg = strerror(ECANCELED);
+			pperl_job_complete(pex, job, &result);
+		}
+		pperl_queue_free(pw->pw_queue);
+		sem_destroy(&pw->pw_pending);
+	}
+	sem_destroy(&pex->pex_started);
+
+	free(pex->pex_workers);
+	free(pex->pex_procname);
+	free(pex);
+}
+
+
+/*!
+ * pperl_executor_shed() - Configure load shedding.
+ *
+ *	When workers fall behind, jobs which have already waited too long
+ *	are unlikely to be useful to anyone by the time they run.  Once a
+ *	limit is set, a worker which dequeues a job that has been queued
+ *	longer than the limit completes it immediately with a pperl_errno
+ *	of ETIMEDOUT instead of running it, letting the backlog drain.
+ *
+ *	@param	pex		Executor to configure.
+ *
+ *	@param	maxwait_usec	Longest a job may be queued, in microseconds;
+ *				zero to run every job regardless of how long
+ *				it waited.
+ */
+void
+pperl_executor_shed(perlexecutor_t pex, uint64_t maxwait_usec)
+{
+
+	pex->pex_maxwait = maxwait_usec;
+}
+
+
+/*!
+ * pperl_executor_submit() - Queue a job for execution.
+ *
+ *	The job is queued for the worker which most recently ran the same
+ *	code, as its interpreter is most likely to still have that code's
+ *	data in cache, unless that worker already has a backlog; in that
+ *	case, or if no worker has run the code recently, the job goes to
+ *	the worker with the fewest jobs outstanding.
+ *
+ *	Submission never blocks: if every worker's queue is full, the job is
+ *	rejected so the caller can shed load (e.g. by responding "503 Service
+ *	Unavailable").
+ *
+ *	@param	pex		Executor to run the job.
+ *
+ *	@param	job		Job to run.  The job must not be modified until
+ *				it completes.
+ *
+ *	@param	ondone		If non-NULL, invoked on the worker thread when
+ *				the job completes (the job may be freed from
+ *				within the callback).  If NULL, the caller must
+ *				collect the result with pperl_job_wait().
+ *
+ *	@param	data		Opaque data passed to \a ondone.
+ *
+ *	@return	Zero if the job was queued; EAGAIN if the queues are full or
+ *		ESHUTDOWN if the executor is being destroyed.
+ */
+int
+pperl_executor_submit(perlexecutor_t pex, perljob_t job,
+		      pperl_job_done_t *ondone, intptr_t data)
+{
+	int error;
+
+	/*
+	 * Announce the submission before checking for shutdown, so that
+	 * pperl_executor_destroy() either sees it and waits, or we see the
+	 * flag and back out; both operations are full barriers.
+	 */
+	__sync_fetch_and_add(&pex->pex_submitting, 1);
+	if (pex->pex_shutdown) {
+		__sync_fetch_and_sub(&pex->pex_submitting, 1);
+		return (ESHUTDOWN);
+	}
+
+	job->pj_ondone = ondone;
+	job->pj_data = data;
+	job->pj_done = false;
+	job->pj_wait_usec = 0;
+	job->pj_submitted = pperl_clock();
+
+	error = pperl_executor_enqueue(pex, job);
+
+	/* The executor may be freed as soon as this is decremented. */
+	__sync_fetch_and_sub(&pex->pex_submitting, 1);
+
+	return (error);
+}
+
+
+/*
+ * pperl_executor_enqueue() - Queue a job on the most suitable worker.
+ */
+int
+pperl_executor_enqueue(perlexecutor_t pex, perljob_t job)
+{
+	struct pperl_worker *pw, *target;
+	uint64_t hot;
+	u_int load, minload;
+	int first, i;
+
+	/* Prefer the worker which last ran this code, if it can keep up. */
+	target = NULL;
+	hot = pex->pex_hot[job->pj_hash & (EXECUTOR_HOTSIZE - 1)];
+	if ((uint32_t)(hot >> 32) == job->pj_hash &&
+	    (int)(uint32_t)hot < pex->pex_nworkers) {
+		pw = &pex->pex_workers[(uint32_t)hot];
+		if (pperl_queue_depth(pw->pw_queue) +
+		    (pw->pw_busy ? 1 : 0) <= EXECUTOR_HOTBACKLOG &&
+		    pperl_queue_push(pw->pw_queue, job)) {
+			__sync_fetch_and_add(&pw->pw_hot, 1);
+			target = pw;
+		}
+	}
+
+	/* Otherwise, find the least busy worker. */
+	if (target == NULL) {
+		first = __sync_fetch_and_add(&pex->pex_next, 1) %
+			pex->pex_nworkers;
+		minload = UINT_MAX;
+		for (i = 0; i < pex->pex_nworkers; i++) {
+			pw = &pex->pex_workers[(first + i) % pex->pex_nworkers];
+			load = pperl_queue_depth(pw->pw_queue) +
+			       (pw->pw_busy ? 1 : 0);
+			if (load < minload) {
+				minload = load;
+				target = pw;
+				if (load == 0)
+					break;
+			}
+		}
+		if (!pperl_queue_push(target->pw_queue, job)) {
+			/* It filled up meanwhile; take any room left. */
+			target = NULL;
+			for (i = 0; i < pex->pex_nworkers; i++) {
+				pw = &pex->pex_workers[i];
+				if (pperl_queue_push(pw->pw_queue, job)) {
+					target = pw;
+					break;
+				}
+			}
+		}
+	}
+
+	if (target == NULL) {
+		__sync_fetch_and_add(&pex->pex_rejected, 1);
+		return (EAGAIN);
+	}
+
+	__sync_fetch_and_add(&pex->pex_submitted, 1);
+	sem_post(&target->pw_pending);
+
+	/*
+	 * If the worker is in the middle of another job, wake an idle
+	 * worker so it can steal the job rather than leave it waiting.
+	 */
+	if (target->pw_busy) {
+		for (i = 0; i < pex->pex_nworkers; i++) {
+			pw = &pex->pex_workers[i];
+			if (!pw->pw_busy &&
+			    pperl_queue_depth(pw->pw_queue) == 0) {
+				sem_post(&pw->pw_pending);
+				break;
+			}
+		}
+	}
+
+	return (0);
+}
+
+
+/*!
+ * pperl_executor_stats() - Report executor statistics.
+ *
+ *	@param	pex		Executor to report on.
+ *
+ *	@param	stats		Populated with a snapshot of the executor's
+ *				counters.
+ */
+void
+pperl_executor_stats(perlexecutor_t pex, struct pperl_executor_stats *stats)
+{
+	int i;
+
+	stats->pes_workers = pex->pex_nworkers;
+	stats->pes_depth = 0;
+	for (i = 0; i < pex->pex_nworkers; i++)
+		stats->pes_depth +=
+		    pperl_queue_depth(pex->pex_workers[i].pw_queue);
+	stats->pes_submitted = pex->pex_submitted;
+	stats->pes_rejected = pex->pex_rejected;
+	stats->pes_shed = pex->pex_shed;
+	stats->pes_completed = pex->pex_completed;
+	stats->pes_wait_usec = pex->pex_wait_usec;
+	stats->pes_wait_max_usec = pex->pex_wait_max_usec;
+}
+
+
+/*!
+ * pperl_executor_shard_stats() - Report per-worker statistics.
+ *
+ *	@param	pex		Executor to report on.
+ *
+ *	@param	stats		Array populated with a snapshot of each
+ *				worker's counters, in worker index order.
+ *
+ *	@param	nstats		Number of entries in \a stats; if less than
+ *				the number of workers, only the first
+ *				\a nstats workers are reported.
+ *
+ *	@return	Number of workers in the executor.
+ */
+int
+pperl_executor_shard_stats(perlexecutor_t pex, struct pperl_shard_stats *stats,
+			   int nstats)
+{
+	struct pperl_worker *pw;
+	uint64_t now;
+	int i;
+
+	now = pperl_clock();
+	for (i = 0; i < nstats && i < pex->pex_nworkers; i++) {
+		pw = &pex->pex_workers[i];
+		stats[i].pss_cpu = pw->pw_cpu;
+		stats[i].pss_node = pw->pw_node;
+		stats[i].pss_depth = pperl_queue_depth(pw->pw_queue);
+		stats[i].pss_jobs = pw->pw_jobs;
+		stats[i].pss_hot = pw->pw_hot;
+		stats[i].pss_stolen = pw->pw_stolen;
+		stats[i].pss_busy_usec = pw->pw_busy_usec;
+		stats[i].pss_uptime_usec = now - pw->pw_started;
+	}
+
+	return (pex->pex_nworkers);
+}
+
+
+/*!
+ * pperl_job_new() - Create a job to run loaded code on an executor.
+ *
+ *	@param	name		Name the code was loaded with in the workers'
+ *				interpreters.
+ *
+ *	@return	New job with empty argument and environment lists.
+ */
+perljob_t
+pperl_job_new(const char *name)
+{
+	perljob_t job;
+
+	job = pperl_malloc(sizeof(*job));
+	memset(job, 0, sizeof(*job));
+	job->pj_name = pperl_strdup(name);
+	job->pj_hash = pperl_registry_hash(name);
+	job->pj_request = pperl_request_new(false);
+	pthread_mutex_init(&job->pj_lock, NULL);
+	pthread_cond_init(&job->pj_cond, NULL);
+
+	return (job);
+}
+
+
+/*!
+ * pperl_job_arg() - Append an argument to a job's \@ARGV list.
+ */
+void
+pperl_job_arg(perljob_t job, const char *arg)
+{
+
+	pperl_request_arg(job->pj_request, arg);
+}
+
+
+/*!
+ * pperl_job_env() - Add a variable to a job's \%ENV hash.
+ */
+void
+pperl_job_env(perljob_t job, const char *name, const char *value)
+{
+
+	pperl_request_env(job->pj_request, name, value);
+}
+
+
+/*!
+ * pperl_job_stdin() - Append data to a job's standard input.
+ *
+ *	See pperl_request_stdin().
+ */
+void
+pperl_job_stdin(perljob_t job, const void *buf, size_t len)
+{
+
+	pperl_request_stdin(job->pj_request, buf, len);
+}
+
+
+/*!
+ * pperl_job_wait() - Wait for a job to complete.
+ *
+ *	Only for jobs submitted without a completion callback.
+ *
+ *	@param	job		Job to wait for.
+ *
+ *	@param	result		If non-NULL, populated with the result of
+ *				running the job.  The error message, if any,
+ *				remains valid until the job is freed.
+ */
+void
+pperl_job_wait(perljob_t job, struct perlresult *result)
+{
+
+	assert(job->pj_ondone == NULL);
+
+	pthread_mutex_lock(&job->pj_lock);
+	while (!job->pj_done)
+		pthread_cond_wait(&job->pj_cond, &job->pj_lock);
+	pthread_mutex_unlock(&job->pj_lock);
+
+	if (result != NULL)
+		*result = job->pj_result;
+}
+
+
+/*!
+ * pperl_job_wait_usec() - Report how long a completed job was queued.
+ *
+ *	@return	Microseconds between submission and a worker picking up the
+ *		job.
+ */
+uint64_t
+pperl_job_wait_usec(const perljob_t job)
+{
+
+	return (job->pj_wait_usec);
+}
+
+
+/*!
+ * pperl_job_free() - Free a job.
+ *
+ *	@param	jobp		Pointer to job to free; the job must not be
+ *				queued or running.
+ *
+ *	@post	*jobp is set to NULL.
+ */
+void
+pperl_job_free(perljob_t *jobp)
+{
+	perljob_t job = *jobp;
+
+	*jobp = NULL;
+
+	pperl_request_free(&job->pj_request);
+	free(job->pj_errmsg);
+	free(job->pj_name);
+	pthread_mutex_destroy(&job->pj_lock);
+	pthread_cond_destroy(&job->pj_cond);
+	free(job);
+}
+
+
+/*
+ * pperl_worker_main() - Worker thread body.
+ */
+void *
+pperl_worker_main(void *arg)
+{
+	struct pperl_worker *pw = arg;
+	perlexecutor_t pex = pw->pw_executor;
+	perljob_t job;
+	uint64_t start;
+
+	/* Pin before creating the interpreter so its memory is local. */
+	if (pw->pw_cpu >= 0)
+		pperl_worker_pin(pw);
+	pw->pw_started = pperl_clock();
+
+	pthread_mutex_lock(&pperl_executor_newlock);
+	pw->pw_interp = pperl_new(pex->pex_procname, pex->pex_flags);
+	pthread_mutex_unlock(&pperl_executor_newlock);
+
+	pw->pw_ready = pex->pex_oninit == NULL ||
+		       pex->pex_oninit(pw->pw_interp, pw->pw_index,
+				       pex->pex_data);
+	sem_post(&pex->pex_started);
+
+	while (pw->pw_ready) {
+		while (sem_wait(&pw->pw_pending) < 0 && errno == EINTR)
+			continue;
+
+		while ((job = pperl_worker_next(pw)) != NULL) {
+			pw->pw_busy = true;
+			start = pperl_clock();
+			pperl_worker_run(pw, job);
+			__sync_fetch_and_add(&pw->pw_busy_usec,
+					     pperl_clock() - start);
+			__sync_fetch_and_add(&pw->pw_jobs, 1);
+			pw->pw_busy = false;
+		}
+
+		/*
+		 * Every queue was empty, so unless pperl_executor_destroy()
+		 * woke us there is nothing to do but wait for the next job.
+		 */
+		if (pex->pex_shutdown)
+			break;
+	}
+
+	pthread_mutex_lock(&pperl_executor_newlock);
+	pperl_destroy(&pw->pw_interp);
+	pthread_mutex_unlock(&pperl_executor_newlock);
+
+	return (NULL);
+}
+
+
+/*
+ * pperl_worker_next() - Find the next job for a worker to run.
+ *
+ *	Takes from the worker's own queue first, then steals from the other
+ *	workers' queues, starting with the next worker along so that
+ *	stealing is spread across the pool.
+ */
+perljob_t
+pperl_worker_next(struct pperl_worker *pw)
+{
+	perlexecutor_t pex = pw->pw_executor;
+	struct pperl_worker *victim;
+	perljob_t job;
+	int i;
+
+	job = pperl_queue_pop(pw->pw_queue);
+	if (job != NULL)
+		return (job);
+
+	for (i = 1; i < pex->pex_nworkers; i++) {
+		victim = &pex->pex_workers[(pw->pw_index + i) %
+					   pex->pex_nworkers];
+		job = pperl_queue_pop(victim->pw_queue);
+		if (job != NULL) {
+			__sync_fetch_and_add(&pw->pw_stolen, 1);
+			return (job);
+		}
+	}
+
+	return (NULL);
+}
+
+
+/*
+ * pperl_worker_pin() - Bind a worker thread to its CPU.
+ *
+ *	Also arranges for the thread's memory to come from the CPU's NUMA
+ *	node.  With libnuma this is requested explicitly; without it, the
+ *	thread relies on the operating system placing pages on the node of
+ *	the CPU which first touches them, which pinning guarantees.  On
+ *	failure, logs a warning and leaves the thread unpinned.
+ */
+void
+pperl_worker_pin(struct pperl_worker *pw)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#ifdef HAVE_SYS_CPUSET_H
+	cpuset_t mask;
+#else
+	cpu_set_t mask;
+#endif
+	int error;
+
+	CPU_ZERO(&mask);
+	CPU_SET(pw->pw_cpu, &mask);
+	error = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+	if (error != 0) {
+		errno = error;
+		pperl_log(LOG_WARNING, "failed to pin worker %d to CPU %d: %m",
+			  pw->pw_index, pw->pw_cpu);
+		pw->pw_cpu = -1;
+		return;
+	}
+
+#ifdef HAVE_NUMA_H
+	if (numa_available() >= 0) {
+		pw->pw_node = numa_node_of_cpu(pw->pw_cpu);
+		if (pw->pw_node >= 0)
+			numa_set_preferred(pw->pw_node);
+	}
+#endif
+#else
+	pperl_log(LOG_WARNING, "pinning threads to CPUs is not supported");
+	pw->pw_cpu = -1;
+#endif
+}
+
+
+/*
+ * pperl_worker_run() - Run a single job in a worker's interpreter.
+ */
+void
+pperl_worker_run(struct pperl_worker *pw, perljob_t job)
+{
+	perlexecutor_t pex = pw->pw_executor;
+	struct perlresult result;
+	perlcode_t pc;
+	uint64_t wait, max;
+
+	/* Account for the time the job spent queued. */
+	wait = pperl_clock() - job->pj_submitted;
+	job->pj_wait_usec = wait;
+	__sync_fetch_and_add(&pex->pex_wait_usec, wait);
+	do {
+		max = pex->pex_wait_max_usec;
+	} while (wait > max &&
+		 !__sync_bool_compare_and_swap(&pex->pex_wait_max_usec,
+					       max, wait));
+
+	if (pex->pex_maxwait != 0 && wait > pex->pex_maxwait) {
+		__sync_fetch_and_add(&pex->pex_shed, 1);
+		pperl_result_clear(&result);
+		pperl_seterr(pw->pw_interp, ETIMEDOUT, &result);
+		pperl_job_complete(pex, job, &result);
+		return;
+	}
+
+	pc = pperl_code_find(pw->pw_interp, job->pj_name);
+	if (pc == NULL) {
+		pperl_log(LOG_ERR, "executor job for unknown code %s",
+			  job->pj_name);
+		pperl_result_clear(&result);
+		pperl_seterr(pw->pw_interp, ENOENT, &result);
+		pperl_job_complete(pex, job, &result);
+		return;
+	}
+
+	pperl_request_run(pc, job->pj_request, &result);
+
+	/* Remember that this code is now hot in this worker. */
+	__sync_lock_test_and_set(&pex->pex_hot[job->pj_hash &
+					       (EXECUTOR_HOTSIZE - 1)],
+				 (uint64_t)job->pj_hash << 32 | pw->pw_index);
+
+	pperl_job_complete(pex, job, &result);
+}
+
+
+/*
+ * pperl_job_complete() - Record a job's result and notify the submitter.
+ *
+ *	The result's error message refers to storage in the interpreter (or
+ *	static storage); it is copied so it stays valid after the worker
+ *	moves on to the next job.
+ */
+void
+pperl_job_complete(perlexecutor_t pex, perljob_t job,
+		   const struct perlresult *result)
+{
+
+	__sync_fetch_and_add(&pex->pex_completed, 1);
+
+	job->pj_result = *result;
+	free(job->pj_errmsg);
+	job->pj_errmsg = NULL;
+	if (result->pperl_errmsg != NULL) {
+		job->pj_errmsg = pperl_strdup(result->pperl_errmsg);
+		job->pj_result.pperl_errmsg = job->pj_errmsg;
+	}
+
+	if (job->pj_ondone != NULL) {
+		job->pj_ondone(job, &job->pj_result, job->pj_data);
+		return;
+	}
+
+	pthread_mutex_lock(&job->pj_lock);
+	job->pj_done = true;
+	pthread_cond_signal(&job->pj_cond);
+	pthread_mutex_unlock(&job->pj_lock);
+}
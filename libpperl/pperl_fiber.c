@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/* Stack size used for fibers when the caller doesn't specify one. */
+#define	FIBER_STACKSIZE		(1024 * 1024)
+
+
+/*
+ * @struct perlfiber
+ *
+ * A single pperl_run() executing on its own stack so that it can be
+ * suspended when an I/O callback would block.
+ *
+ *	@param	pf_pc, pf_pargs, pf_penv
+ *				Arguments to pperl_run().
+ *
+ *	@param	pf_result	Result of the run, once complete.
+ *
+ *	@param	pf_context	Saved machine context of the fiber while it is
+ *				parked.
+ *
+ *	@param	pf_caller	Saved machine context of whoever last resumed
+ *				the fiber.
+ *
+ *	@param	pf_perl		Perl context current when the fiber parked.
+ *
+ *	@param	pf_stack	Fiber's stack, including a guard page.
+ *
+ *	@param	pf_stacksize	Size of \a pf_stack in bytes.
+ *
+ *	@param	pf_started	Set once the fiber has first been resumed.
+ *
+ *	@param	pf_inside	Set while the fiber is executing, i.e. from
+ *				pperl_fiber_resume() until it parks or
+ *				completes.
+ *
+ *	@param	pf_done		Set once pperl_run() has returned.
+ *
+ *	@param	pf_abort	Set when the fiber is being destroyed; I/O
+ *				callbacks which would block fail instead.
+ */
+struct perlfiber {
+	perlcode_t		 pf_pc;
+	perlargs_t		 pf_pargs;
+	perlenv_t		 pf_penv;
+	struct perlresult	 pf_result;
+
+	ucontext_t		 pf_context;
+	ucontext_t		 pf_caller;
+	PerlInterpreter		*pf_perl;
+
+	void			*pf_stack;
+	size_t			 pf_stacksize;
+
+	bool			 pf_started;
+	bool			 pf_inside;
+	bool			 pf_done;
+	bool			 pf_abort;
+};
+
+
+static void	 pperl_fiber_main(int hi, int lo);
+
+
+/*!
+ * pperl_fiber_new() - Prepare to run code on its own stack.
+ *
+ *	Creates a fiber which, when resumed, calls pperl_run() with the given
+ *	arguments.  While the code runs, any I/O callback registered with
+ *	pperl_io_override() may return PPERL_IO_WOULDBLOCK; the fiber then
+ *	parks, pperl_fiber_resume() returns PPERL_FIBER_BLOCKED, and the
+ *	application can go on to resume other fibers (in other interpreters)
+ *	until the I/O is ready.  Resuming the fiber retries the callback.
+ *	This lets a single thread interleave runs in many interpreters.
+ *
+ *	Only one fiber may be active in an interpreter at a time as perl's
+ *	own stacks belong to the interpreter rather than the fiber.  For the
+ *	same reason, while the fiber is parked, pperl_run(), pperl_call(),
+ *	and the like refuse to run code in the interpreter (failing with
+ *	EBUSY).  Code run other than by the fiber cannot park; an I/O
+ *	callback which would block then fails with EAGAIN.
+ *
+ *	@param	pc		Code to run.
+ *
+ *	@param	pargs		Argument list; see pperl_run().
+ *
+ *	@param	penv		Environment variable list; see pperl_run().
+ *
+ *	@param	stacksize	Size of the fiber's stack in bytes, or zero for
+ *				the default.
+ *
+ *	@return	New fiber, or NULL with errno set if the interpreter already
+ *		has an active fiber (EBUSY) or the stack couldn't be allocated.
+ */
+perlfiber_t
+pperl_fiber_new(perlcode_t pc, perlargs_t pargs, perlenv_t penv,
+		size_t stacksize)
+{
+	perlinterp_t interp = pc->pc_interp;
+	perlfiber_t fiber;
+	uintptr_t addr;
+	size_t pagesize;
+	void *stack;
+
+	if (interp->pi_fiber != NULL) {
+		errno = EBUSY;
+		return (NULL);
+	}
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (stacksize == 0)
+		stacksize = FIBER_STACKSIZE;
+	stacksize = (stacksize + pagesize - 1) & ~(pagesize - 1);
+
+	/*
+	 * Allocate the stack with an inaccessible guard page below it, so
+	 * overflowing the stack faults rather than silently corrupting
+	 * memory.
+	 */
+	stack = mmap(NULL, stacksize + pagesize, PROT_READ|PROT_WRITE,
+		     MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (stack == MAP_FAILED) {
+		pperl_log(LOG_ERR, "failed to allocate fiber stack: %m");
+		return (NULL);
+	}
+	mprotect(stack, pagesize, PROT_NONE);
+
+	fiber = pperl_malloc(sizeof(*fiber));
+	memset(fiber, 0, sizeof(*fiber));
+	fiber->pf_pc = pc;
+	fiber->pf_pargs = pargs;
+	fiber->pf_penv = penv;
+	fiber->pf_stack = stack;
+	fiber->pf_stacksize = stacksize + pagesize;
+
+	if (getcontext(&fiber->pf_context) < 0)
+		pperl_fatal(EX_OSERR, "getcontext: %m");
+	fiber->pf_context.uc_stack.ss_sp = (char *)stack + pagesize;
+	fiber->pf_context.uc_stack.ss_size = stacksize;
+	fiber->pf_context.uc_link = &fiber->pf_caller;
+
+	/*
+	 * makecontext(3) only passes int arguments, so split the fiber's
+	 * address into two halves.
+	 */
+	addr = (uintptr_t)fiber;
+	makecontext(&fiber->pf_context, (void (*)(void))pperl_fiber_main, 2,
+		    (int)(addr >> 16 >> 16), (int)(addr & 0xffffffffU));
+
+	interp->pi_fiber = fiber;
+
+	return (fiber);
+}
+
+
+/*!
+ * pperl_fiber_resume() - Run a fiber until it completes or blocks.
+ *
+ *	@param	fiber		Fiber to resume.
+ *
+ *	@param	result		If non-NULL and the fiber completed, populated
+ *				with the result of pperl_run().
+ *
+ *	@return	PPERL_FIBER_DONE if the code finished running, or
+ *		PPERL_FIBER_BLOCKED if it is waiting for an I/O callback
+ *		and should be resumed once the I/O is ready.
+ */
+enum pperl_fiber_state
+pperl_fiber_resume(perlfiber_t fiber, struct perlresult *result)
+{
+	PerlInterpreter *orig_perl;
+
+	if (!fiber->pf_done) {
+		fiber->pf_started = true;
+		fiber->pf_inside = true;
+		orig_perl = PERL_GET_CONTEXT;
+		if (swapcontext(&fiber->pf_caller, &fiber->pf_context) < 0)
+			pperl_fatal(EX_OSERR, "swapcontext: %m");
+		PERL_SET_CONTEXT(orig_perl);
+		fiber->pf_inside = false;
+	}
+
+	if (!fiber->pf_done)
+		return (PPERL_FIBER_BLOCKED);
+
+	if (result != NULL)
+		*result = fiber->pf_result;
+	return (PPERL_FIBER_DONE);
+}
+
+
+/*!
+ * pperl_fiber_destroy() - Free a fiber.
+ *
+ *	If the fiber has started but not finished, its run is cancelled (see
+ *	pperl_cancel()) and it is resumed, with I/O callbacks which would
+ *	block failing instead, until the run finishes.
+ *
+ *	@param	fiberp		Pointer to fiber to destroy.
+ *
+ *	@post	*fiberp is set to NULL.
+ */
+void
+pperl_fiber_destroy(perlfiber_t *fiberp)
+{
+	perlfiber_t fiber = *fiberp;
+
+	*fiberp = NULL;
+
+	if (!fiber->pf_started)
+		fiber->pf_pc->pc_interp->pi_fiber = NULL;
+	else if (!fiber->pf_done) {
+		fiber->pf_abort = true;
+		pperl_cancel(fiber->pf_pc->pc_interp);
+		while (pperl_fiber_resume(fiber, NULL) != PPERL_FIBER_DONE)
+			continue;
+	}
+
+	munmap(fiber->pf_stack, fiber->pf_stacksize);
+	free(fiber);
+}
+
+
+/*!
+ * pperl_fiber_park() - Suspend the fiber running in an interpreter.
+ *
+ *	Called by the I/O layer when a callback reports that it would block.
+ *	Returns once the fiber has been resumed, at which point the callback
+ *	should be retried.
+ *
+ *	@param	interp		Interpreter the callback was invoked from.
+ *
+ *	@return	False if the code isn't running in a fiber (e.g. it was run
+ *		by pperl_run() in an interpreter which merely has a fiber
+ *		waiting to start), or the fiber is being destroyed, in which
+ *		case the I/O should fail instead.
+ */
+bool
+pperl_fiber_park(perlinterp_t interp)
+{
+	perlfiber_t fiber = interp->pi_fiber;
+
+	if (fiber == NULL || !fiber->pf_inside || fiber->pf_abort)
+		return false;
+
+	fiber->pf_perl = PERL_GET_CONTEXT;
+	fiber->pf_inside = false;
+	if (swapcontext(&fiber->pf_context, &fiber->pf_caller) < 0)
+		pperl_fatal(EX_OSERR, "swapcontext: %m");
+	PERL_SET_CONTEXT(fiber->pf_perl);
+
+	return (!fiber->pf_abort);
+}
+
+
+/*!
+ * pperl_fiber_parked() - Check whether an interpreter's fiber is parked.
+ *
+ *	Perl's stacks are then in the middle of the fiber's run, so no other
+ *	code may be run in the interpreter until the fiber completes.
+ */
+bool
+pperl_fiber_parked(perlinterp_t interp)
+{
+	perlfiber_t fiber = interp->pi_fiber;
+
+	return (fiber != NULL && fiber->pf_started && !fiber->pf_inside);
+}
+
+
+/*
+ * pperl_fiber_main() - Entry point of a fiber's stack.
+ */
+void
+pperl_fiber_main(int hi, int lo)
+{
+	perlfiber_t fiber;
+
+	fiber = (perlfiber_t)(((uintptr_t)(u_int)hi << 16 << 16) | (u_int)lo);
+
+	pperl_run(fiber->pf_pc, fiber->pf_pargs, fiber->pf_penv,
+		  &fiber->pf_result);
+
+	fiber->pf_pc->pc_interp->pi_fiber = NULL;
+	fiber->pf_done = true;
+
+	/* Returning resumes pf_caller via uc_link. */
+}
@@ -30,6 +30,7 @@
 #include <syslog.h>
 
 #define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
 #include <EXTERN.h>
 #include <XSUB.h>
 #include <perl.h>
@@ -111,7 +112,7 @@ pperl_load_file(perlinterp_t interp, const char *path, perlenv_t penv,
 	 */
 	fd = open(path, O_RDONLY|O_SHLOCK);
 	if (fd < 0) {
-		pperl_seterr(errno, result);
+		pperl_seterr(interp, errno, result);
 		return NULL;
 	}
 
@@ -176,7 +177,7 @@ pperl_load_fd(perlinterp_t interp, const char *name, perlenv_t penv, int fd,
 	 * network filesystems do not support mmap(2)).
 	 */
 	if (fstat(fd, &sb) < 0) {
-		pperl_seterr(errno, result);
+		pperl_seterr(interp, errno, result);
 		return NULL;
 	}
 
@@ -219,7 +220,7 @@ pperl_load_fd_mmap(perlinterp_t interp, const char *name, perlenv_t penv,
 	 */
 	code = mmap(NULL, size, PROT_READ, 0, fd, 0);
 	if (code == MAP_FAILED) {
-		pperl_seterr(errno, result);
+		pperl_seterr(interp, errno, result);
 		return NULL;
 	}
 
@@ -303,7 +304,7 @@ pperl_load_fd_read(perlinterp_t interp, const char *name, perlenv_t penv,
 			}
 
 			/* All other errors are fatal. */
-			pperl_seterr(errno, result);
+			pperl_seterr(interp, errno, result);
 			free(code);
 			return NULL;
 		}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*
+ * Largest high-water marks reached by any interpreter in this process (or
+ * loaded with pperl_hwm_load()); new interpreters are presized to them.
+ */
+static pthread_mutex_t	 hwm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pperl_hwm	 hwm_process;
+
+/*
+ * Names of the marks in files written by pperl_hwm_save().
+ */
+static const struct {
+	const char	*name;
+	size_t		 offset;
+} hwm_fields[] = {
+	{ "stack",	offsetof(struct pperl_hwm, ph_stack) },
+	{ "tmps",	offsetof(struct pperl_hwm, ph_tmps) },
+	{ "savestack",	offsetof(struct pperl_hwm, ph_savestack) },
+	{ "scopestack",	offsetof(struct pperl_hwm, ph_scopestack) },
+	{ "svs",	offsetof(struct pperl_hwm, ph_svs) },
+};
+
+#define	HWM_FIELD(hwm, i)	\
+	(*(size_t *)((char *)(hwm) + hwm_fields[i].offset))
+#define	HWM_CFIELD(hwm, i)	\
+	(*(const size_t *)((const char *)(hwm) + hwm_fields[i].offset))
+#define	HWM_NFIELDS	(sizeof(hwm_fields) / sizeof(hwm_fields[0]))
+
+static bool	 pperl_hwm_merge(struct pperl_hwm *to,
+				 const struct pperl_hwm *from);
+
+
+/*!
+ * pperl_hwm_get() - Get the high-water marks reached in an interpreter.
+ *
+ *	Perl grows its stacks and scalar arenas on demand, so the first few
+ *	runs in a new interpreter are slowed down by reallocation.  libpperl
+ *	records how large they grow after each run, and presizes them in
+ *	interpreters created later in the same process; pperl_hwm_save()
+ *	and pperl_hwm_load() carry the marks over to later processes.
+ *
+ *	@param	interp		Interpreter to get the marks of.
+ *
+ *	@param	hwm		Populated with the marks.
+ */
+void
+pperl_hwm_get(perlinterp_t interp, struct pperl_hwm *hwm)
+{
+
+	*hwm = interp->pi_hwm;
+}
+
+
+/*!
+ * pperl_hwm_save() - Save the high-water marks reached in this process.
+ *
+ *	Writes the largest marks reached by any interpreter in the process
+ *	so far, including those loaded with pperl_hwm_load(), to a file.
+ *
+ *	@param	interp		Interpreter to report errors against.
+ *
+ *	@param	path		Path of the file to write; it is replaced if it
+ *				exists.
+ *
+ *	@param	result		If non-NULL and the file cannot be written, the
+ *				pperl_errno member is set to indicate the
+ *				cause of the error.
+ */
+void
+pperl_hwm_save(perlinterp_t interp, const char *path,
+	       struct perlresult *result)
+{
+	struct pperl_hwm hwm;
+	FILE *fp;
+	size_t i;
+
+	pperl_result_clear(result);
+
+	pthread_mutex_lock(&hwm_lock);
+	pperl_hwm_merge(&hwm_process, &interp->pi_hwm);
+	hwm = hwm_process;
+	pthread_mutex_unlock(&hwm_lock);
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		pperl_log(LOG_ERR, "failed to open high-water marks %s: %m",
+			  path);
+		pperl_seterr(interp, errno, result);
+		return;
+	}
+
+	fprintf(fp, "# libpperl high-water marks\n");
+	for (i = 0; i < HWM_NFIELDS; i++)
+		fprintf(fp, "%s\t%zu\n", hwm_fields[i].name,
+			HWM_FIELD(&hwm, i));
+
+	if (fclose(fp) != 0) {
+		pperl_log(LOG_ERR, "failed to write high-water marks %s: %m",
+			  path);
+		pperl_seterr(interp, errno, result);
+	}
+}
+
+
+/*!
+ * pperl_hwm_load() - Load high-water marks saved by pperl_hwm_save().
+ *
+ *	Merges the marks into those of the process, so that interpreters
+ *	created afterwards are presized to them, and presizes \a interp.
+ *	Typically called once at startup, with the marks saved by a previous
+ *	run of the program.
+ *
+ *	@param	interp		Interpreter to presize.
+ *
+ *	@param	path		Path of the file to read.
+ *
+ *	@param	result		If non-NULL and the file cannot be read, the
+ *				pperl_errno member is set to indicate the
+ *				cause of the error.
+ */
+void
+pperl_hwm_load(perlinterp_t interp, const char *path,
+	       struct perlresult *result)
+{
+	struct pperl_hwm hwm;
+	PerlInterpreter *orig_perl;
+	char line[128];
+	char *pos;
+	size_t i, len;
+	FILE *fp;
+	dTHXa(interp->pi_perl);
+
+	pperl_result_clear(result);
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		pperl_log(LOG_ERR, "failed to open high-water marks %s: %m",
+			  path);
+		pperl_seterr(interp, errno, result);
+		return;
+	}
+
+	memset(&hwm, 0, sizeof(hwm));
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strcspn(line, "\t");
+		if (line[len] != '\t')
+			continue;
+		pos = line + len + 1;
+		for (i = 0; i < HWM_NFIELDS; i++) {
+			if (strlen(hwm_fields[i].name) == len &&
+			    strncmp(line, hwm_fields[i].name, len) == 0) {
+				HWM_FIELD(&hwm, i) = strtoul(pos, NULL, 10);
+				break;
+			}
+		}
+	}
+
+	if (ferror(fp)) {
+		pperl_log(LOG_ERR, "failed to read high-water marks %s: %m",
+			  path);
+		pperl_seterr(interp, errno, result);
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+
+	pthread_mutex_lock(&hwm_lock);
+	pperl_hwm_merge(&hwm_process, &hwm);
+	pthread_mutex_unlock(&hwm_lock);
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+	pperl_hwm_presize(aTHX_ interp);
+	PERL_SET_CONTEXT(orig_perl);
+}
+
+
+/*
+ * pperl_hwm_record() - Record the high-water marks reached by a run.
+ *
+ *	Called at the end of each run, before its temporaries are freed.
+ *	Perl never shrinks its stacks, so their allocated sizes are their
+ *	high-water marks; the number of scalars in use at this point stands
+ *	in for the scalar arenas' high-water mark.
+ */
+void
+pperl_hwm_record(pTHX_ perlinterp_t interp)
+{
+	struct pperl_hwm hwm;
+
+	hwm.ph_stack = PL_stack_max - PL_stack_base;
+	hwm.ph_tmps = PL_tmps_max;
+	hwm.ph_savestack = PL_savestack_max;
+	hwm.ph_scopestack = PL_scopestack_max;
+	hwm.ph_svs = PL_sv_count;
+
+	/* Only take the lock when a new mark is reached. */
+	if (!pperl_hwm_merge(&interp->pi_hwm, &hwm))
+		return;
+
+	pthread_mutex_lock(&hwm_lock);
+	pperl_hwm_merge(&hwm_process, &interp->pi_hwm);
+	pthread_mutex_unlock(&hwm_lock);
+}
+
+
+/*
+ * pperl_hwm_presize() - Grow an interpreter to the process's high-water marks.
+ *
+ *	Extends perl's stacks and preallocates scalars (which are freed
+ *	straight away, leaving them in the arenas for reuse) so that code run
+ *	in the interpreter doesn't have to wait for them to grow.
+ *
+ *	@note	\a interp must be the current perl context.
+ */
+void
+pperl_hwm_presize(pTHX_ perlinterp_t interp)
+{
+	struct pperl_hwm hwm;
+	ssize_t n;
+	AV *av;
+	dSP;
+
+	pthread_mutex_lock(&hwm_lock);
+	hwm = hwm_process;
+	pthread_mutex_unlock(&hwm_lock);
+
+	if (hwm.ph_stack > (size_t)(PL_stack_max - PL_stack_base)) {
+		EXTEND(SP, (SSize_t)hwm.ph_stack - (SP - PL_stack_base));
+		PUTBACK;
+	}
+	if (hwm.ph_tmps > (size_t)PL_tmps_max)
+		EXTEND_MORTAL((SSize_t)hwm.ph_tmps - PL_tmps_ix);
+	if (hwm.ph_savestack > (size_t)PL_savestack_max)
+		SSGROW((I32)hwm.ph_savestack - PL_savestack_ix);
+	if (hwm.ph_scopestack > (size_t)PL_scopestack_max) {
+		PL_scopestack_max = hwm.ph_scopestack;
+		Renew(PL_scopestack, PL_scopestack_max, I32);
+#ifdef DEBUGGING
+		Renew(PL_scopestack_name, PL_scopestack_max, const char *);
+#endif
+	}
+
+	n = (ssize_t)hwm.ph_svs - (ssize_t)PL_sv_count;
+	if (n > 0) {
+		av = newAV();
+		av_extend(av, n);
+		while (n-- > 0)
+			av_push(av, newSV(0));
+		SvREFCNT_dec(av);
+	}
+
+	pperl_hwm_merge(&interp->pi_hwm, &hwm);
+}
+
+
+/*
+ * pperl_hwm_merge() - Raise one set of high-water marks to another.
+ *
+ *	@return	True if any of \a to's marks rose.
+ */
+bool
+pperl_hwm_merge(struct pperl_hwm *to, const struct pperl_hwm *from)
+{
+	bool raised = false;
+	size_t i;
+
+	for (i = 0; i < HWM_NFIELDS; i++) {
+		if (HWM_CFIELD(from, i) > HWM_FIELD(to, i)) {
+			HWM_FIELD(to, i) = HWM_CFIELD(from, i);
+			raised = true;
+		}
+	}
+
+	return (raised);
+}
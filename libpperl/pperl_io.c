@@ -19,8 +19,11 @@
 
 #include "pperl_platform.h"
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,7 +32,9 @@
 #include <unistd.h>
 
 #define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
 #include <EXTERN.h>
+#include <XSUB.h>
 #include <perl.h>
 #include <perliol.h>
 
@@ -49,6 +54,13 @@ static IV	 pperl_PerlIO_close(pTHX_ PerlIO *f);
 static SSize_t	 pperl_PerlIO_read(pTHX_ PerlIO *f, void *vbuf, Size_t count);
 static SSize_t	 pperl_PerlIO_write(pTHX_ PerlIO *f, const void *vbuf,
 				    Size_t count);
+static bool	 pperl_io_wait(PerlIO *f, struct perlio *pio);
+static struct perlio *pperl_io_handle_pio(pTHX_ PerlIO *f);
+static struct perlio *pperl_io_named_pio(pTHX_ const char *name);
+static ssize_t	 pperl_io_copyfile(pTHX_ PerlIO *f, int fd, off_t offset,
+				   size_t len);
+static XS(XS_pperl_send);
+static XS(XS_pperl_sendfile);
 
 
 /*
@@ -102,11 +114,15 @@ static PerlIO_funcs pperl_io_funcs = {
  *	reads and writes to I/O handles.
  */
 void
-pperl_io_init(void)
+pperl_io_init(pTHX)
 {
-	dTHX;
 
 	PerlIO_define_layer(aTHX_ &pperl_io_funcs);
+
+	newXS(ignoreconst(PPERL_NAMESPACE_PUBLIC "::send"), XS_pperl_send,
+	      ignoreconst(__FILE__));
+	newXS(ignoreconst(PPERL_NAMESPACE_PUBLIC "::sendfile"),
+	      XS_pperl_sendfile, ignoreconst(__FILE__));
 }
 
 
@@ -213,7 +229,17 @@ pperl_PerlIO_close(pTHX_ PerlIO *f)
 	if (pio->pio_onClose != NULL)
 		pio->pio_onClose(pio->pio_data);
 
-	code = PerlIOBase_close(f);
+	code = PerlIOBase_close(aTHX_ f);
+
+	/*
+	 * Capture handles are only ever closed by perl (when the run they
+	 * were opened for ends), so free their perlio structure here.
+	 */
+	if (pio->pio_output != NULL) {
+		LIST_REMOVE(pio, pio_link);
+		free(pio);
+		return (code);
+	}
 
 	pperl_io_destroy(&pio);
 
@@ -235,9 +261,15 @@ pperl_PerlIO_read(pTHX_ PerlIO *f, void *vbuf, Size_t count)
 {
 	struct pperl_io_layer *layer = PerlIOSelf(f, struct pperl_io_layer);
 	struct perlio *pio = layer->pil_pio;
+	size_t len;
 
 	assert(pio->pio_onRead != NULL);
-	return pio->pio_onRead(vbuf, count, pio->pio_data);
+	while ((len = pio->pio_onRead(vbuf, count, pio->pio_data)) ==
+	       PPERL_IO_WOULDBLOCK) {
+		if (!pperl_io_wait(f, pio))
+			return (-1);
+	}
+	return (len);
 }
 
 
@@ -255,9 +287,53 @@ pperl_PerlIO_write(pTHX_ PerlIO *f, const void *vbuf, Size_t count)
 {
 	struct pperl_io_layer *layer = PerlIOSelf(f, struct pperl_io_layer);
 	struct perlio *pio = layer->pil_pio;
+	struct pperl_output *out = pio->pio_output;
+	size_t len;
+
+	/* Append captured output straight to the caller's buffer. */
+	if (out != NULL) {
+		if (out->po_len + count > out->po_size) {
+			if (out->po_size == 0)
+				out->po_size = 512;
+			while (out->po_len + count > out->po_size)
+				out->po_size *= 2;
+			out->po_buf = pperl_realloc(out->po_buf,
+						    out->po_size);
+		}
+		memcpy(out->po_buf + out->po_len, vbuf, count);
+		out->po_len += count;
+		return (count);
+	}
 
 	assert(pio->pio_onWrite != NULL);
-	return pio->pio_onWrite(vbuf, count, pio->pio_data);
+	while ((len = pio->pio_onWrite(vbuf, count, pio->pio_data)) ==
+	       PPERL_IO_WOULDBLOCK) {
+		if (!pperl_io_wait(f, pio))
+			return (-1);
+	}
+	return (len);
+}
+
+
+/*
+ * pperl_io_wait() - Wait for a callback which would block to be retried.
+ *
+ *	If the code is running in a fiber, parks the fiber until it is
+ *	resumed.  Otherwise, or if the fiber is being destroyed, there is
+ *	nothing to wait with; the I/O operation fails with EAGAIN.
+ *
+ *	@return	True if the callback should be retried.
+ */
+bool
+pperl_io_wait(PerlIO *f, struct perlio *pio)
+{
+
+	if (pperl_fiber_park(pio->pio_interp))
+		return true;
+
+	errno = EAGAIN;
+	PerlIOBase(f)->flags |= PERLIO_F_ERROR;
+	return false;
 }
 
 
@@ -286,7 +362,9 @@ pperl_PerlIO_write(pTHX_ PerlIO *f, const void *vbuf, Size_t count)
  *				\a buf buffer with up to \a buflen bytes of
  *				data to be read by the perl script; the exact
  *				number of bytes written to the buffer should
- *				be returned by the callback.
+ *				be returned by the callback.  If no data is
+ *				available yet, the callback may return
+ *				PPERL_IO_WOULDBLOCK; see pperl_fiber_new().
  *
  *	@param	onWrite		Function to call whenever a perl script
  *				attempts to write to the I/O handle.  If NULL,
@@ -295,7 +373,9 @@ pperl_PerlIO_write(pTHX_ PerlIO *f, const void *vbuf, Size_t count)
  *				The \a onWrite callback can consume up to
  *				\a buflen bytes from the \a buf buffer.  The
  *				exact number of bytes consumed should be
- *				returned by the callback.
+ *				returned by the callback, or
+ *				PPERL_IO_WOULDBLOCK if none can be consumed
+ *				yet.
  *
  *	@param	onClose		Function to call when the I/O handle is closed.
  *				May be NULL.
@@ -315,7 +395,7 @@ pperl_io_override(perlinterp_t interp, const char *name,
 	const char *openstr;
 	GV *handle;
 	SV *sv;
-	dTHX;
+	dTHXa(interp->pi_perl);
 
 	assert(onRead != NULL || onWrite != NULL);
 
@@ -333,7 +413,10 @@ pperl_io_override(perlinterp_t interp, const char *name,
 	pio->pio_onRead = onRead;
 	pio->pio_onWrite = onWrite;
 	pio->pio_onClose = onClose;
+	pio->pio_onSend = NULL;
+	pio->pio_onSendfile = NULL;
 	pio->pio_data = data;
+	pio->pio_output = NULL;
 	pio->pio_f = NULL;
 	pio->pio_interp = interp;
 	LIST_INSERT_HEAD(&interp->pi_io_head, pio, pio_link);
@@ -381,6 +464,349 @@ pperl_io_override(perlinterp_t interp, const char *name,
 }
 
 
+/*!
+ * pperl_io_override_send() - Accept buffers handed off by libpperl::send().
+ *
+ *	Scripts producing large responses may pass them to
+ *	libpperl::send($body) rather than print()ing them.  If the
+ *	currently selected output handle was overridden with
+ *	pperl_io_override() and given an \a onSend callback, the scalar's
+ *	buffer is handed to the callback without being copied; the C side
+ *	owns it until it calls pperl_iobuf_release(), so it may, for
+ *	example, queue the buffer for writing once the script has returned.
+ *	Otherwise the buffer is written to the handle as print() would.
+ *
+ *	@param	interp		The persistent perl interpreter the I/O handle
+ *				exists in.
+ *
+ *	@param	name		The name of an I/O handle already overridden
+ *				with pperl_io_override() for writing.
+ *
+ *	@param	onSend		Function to hand buffers to, or NULL to write
+ *				them with the handle's \a onWrite callback.
+ *				The callback is passed the buffer and its
+ *				length, the buffer's handle (which must be
+ *				released with pperl_iobuf_release() when the
+ *				buffer is no longer needed), and the opaque
+ *				data given to pperl_io_override().
+ */
+void
+pperl_io_override_send(perlinterp_t interp, const char *name,
+		       pperl_io_send_t *onSend)
+{
+	struct perlio *pio;
+	dTHXa(interp->pi_perl);
+
+	pio = pperl_io_named_pio(aTHX_ name);
+	if (pio != NULL)
+		pio->pio_onSend = onSend;
+}
+
+
+/*!
+ * pperl_io_override_sendfile() - Accept file ranges from libpperl::sendfile().
+ *
+ *	Scripts serving files from disk may call
+ *	libpperl::sendfile($path_or_fh, $offset, $length) rather than
+ *	copying the file through perl.  If the currently selected output
+ *	handle was overridden with pperl_io_override() and given an
+ *	\a onSendfile callback, the callback is passed an open descriptor
+ *	for the file and the range to send, so it can move the data with
+ *	sendfile(2) or splice(2) without it passing through user space.
+ *	Otherwise the range is read from the file and written to the handle.
+ *
+ *	@param	interp		The persistent perl interpreter the I/O handle
+ *				exists in.
+ *
+ *	@param	name		The name of an I/O handle already overridden
+ *				with pperl_io_override() for writing.
+ *
+ *	@param	onSendfile	Function to hand file ranges to, or NULL to
+ *				copy them to the handle.  The descriptor is
+ *				only valid until the callback returns (dup(2)
+ *				it to send the range later).  The callback
+ *				should return the number of bytes sent, or -1
+ *				with errno set on error.
+ */
+void
+pperl_io_override_sendfile(perlinterp_t interp, const char *name,
+			   pperl_io_sendfile_t *onSendfile)
+{
+	struct perlio *pio;
+	dTHXa(interp->pi_perl);
+
+	pio = pperl_io_named_pio(aTHX_ name);
+	if (pio != NULL)
+		pio->pio_onSendfile = onSendfile;
+}
+
+
+/*!
+ * pperl_iobuf_release() - Release a buffer handed off by libpperl::send().
+ *
+ *	Must be called from the thread running the buffer's interpreter, and
+ *	before the interpreter is destroyed.
+ *
+ *	@param	iobp		Pointer to the handle passed to the
+ *				\a onSend callback.
+ *
+ *	@post	*iobp is set to NULL.
+ */
+void
+pperl_iobuf_release(perliobuf_t *iobp)
+{
+	perliobuf_t iob = *iobp;
+	PerlInterpreter *orig_perl;
+	dTHXa(iob->piob_interp->pi_perl);
+
+	*iobp = NULL;
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(iob->piob_interp->pi_perl);
+	SvREFCNT_dec(iob->piob_sv);
+	PERL_SET_CONTEXT(orig_perl);
+
+	free(iob);
+}
+
+
+/*
+ * pperl_io_handle_pio() - Find the perlio structure for a PerlIO handle.
+ *
+ *	@return	The perlio structure, or NULL if the handle's top layer is
+ *		not ours.
+ */
+struct perlio *
+pperl_io_handle_pio(pTHX_ PerlIO *f)
+{
+
+	if (!PerlIOValid(f) || PerlIOBase(f)->tab != &pperl_io_funcs)
+		return (NULL);
+
+	return (PerlIOSelf(f, struct pperl_io_layer)->pil_pio);
+}
+
+
+/*
+ * pperl_io_named_pio() - Find the perlio structure for a named I/O handle.
+ *
+ *	@return	The perlio structure, or NULL (after logging an error) if the
+ *		handle has not been overridden for writing.
+ */
+struct perlio *
+pperl_io_named_pio(pTHX_ const char *name)
+{
+	struct perlio *pio = NULL;
+	GV *handle;
+	IO *io;
+
+	handle = gv_fetchpv(name, FALSE, SVt_PVIO);
+	if (handle != NULL && (io = GvIO(handle)) != NULL &&
+	    IoOFP(io) != NULL)
+		pio = pperl_io_handle_pio(aTHX_ IoOFP(io));
+
+	if (pio == NULL)
+		pperl_log(LOG_ERR, "I/O handle %s is not overridden", name);
+
+	return (pio);
+}
+
+
+/*
+ * pperl_io_copyfile() - Copy a range of a file to a PerlIO handle.
+ *
+ *	Fallback for libpperl::sendfile() when the output handle doesn't
+ *	accept file ranges.
+ *
+ *	@return	Number of bytes copied, or -1 on error.
+ */
+ssize_t
+pperl_io_copyfile(pTHX_ PerlIO *f, int fd, off_t offset, size_t len)
+{
+	char buf[65536];
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pread(fd, buf, len - done < sizeof(buf) ?
+			  len - done : sizeof(buf), offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		if (n == 0)
+			break;
+		if (PerlIO_write(f, buf, n) != n)
+			return (-1);
+		done += n;
+	}
+
+	return (done);
+}
+
+
+/*!
+ * XS_pperl_send() - Write a scalar to the selected handle without copying.
+ *
+ *	Called as libpperl::send($body);
+ *
+ *	If the selected output handle accepts buffers (see
+ *	pperl_io_override_send()), takes the scalar's buffer, leaving the
+ *	scalar empty, and hands it to the handle's \a onSend callback.  A
+ *	scalar whose buffer can't be taken (e.g. a constant) is copied
+ *	once instead.  Otherwise the scalar is printed.
+ *
+ *	Returns true if successful, as print() does.
+ */
+XS(XS_pperl_send)
+{
+	struct perlio *pio;
+	perliobuf_t iob;
+	PerlIO *f;
+	STRLEN len;
+	const char *buf;
+	SV *sv, *holder;
+	dXSARGS;
+
+	(void)cv;		/* Silence warning about unused parameter. */
+
+	if (items != 1)
+		croak("Usage: " PPERL_NAMESPACE_PUBLIC "::send(scalar)");
+	sv = ST(0);
+
+	f = GvIO(PL_defoutgv) != NULL ? IoOFP(GvIO(PL_defoutgv)) : NULL;
+	if (f == NULL) {
+		errno = EBADF;
+		XSRETURN_NO;
+	}
+
+	pio = pperl_io_handle_pio(aTHX_ f);
+	if (pio == NULL || pio->pio_onSend == NULL) {
+		buf = SvPV(sv, len);
+		if (PerlIO_write(f, buf, len) != (SSize_t)len)
+			XSRETURN_NO;
+		XSRETURN_YES;
+	}
+
+	/*
+	 * Take over the scalar's buffer if it owns one outright; anything
+	 * else (read-only, magical, references, numbers) is copied.
+	 */
+	if (SvPOK(sv) && !SvREADONLY(sv) && !SvROK(sv) && !SvMAGICAL(sv)) {
+		if (SvIsCOW(sv))
+			sv_force_normal_flags(sv, 0);
+		SvOOK_off(sv);
+	}
+	if (SvPOK(sv) && !SvREADONLY(sv) && !SvROK(sv) && !SvMAGICAL(sv) &&
+	    !SvIsCOW(sv) && SvLEN(sv) != 0) {
+		holder = newSV(0);
+		sv_upgrade(holder, SVt_PV);
+		SvPV_set(holder, SvPVX(sv));
+		SvCUR_set(holder, SvCUR(sv));
+		SvLEN_set(holder, SvLEN(sv));
+		SvPOK_only(holder);
+
+		SvPV_set(sv, NULL);
+		SvCUR_set(sv, 0);
+		SvLEN_set(sv, 0);
+		SvOK_off(sv);
+	}
+	else {
+		buf = SvPV(sv, len);
+		holder = newSVpvn(buf, len);
+	}
+
+	iob = pperl_malloc(sizeof(*iob));
+	iob->piob_sv = holder;
+	iob->piob_interp = pio->pio_interp;
+
+	pio->pio_onSend(SvPVX(holder), SvCUR(holder), iob, pio->pio_data);
+
+	XSRETURN_YES;
+}
+
+
+/*!
+ * XS_pperl_sendfile() - Send a range of a file to the selected handle.
+ *
+ *	Called as libpperl::sendfile($path_or_fh, $offset, $length);
+ *
+ *	The file may be given by name or as an open file handle.  $offset
+ *	defaults to 0, and $length to the rest of the file.  If the selected
+ *	output handle accepts file ranges (see pperl_io_override_sendfile()),
+ *	the range is handed to it; otherwise it is copied to the handle.
+ *
+ *	Returns the number of bytes sent, or undef (with $! set) on error.
+ */
+XS(XS_pperl_sendfile)
+{
+	struct perlio *pio;
+	struct stat st;
+	PerlIO *f, *in;
+	off_t offset = 0;
+	size_t len;
+	ssize_t sent;
+	bool opened = false;
+	int fd, saverr;
+	SV *sv;
+	dXSARGS;
+
+	(void)cv;		/* Silence warning about unused parameter. */
+
+	if (items < 1 || items > 3)
+		croak("Usage: " PPERL_NAMESPACE_PUBLIC
+		      "::sendfile(path-or-handle, [offset, [length]])");
+	sv = ST(0);
+
+	f = GvIO(PL_defoutgv) != NULL ? IoOFP(GvIO(PL_defoutgv)) : NULL;
+	if (f == NULL) {
+		errno = EBADF;
+		XSRETURN_UNDEF;
+	}
+
+	/* Find or open the file. */
+	if (SvROK(sv) || isGV_with_GP(sv)) {
+		in = IoIFP(sv_2io(sv));
+		fd = in != NULL ? PerlIO_fileno(in) : -1;
+		if (fd < 0) {
+			errno = EBADF;
+			XSRETURN_UNDEF;
+		}
+	}
+	else {
+		fd = open(SvPV_nolen(sv), O_RDONLY);
+		if (fd < 0)
+			XSRETURN_UNDEF;
+		opened = true;
+	}
+
+	if (items > 1 && SvOK(ST(1)))
+		offset = SvIV(ST(1));
+	if (items > 2 && SvOK(ST(2)))
+		len = SvUV(ST(2));
+	else if (fstat(fd, &st) == 0)
+		len = st.st_size > offset ? st.st_size - offset : 0;
+	else
+		len = 0;
+
+	pio = pperl_io_handle_pio(aTHX_ f);
+	if (pio != NULL && pio->pio_onSendfile != NULL)
+		sent = pio->pio_onSendfile(fd, offset, len, pio->pio_data);
+	else
+		sent = pperl_io_copyfile(aTHX_ f, fd, offset, len);
+
+	if (opened) {
+		saverr = errno;
+		close(fd);
+		errno = saverr;
+	}
+
+	if (sent < 0)
+		XSRETURN_UNDEF;
+	XSRETURN_IV(sent);
+}
+
+
 /*
  * pperl_io_destroy() - Free a perlio structure.
  *
@@ -401,6 +827,7 @@ pperl_io_destroy(perlio_t *piop)
 {
 	perlio_t pio = *piop;
 	PerlIO *f = pio->pio_f;
+	dTHXa(pio->pio_interp->pi_perl);
 
 	*piop = NULL;
 
@@ -421,3 +848,166 @@ pperl_io_destroy(perlio_t *piop)
 
 	free(pio);
 }
+
+
+/*
+ * pperl_io_detach() - Disconnect on-close callbacks from all I/O handles.
+ *
+ *	Used in a forked child (see pperl_zygote_run()) before it reopens
+ *	overridden handles, so that closing them doesn't invoke callbacks
+ *	which would act on a copy of the parent's state.
+ *
+ *	@param	interp		Interpreter whose I/O handles to detach.
+ */
+void
+pperl_io_detach(perlinterp_t interp)
+{
+	struct perlio *pio;
+
+	LIST_FOREACH(pio, &interp->pi_io_head, pio_link)
+		pio->pio_onClose = NULL;
+}
+
+
+/*!
+ * pperl_run_capture() - Execute loaded perl code, capturing its output.
+ *
+ *	Runs code as pperl_run() does, except that while it runs, STDOUT
+ *	(and, optionally, STDERR) write directly into caller-owned buffers
+ *	rather than through a file descriptor or pperl_io_override()
+ *	callbacks.  The handles are restored when the run completes.
+ *
+ *	Each buffer's contents are replaced by the run's output.  A buffer
+ *	that is reused keeps its allocation, so once it is large enough
+ *	capturing output needs no further allocation; a buffer which has
+ *	not been allocated yet is sized from the output of the code's
+ *	previous captured run.
+ *
+ *	@param	pc		The perl code to run.
+ *
+ *	@param	pargs		Argument list; see pperl_run().
+ *
+ *	@param	penv		Environment variable list; see pperl_run().
+ *
+ *	@param	out		Buffer to capture STDOUT into.
+ *
+ *	@param	err		Buffer to capture STDERR into; if NULL, STDERR
+ *				is left alone.
+ *
+ *	@param	result		If non-NULL, populated with the exit status
+ *				and/or error message returned by the code.
+ */
+void
+pperl_run_capture(perlcode_t pc, perlargs_t pargs, perlenv_t penv,
+		  struct pperl_output *out, struct pperl_output *err,
+		  struct perlresult *result)
+{
+	const perlinterp_t interp = pc->pc_interp;
+
+	assert(out != NULL);
+
+	if (out->po_buf == NULL && pc->pc_outlen > 0) {
+		out->po_size = pc->pc_outlen + pc->pc_outlen / 4;
+		out->po_buf = pperl_malloc(out->po_size);
+	}
+	out->po_len = 0;
+	if (err != NULL)
+		err->po_len = 0;
+
+	interp->pi_capture_out = out;
+	interp->pi_capture_err = err;
+
+	pperl_run(pc, pargs, penv, result);
+
+	/* In case the run failed before the handles were redirected. */
+	interp->pi_capture_out = NULL;
+	interp->pi_capture_err = NULL;
+
+	pc->pc_outlen = out->po_len;
+}
+
+
+/*
+ * pperl_io_capture() - Redirect a perl I/O handle into a buffer.
+ *
+ *	Localizes the handle's glob (as "local *STDOUT" would) and opens it
+ *	with our layer in capture mode, so that the handle is restored and
+ *	the capture closed by the enclosing LEAVE.
+ *
+ *	@note	Must be called inside an ENTER/LEAVE block.
+ */
+void
+pperl_io_capture(pTHX_ perlinterp_t interp, const char *name,
+		 struct pperl_output *out)
+{
+	struct perlio *pio;
+	const char *openstr = ">:" PPERL_IOLAYER;
+	GV *handle;
+	SV *sv;
+
+	pio = pperl_malloc(sizeof(*pio));
+	pio->pio_onRead = NULL;
+	pio->pio_onWrite = NULL;
+	pio->pio_onClose = NULL;
+	pio->pio_onSend = NULL;
+	pio->pio_onSendfile = NULL;
+	pio->pio_data = 0;
+	pio->pio_output = out;
+	pio->pio_f = NULL;
+	pio->pio_interp = interp;
+	LIST_INSERT_HEAD(&interp->pi_io_head, pio, pio_link);
+
+	handle = gv_fetchpv(name, TRUE, SVt_PVIO);
+	save_gp(handle, 1);
+
+	sv = sv_newmortal();
+	sv_setiv(sv, (IV)(intptr_t)pio);
+
+	if (!Perl_do_openn(aTHX_ handle, ignoreconst(openstr), strlen(openstr),
+			   FALSE, O_WRONLY, 0, Nullfp, &sv, 1)) {
+		pperl_log(LOG_ERR, "failed to capture I/O handle %s: %s",
+			  name, SvPV(get_sv("!", TRUE), PL_na));
+		LIST_REMOVE(pio, pio_link);
+		free(pio);
+		return;
+	}
+
+	IoFLAGS(GvIOp(handle)) &= ~IOf_FLUSH;
+}
+
+
+/*
+ * pperl_io_input() - Redirect a perl I/O handle to read from a buffer.
+ *
+ *	Localizes the handle's glob and opens it on an in-memory scalar
+ *	which refers to the buffer directly rather than copying it.  The
+ *	buffer must be followed by a nul byte and remain valid until the
+ *	handle is restored.
+ *
+ *	@note	Must be called inside an ENTER/LEAVE block; the handle is
+ *		restored by LEAVE.
+ */
+void
+pperl_io_input(pTHX_ const char *name, const char *buf, size_t len)
+{
+	GV *handle;
+	SV *buf_sv, *ref_sv;
+
+	handle = gv_fetchpv(name, TRUE, SVt_PVIO);
+	save_gp(handle, 1);
+
+	buf_sv = newSV(0);
+	sv_upgrade(buf_sv, SVt_PV);
+	SvPV_set(buf_sv, ignoreconst(buf));
+	SvCUR_set(buf_sv, len);
+	SvLEN_set(buf_sv, 0);
+	SvPOK_only(buf_sv);
+	SvREADONLY_on(buf_sv);
+
+	ref_sv = sv_2mortal(newRV_noinc(buf_sv));
+
+	if (!Perl_do_openn(aTHX_ handle, ignoreconst("<"), 1, FALSE,
+			   O_RDONLY, 0, Nullfp, &ref_sv, 1))
+		pperl_log(LOG_ERR, "failed to redirect I/O handle %s: %s",
+			  name, SvPV_nolen(get_sv("!", TRUE)));
+}
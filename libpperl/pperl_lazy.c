@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+
+
+/*!
+ * pperl_lazy_compile() - Enable or disable lazy compilation.
+ *
+ *	While enabled, pperl_load() (and the helpers built on it) only record
+ *	the code's source; compilation is deferred until the code is first
+ *	run, or until pperl_warmup() gets to it, whichever happens first.
+ *	This lets an application register a large catalog of scripts without
+ *	paying their compile cost up front.
+ *
+ *	Since BEGIN blocks and compile errors are deferred too, pperl_load()
+ *	always succeeds in this mode; errors are instead reported by the
+ *	first pperl_run() of the code.
+ *
+ *	@param	interp		Interpreter to change the load mode of.
+ *
+ *	@param	enable		Whether subsequently loaded code should be
+ *				compiled lazily.
+ */
+void
+pperl_lazy_compile(perlinterp_t interp, bool enable)
+{
+
+	interp->pi_lazy = enable;
+}
+
+
+/*!
+ * pperl_warmup() - Compile lazily loaded code while the interpreter is idle.
+ *
+ *	Intended to be called by the application whenever it has nothing
+ *	else for the interpreter to do (e.g. from an event loop's idle
+ *	handler).  Compiles pending code, most recently loaded first, until
+ *	either none remains or the given time budget is spent; since a
+ *	single piece of code cannot be interrupted mid-compile, the budget
+ *	may be overrun by up to the compile time of one piece of code.
+ *
+ *	Code that fails to compile is not retried here; the error is
+ *	reported when the code is run.
+ *
+ *	@param	interp		Interpreter to compile code in.
+ *
+ *	@param	penv		Environment variable list to populate \%ENV
+ *				with while compiling.
+ *
+ *	@param	usec		Approximate number of microseconds to spend
+ *				compiling; zero or negative compiles all
+ *				pending code.
+ *
+ *	@return	Number of pieces of code still waiting to be compiled.
+ */
+int
+pperl_warmup(perlinterp_t interp, perlenv_t penv, int usec)
+{
+	PerlInterpreter *orig_perl;
+	perlcode_t pc;
+	uint64_t deadline;
+	int curdir;
+	dTHXa(interp->pi_perl);
+
+	if (interp->pi_code_pending == 0)
+		return (0);
+
+	/* Save current directory in case perl code changes it. */
+	if (!pperl_curdir_save(interp, &curdir, NULL))
+		return (interp->pi_code_pending);
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	deadline = pperl_clock() + (usec > 0 ? usec : 0);
+
+	LIST_FOREACH(pc, &interp->pi_code_head, pc_link) {
+		if (interp->pi_code_pending == 0)
+			break;
+		if (!pc->pc_pending)
+			continue;
+
+		pperl_lazy_done(pc);
+		if (!pperl_compile(pc, penv, pc->pc_src, pc->pc_srclen, NULL))
+			pperl_log(LOG_WARNING, "failed to compile %s: %s",
+				  pc->pc_name, SvPV_nolen(ERRSV));
+
+		/* Stay within the memory budget, if any. */
+		pperl_lru_trim(interp, pc);
+
+		if (usec > 0 && pperl_clock() >= deadline)
+			break;
+	}
+
+	PERL_SET_CONTEXT(orig_perl);
+
+	pperl_curdir_restore(&curdir);
+
+	return (interp->pi_code_pending);
+}
+
+
+/*!
+ * pperl_lazy_done() - Note that lazily loaded code no longer needs to be
+ *		       compiled by pperl_warmup().
+ */
+void
+pperl_lazy_done(perlcode_t pc)
+{
+
+	if (!pc->pc_pending)
+		return;
+
+	pc->pc_pending = false;
+	assert(pc->pc_interp->pi_code_pending > 0);
+	pc->pc_interp->pi_code_pending--;
+}
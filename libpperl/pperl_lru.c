@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+
+/*
+ * Rough average number of bytes occupied by each perl value (head, body,
+ * and any string buffer) created when code is compiled or run.  Perl
+ * doesn't track memory usage directly, so footprints are estimated by
+ * counting values.
+ */
+#define	SV_FOOTPRINT	96
+
+
+/*!
+ * pperl_code_budget() - Limit the memory occupied by compiled code.
+ *
+ *	Sets the approximate number of bytes compiled code may occupy in an
+ *	interpreter.  When the budget is exceeded, the code which was run
+ *	least recently is discarded: its END blocks are run and its compiled
+ *	form is freed.  The code's handle remains valid; the next time it is
+ *	run, it is transparently recompiled from a saved copy of its source.
+ *
+ *	Only code loaded after a budget is set retains its source and can be
+ *	discarded; code loaded earlier is never evicted, though it still
+ *	counts towards the budget.
+ *
+ *	@param	interp		Interpreter to limit.
+ *
+ *	@param	bytes		Approximate number of bytes compiled code may
+ *				occupy, or zero for no limit.
+ */
+void
+pperl_code_budget(perlinterp_t interp, size_t bytes)
+{
+	PerlInterpreter *orig_perl;
+
+	interp->pi_code_budget = bytes;
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	pperl_lru_trim(interp, NULL);
+
+	PERL_SET_CONTEXT(orig_perl);
+}
+
+
+/*!
+ * pperl_code_footprint() - Report the approximate memory used by code.
+ *
+ *	The estimate includes the code's source text, the values created when
+ *	it was compiled (including any modules it was first to load), and
+ *	values it left behind after each run (e.g. package variables).
+ *
+ *	@param	pc		Loaded code to report on.
+ *
+ *	@return	Approximate number of bytes occupied by the compiled code; zero
+ *		if it has been discarded to stay within the interpreter's
+ *		memory budget.
+ */
+size_t
+pperl_code_footprint(const perlcode_t pc)
+{
+
+	return (pc->pc_sv != NULL ? pc->pc_size : 0);
+}
+
+
+/*!
+ * pperl_lru_insert() - Account for newly-compiled code.
+ *
+ *	@param	pc		Code which was just compiled; \a pc_size holds
+ *				the length of its source.
+ *
+ *	@param	svcount		Number of perl values created by compiling it.
+ */
+void
+pperl_lru_insert(perlcode_t pc, I32 svcount)
+{
+	perlinterp_t interp = pc->pc_interp;
+
+	if (svcount > 0)
+		pc->pc_size += (size_t)svcount * SV_FOOTPRINT;
+	pc->pc_lastrun = time(NULL);
+
+	TAILQ_INSERT_HEAD(&interp->pi_lru_head, pc, pc_lru_link);
+	interp->pi_code_size += pc->pc_size;
+}
+
+
+/*!
+ * pperl_lru_remove() - Stop accounting for code being discarded.
+ */
+void
+pperl_lru_remove(perlcode_t pc)
+{
+	perlinterp_t interp = pc->pc_interp;
+
+	TAILQ_REMOVE(&interp->pi_lru_head, pc, pc_lru_link);
+	assert(interp->pi_code_size >= pc->pc_size);
+	interp->pi_code_size -= pc->pc_size;
+	pc->pc_size = 0;
+}
+
+
+/*!
+ * pperl_lru_touch() - Mark code as the most recently run.
+ *
+ *	@param	pc		Code which was just run.
+ *
+ *	@param	svcount		Net number of perl values the run created; if
+ *				positive, they are charged to the code.
+ */
+void
+pperl_lru_touch(perlcode_t pc, I32 svcount)
+{
+	perlinterp_t interp = pc->pc_interp;
+
+	if (svcount > 0) {
+		pc->pc_size += (size_t)svcount * SV_FOOTPRINT;
+		interp->pi_code_size += (size_t)svcount * SV_FOOTPRINT;
+	}
+	pc->pc_lastrun = time(NULL);
+
+	if (TAILQ_FIRST(&interp->pi_lru_head) != pc) {
+		TAILQ_REMOVE(&interp->pi_lru_head, pc, pc_lru_link);
+		TAILQ_INSERT_HEAD(&interp->pi_lru_head, pc, pc_lru_link);
+	}
+}
+
+
+/*!
+ * pperl_lru_trim() - Discard least recently run code until the interpreter
+ *		      is within its memory budget.
+ *
+ *	@param	interp		Interpreter to trim; must be the current perl
+ *				context.
+ *
+ *	@param	keep		Code which must not be discarded (i.e. the
+ *				code which was just loaded or run), or NULL.
+ */
+void
+pperl_lru_trim(perlinterp_t interp, perlcode_t keep)
+{
+	perlcode_t pc, prev;
+
+	if (interp->pi_code_budget == 0)
+		return;
+
+	pc = TAILQ_LAST(&interp->pi_lru_head, perlcode_lru);
+	while (pc != NULL && interp->pi_code_size > interp->pi_code_budget) {
+		prev = TAILQ_PREV(pc, perlcode_lru, pc_lru_link);
+
+		/* Code without saved source couldn't be recompiled. */
+		if (pc != keep && pc->pc_src != NULL) {
+			pperl_log(LOG_INFO, "discarding %s (%zu bytes, "
+				  "idle %ld seconds)", pc->pc_name,
+				  pc->pc_size, (long)(time(NULL) -
+				  pc->pc_lastrun));
+			pperl_discard(pc);
+		}
+
+		pc = prev;
+	}
+}
@@ -29,6 +29,7 @@
 #include <syslog.h>
 
 #define HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
 #include <EXTERN.h>
 #include <XSUB.h>
 #include <perl.h>
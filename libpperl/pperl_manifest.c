@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*
+ * A single module entry read from a manifest file.
+ */
+struct manifest_entry {
+	uint64_t	 me_usec;
+	char		*me_path;
+};
+
+static int	 manifest_entry_bypath(const void *a, const void *b);
+static int	 manifest_entry_bycost(const void *a, const void *b);
+
+
+/*!
+ * pperl_inc_snapshot() - Take a snapshot of the modules currently loaded.
+ *
+ *	Copies perl's \%INC hash so that pperl_inc_delta() can later determine
+ *	which modules were loaded in the meantime.
+ *
+ *	@return	Copy of the \%INC hash; must be passed to pperl_inc_delta()
+ *		to be freed.
+ */
+HV *
+pperl_inc_snapshot(pTHX)
+{
+
+	return newHVhv(GvHVn(PL_incgv));
+}
+
+
+/*!
+ * pperl_inc_delta() - Determine which modules were loaded since a snapshot.
+ *
+ *	@param	snapshot	Copy of \%INC returned by pperl_inc_snapshot().
+ *				The snapshot is freed by this routine.
+ *
+ *	@return	Newly-created perl array containing the \%INC keys (e.g.
+ *		"File/Spec.pm") of all modules successfully loaded since the
+ *		snapshot was taken.  The caller owns the reference.
+ */
+AV *
+pperl_inc_delta(pTHX_ HV *snapshot)
+{
+	HV *inc_hv;
+	AV *delta_av;
+	HE *entry;
+	char *key;
+	STRLEN keylen;
+
+	inc_hv = GvHVn(PL_incgv);
+	delta_av = newAV();
+
+	hv_iterinit(inc_hv);
+	while ((entry = hv_iternext(inc_hv)) != NULL) {
+
+		/* Modules which failed to compile have an undefined value. */
+		if (!SvOK(HeVAL(entry)))
+			continue;
+
+		key = HePV(entry, keylen);
+		if (hv_exists(snapshot, key, keylen))
+			continue;
+
+		av_push(delta_av, newSVpvn(key, keylen));
+	}
+
+	SvREFCNT_dec(snapshot);
+
+	return (delta_av);
+}
+
+
+/*!
+ * pperl_manifest_add() - Append an entry to the module load manifest.
+ *
+ *	Records the name of the code which was loaded, how long it took to
+ *	compile, and the modules which were loaded as a consequence.  Does
+ *	nothing unless pperl_manifest_record() has been called to enable
+ *	recording.  Each record is only written once per interpreter, so
+ *	code which is compiled again (e.g. after being evicted) doesn't
+ *	repeat it; callers therefore only add code which compiled
+ *	successfully.
+ *
+ *	The manifest is a plain text file with one tab-separated record per
+ *	line.  Lines starting with "script" record the compile time of the
+ *	named code; lines starting with "module" record the \%INC key of each
+ *	module it pulled in, with the time its require took: compiling and
+ *	running the module, including the modules it uses, as
+ *	pperl_profile_require() measures.
+ *	Lines starting with '#' are comments.
+ *
+ *	@param	interp		Interpreter the code was loaded into.
+ *
+ *	@param	name		Name of the loaded code or module.
+ *
+ *	@param	usec		Time spent compiling, in microseconds.
+ *
+ *	@param	inc_av		Modules loaded; as returned by
+ *				pperl_inc_delta().
+ */
+void
+pperl_manifest_add(perlinterp_t interp, const char *name, uint64_t usec,
+		   AV *inc_av)
+{
+	FILE *fp = interp->pi_manifest;
+	HV *usec_hv = interp->pi_manifest_usec_hv;
+	const char *modname;
+	uint64_t modusec;
+	STRLEN modlen;
+	SV **svp, *key_sv;
+	int i;
+	dTHXa(interp->pi_perl);
+
+	if (fp == NULL)
+		return;
+
+	if (interp->pi_manifest_seen_hv == NULL)
+		interp->pi_manifest_seen_hv = newHV();
+	key_sv = newSVpvf("script\t%s", name);
+
+	if (!hv_exists_ent(interp->pi_manifest_seen_hv, key_sv, 0)) {
+		hv_store_ent(interp->pi_manifest_seen_hv, key_sv,
+			     newSVuv(usec), 0);
+		fprintf(fp, "script\t%" PRIu64 "\t%s\n", usec, name);
+	}
+
+	for (i = 0; i <= av_len(inc_av); i++) {
+		svp = av_fetch(inc_av, i, FALSE);
+		if (svp == NULL)
+			continue;
+		modname = SvPV(*svp, modlen);
+
+		sv_setpvf(key_sv, "module\t%s", modname);
+		if (hv_exists_ent(interp->pi_manifest_seen_hv, key_sv, 0))
+			continue;
+
+		/* Modules loaded other than by require weren't timed. */
+		modusec = 0;
+		if (usec_hv != NULL) {
+			svp = hv_fetch(usec_hv, modname, modlen, FALSE);
+			if (svp != NULL)
+				modusec = SvUV(*svp);
+		}
+
+		hv_store_ent(interp->pi_manifest_seen_hv, key_sv,
+			     newSVuv(modusec), 0);
+		fprintf(fp, "module\t%" PRIu64 "\t%s\n", modusec, modname);
+	}
+
+	SvREFCNT_dec(key_sv);
+
+	if (fflush(fp) != 0)
+		pperl_log(LOG_WARNING, "failed to write module manifest: %m");
+}
+
+
+/*!
+ * pperl_manifest_record() - Record modules loaded by code into a manifest.
+ *
+ *	Once enabled, every subsequent successful call to pperl_load() (and
+ *	the helpers built on it) and pperl_load_module() appends the code's
+ *	compile time and the set of modules it caused to be loaded to the
+ *	given manifest file.  The manifest can later be passed to pperl_preload_manifest()
+ *	to load the same set of modules up front, typically when a new
+ *	interpreter is started.
+ *
+ *	@param	interp		Interpreter to record module loads for.
+ *
+ *	@param	path		Path of the manifest file to append to; it is
+ *				created if it does not exist.  If NULL,
+ *				recording is disabled.
+ *
+ *	@param	result		If non-NULL and the manifest cannot be opened,
+ *				the pperl_errno member is set to indicate the
+ *				cause of the error.
+ */
+void
+pperl_manifest_record(perlinterp_t interp, const char *path,
+		      struct perlresult *result)
+{
+	FILE *fp = NULL;
+
+	pperl_result_clear(result);
+
+	if (path != NULL) {
+		fp = fopen(path, "a");
+		if (fp == NULL) {
+			pperl_log(LOG_ERR, "failed to open module manifest %s: %m",
+				  path);
+			pperl_seterr(interp, errno, result);
+			return;
+		}
+		if (ftell(fp) == 0)
+			fprintf(fp, "# libpperl module manifest\n");
+
+		/* Time each require; see pperl_manifest_add(). */
+		pperl_profile_hook();
+	}
+
+	if (interp->pi_manifest != NULL)
+		fclose(interp->pi_manifest);
+	interp->pi_manifest = fp;
+}
+
+
+/*!
+ * pperl_preload_manifest() - Preload all modules listed in a manifest.
+ *
+ *	Reads a manifest written by pperl_manifest_record() and requires
+ *	every module listed in it, most expensive first.  Loading the costly
+ *	dependencies up front (typically before an interpreter starts serving
+ *	requests) means later calls to pperl_load() find their modules already
+ *	compiled, so their own compile time is small and predictable.
+ *
+ *	Modules which are already loaded into the interpreter are skipped.
+ *	Loading stops at the first module which fails to load.
+ *
+ *	@param	interp		Perl interpreter to load modules into.
+ *
+ *	@param	path		Path of the manifest file to read.
+ *
+ *	@param	penv		Environment variable list to populate \%ENV
+ *				with while loading modules.
+ *
+ *	@param	result		If non-NULL, populated with the result of
+ *				the first module which failed to load.  If the
+ *				manifest cannot be read, the pperl_errno
+ *				member is set to indicate the cause.
+ */
+void
+pperl_preload_manifest(perlinterp_t interp, const char *path,
+		       perlenv_t penv, struct perlresult *result)
+{
+	struct perlresult dummy_result;
+	struct manifest_entry *entries;
+	size_t nentries, maxentries;
+	size_t i, j;
+	PerlInterpreter *orig_perl;
+	char line[PATH_MAX + 64];
+	char *pos, *end;
+	uint64_t usec;
+	FILE *fp;
+	int curdir;
+	dTHXa(interp->pi_perl);
+
+	if (result == NULL)
+		result = &dummy_result;
+	pperl_result_clear(result);
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		pperl_log(LOG_ERR, "failed to open module manifest %s: %m",
+			  path);
+		pperl_seterr(interp, errno, result);
+		return;
+	}
+
+	/*
+	 * Read all module entries from the manifest.  Script entries are
+	 * purely informational and are ignored here.
+	 */
+	maxentries = 32;
+	nentries = 0;
+	entries = pperl_malloc(maxentries * sizeof(*entries));
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "module\t", 7) != 0)
+			continue;
+
+		usec = strtoull(line + 7, &pos, 10);
+		if (*pos != '\t')
+			continue;
+		pos++;
+
+		end = pos + strcspn(pos, "\n");
+		*end = '\0';
+		if (end == pos)
+			continue;
+
+		if (nentries == maxentries) {
+			maxentries *= 2;
+			entries = pperl_realloc(entries,
+					maxentries * sizeof(*entries));
+		}
+		entries[nentries].me_usec = usec;
+		entries[nentries].me_path = pperl_strdup(pos);
+		nentries++;
+	}
+
+	if (ferror(fp)) {
+		pperl_log(LOG_ERR, "failed to read module manifest %s: %m",
+			  path);
+		pperl_seterr(interp, errno, result);
+		fclose(fp);
+		goto done;
+	}
+	fclose(fp);
+
+	/*
+	 * A module may appear in the manifest multiple times (e.g. if it was
+	 * recorded by more than one process).  Collapse duplicates, keeping
+	 * the most expensive cost recorded for each, and then order the
+	 * remaining entries by descending cost.
+	 */
+	qsort(entries, nentries, sizeof(*entries), manifest_entry_bypath);
+	for (i = j = 0; i < nentries; i++) {
+		if (j > 0 &&
+		    strcmp(entries[j - 1].me_path, entries[i].me_path) == 0) {
+			free(entries[i].me_path);
+			continue;
+		}
+		entries[j++] = entries[i];
+	}
+	nentries = j;
+	qsort(entries, nentries, sizeof(*entries), manifest_entry_bycost);
+
+	/* Save the current directory in case the module code changes it. */
+	if (!pperl_curdir_save(interp, &curdir, result))
+		goto done;
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	ENTER;
+	SAVETMPS;
+
+	pperl_setvars(aTHX_ path);
+	pperl_env_populate(aTHX_ penv);
+
+	for (i = 0; i < nentries; i++) {
+		const char *modpath = entries[i].me_path;
+
+		if (hv_exists(GvHVn(PL_incgv), modpath, strlen(modpath)))
+			continue;
+
+		/*
+		 * Entries are \%INC keys, which are file paths rather than
+		 * module names, so they need to be quoted for require.  Paths
+		 * that would need escaping are not something perl generates
+		 * for modules; skip them rather than risk evaluating them.
+		 */
+		if (strpbrk(modpath, "'\\") != NULL) {
+			pperl_log(LOG_WARNING, "%s: skipping module %s",
+				  path, modpath);
+			continue;
+		}
+
+		pperl_require(aTHX_ "'%s'", modpath);
+		if (SvTRUE(ERRSV))
+			break;
+	}
+
+	FREETMPS;
+	LEAVE;
+
+	result->pperl_status = STATUS_CURRENT;
+	if (SvTRUE(ERRSV)) {
+		result->pperl_errmsg = SvPVX(ERRSV);
+		pperl_log(LOG_DEBUG, "%s(%s): %s",
+			  __func__, path, result->pperl_errmsg);
+	}
+
+	PERL_SET_CONTEXT(orig_perl);
+
+	/* Restore the current directory. */
+	pperl_curdir_restore(&curdir);
+
+done:
+	for (i = 0; i < nentries; i++)
+		free(entries[i].me_path);
+	free(entries);
+}
+
+
+/*
+ * qsort(3) comparison routines for manifest entries.
+ */
+int
+manifest_entry_bypath(const void *a, const void *b)
+{
+	const struct manifest_entry *mea = a;
+	const struct manifest_entry *meb = b;
+	int cmp;
+
+	cmp = strcmp(mea->me_path, meb->me_path);
+	if (cmp != 0)
+		return (cmp);
+
+	/* Most expensive first, so it survives duplicate removal. */
+	if (mea->me_usec != meb->me_usec)
+		return (mea->me_usec > meb->me_usec ? -1 : 1);
+	return (0);
+}
+
+int
+manifest_entry_bycost(const void *a, const void *b)
+{
+	const struct manifest_entry *mea = a;
+	const struct manifest_entry *meb = b;
+
+	if (mea->me_usec != meb->me_usec)
+		return (mea->me_usec > meb->me_usec ? -1 : 1);
+	return (strcmp(mea->me_path, meb->me_path));
+}
@@ -39,10 +39,25 @@
 #define	PPERL_NAMESPACE_PUBLIC	"libpperl"
 #define	PPERL_IOLAYER		"pperl"
 
+/*
+ * Maximum number of destroyed argument and environment lists each
+ * interpreter keeps for reuse.
+ */
+#define	PPERL_POOL_MAX		16
+
 
 /* Macro for removing const poisoning.  Use with extreme caution. */
 #define	ignoreconst(exp)	((void *)(intptr_t)(exp))
 
+/* Assign the interpreter context declared by dTHXa(); missing before 5.20. */
+#ifndef aTHXa
+#  ifdef PERL_IMPLICIT_CONTEXT
+#    define	aTHXa(a)	(aTHX = (tTHX)(a))
+#  else
+#    define	aTHXa(a)	NOOP
+#  endif
+#endif
+
 
 
 /*!
@@ -82,7 +97,140 @@
  *
  *	@param	pi_io_head	Linked-list of perlio structures so we can
  *				free them when pperl_destroy() is called.
+ *
+ *	@param	pi_manifest	Stream module load manifest entries are
+ *				appended to; NULL if pperl_manifest_record()
+ *				has not been called.
+ *
+ *	@param	pi_manifest_usec_hv Hash mapping the \%INC keys of modules
+ *				loaded while recording to the time their
+ *				require took, in microseconds.
+ *
+ *	@param	pi_manifest_seen_hv Set of manifest records already written,
+ *				so code compiled again doesn't repeat them.
+ *
+ *	@param	pi_reqprof_root	Root of the module load profile tree; NULL
+ *				if pperl_profile_require() was never called.
+ *
+ *	@param	pi_reqprof_cur	Profile node of the module currently being
+ *				loaded (the parent of any module it requires).
+ *
+ *	@param	pi_reqprof_on	Whether module loads are currently profiled.
+ *
+ *	@param	pi_reqpend_head	Stack of requires whose module is still being
+ *				compiled or run, innermost first.
+ *
+ *	@param	pi_inc_mtime_hv	Hash mapping \%INC keys to the modification
+ *				time of the module's file when it was last
+ *				checked by the module reloader.
+ *
+ *	@param	pi_moddeps_hv	Hash mapping the \%INC keys of modules to
+ *				references to sets of the modules each one
+ *				required while being loaded; see
+ *				pperl_reload_depend().
+ *
+ *	@param	pi_deps_hv	Set of modules required by the code currently
+ *				being compiled, if any.
+ *
+ *	@param	pi_reload_interval Minimum number of seconds between checks
+ *				for modified modules; negative if module
+ *				reloading is disabled.
+ *
+ *	@param	pi_reload_last	Time modules were last checked for changes.
+ *
+ *	@param	pi_code_hash	Hash table of loaded code indexed by name;
+ *				see pperl_code_find().
+ *
+ *	@param	pi_code_hashsize Number of buckets in \a pi_code_hash; always
+ *				a power of two.
+ *
+ *	@param	pi_code_count	Number of entries in \a pi_code_hash.
+ *
+ *	@param	pi_route_root	Root of the prefix trie mapping request paths
+ *				to loaded code; see pperl_route_add().
+ *
+ *	@param	pi_lru_head	Queue of compiled code ordered from most to
+ *				least recently run.
+ *
+ *	@param	pi_code_size	Approximate number of bytes occupied by all
+ *				compiled code in the interpreter.
+ *
+ *	@param	pi_code_budget	Number of bytes compiled code may occupy
+ *				before the least recently run code is
+ *				discarded; zero if unlimited.
+ *
+ *	@param	pi_lazy		Whether pperl_load() defers compilation until
+ *				code is first run.
+ *
+ *	@param	pi_code_pending	Number of lazily loaded pieces of code which
+ *				have not been compiled yet.
+ *
+ *	@param	pi_sighandler	Perl's signal dispatcher, which our own
+ *				dispatcher defers to; see pperl_cancel_init().
+ *
+ *	@param	pi_timeout_msec	Maximum duration of each run; zero if
+ *				unlimited.
+ *
+ *	@param	pi_deadline	Clock reading at which the current run times
+ *				out.
+ *
+ *	@param	pi_cancel	Reason the current run was interrupted
+ *				(ETIMEDOUT or ECANCELED); zero if it wasn't.
+ *
+ *	@param	pi_running	Whether code is currently running.
+ *
+ *	@param	pi_armed	Whether the interpreter is in the watchdog's
+ *				queue of deadlines.
+ *
+ *	@param	pi_watchdog_link Link in the watchdog's queue of deadlines.
+ *
+ *	@param	pi_fiber	Fiber created to run code in the interpreter,
+ *				if any; see pperl_fiber_new().
+ *
+ *	@param	pi_generation	Incremented whenever code is loaded or
+ *				unloaded; see pperl_zygote_new().
+ *
+ *	@param	pi_pkgid	Identifier of the most recently compiled
+ *				code's package; see pperl_compile().
+ *
+ *	@param	pi_errbuf	Holds the error message set by pperl_seterr()
+ *				for the most recent failure in the
+ *				interpreter.
+ *
+ *	@param	pi_request	Request whose standard input and body the
+ *				next pperl_run() should bind; see
+ *				pperl_request_run().
+ *
+ *	@param	pi_args_free	Destroyed argument lists kept for reuse by
+ *				pperl_args_new(), with their buffers intact.
+ *
+ *	@param	pi_env_free	Destroyed environment lists kept for reuse by
+ *				pperl_env_new(), with their hashes intact.
+ *
+ *	@param	pi_call_av	Values returned by the last pperl_call(), kept
+ *				alive so the strings handed back to the caller
+ *				remain valid.
+ *
+ *	@param	pi_capture_out	Buffers the next pperl_run() should capture
+ *	@param	pi_capture_err	STDOUT and STDERR into; see
+ *				pperl_run_capture().
+ *
+ *	@param	pi_defer_av	Subroutine references registered with
+ *				libpperl::defer() during the current run.
+ *
+ *	@param	pi_onComplete	Callback, if any, invoked as soon as each run's
+ *	@param	pi_complete_data output has been flushed, and its data; see
+ *				pperl_run_oncomplete().
+ *
+ *	@param	pi_hwm		High-water marks reached by code run in the
+ *				interpreter; see pperl_hwm_get().
+ *
+ *	The cancellation fields (\a pi_deadline through \a pi_watchdog_link)
+ *	are protected by the watchdog's lock as they are
+ *	accessed by other threads.
  */
+LIST_HEAD(perlcode_list, perlcode);
+
 struct perlinterp {
 	PerlInterpreter		 *pi_perl;
 	AV			 *pi_prologue_av;
@@ -92,6 +240,50 @@ struct perlinterp {
 	LIST_HEAD(, perlcode)	  pi_code_head;
 	LIST_HEAD(, perlenv)	  pi_env_head;
 	LIST_HEAD(, perlio)	  pi_io_head;
+	FILE			 *pi_manifest;
+	HV			 *pi_manifest_usec_hv;
+	HV			 *pi_manifest_seen_hv;
+	struct pperl_reqprof	 *pi_reqprof_root;
+	struct pperl_reqprof	 *pi_reqprof_cur;
+	bool			  pi_reqprof_on;
+	LIST_HEAD(, pperl_reqpend) pi_reqpend_head;
+	HV			 *pi_inc_mtime_hv;
+	HV			 *pi_moddeps_hv;
+	HV			 *pi_deps_hv;
+	int			  pi_reload_interval;
+	time_t			  pi_reload_last;
+	struct perlcode_list	 *pi_code_hash;
+	u_int			  pi_code_hashsize;
+	u_int			  pi_code_count;
+	struct pperl_route	 *pi_route_root;
+	TAILQ_HEAD(perlcode_lru, perlcode) pi_lru_head;
+	size_t			  pi_code_size;
+	size_t			  pi_code_budget;
+	bool			  pi_lazy;
+	u_int			  pi_code_pending;
+	Sighandler_t		  pi_sighandler;
+	u_int			  pi_timeout_msec;
+	uint64_t		  pi_deadline;
+	volatile int		  pi_cancel;
+	bool			  pi_running;
+	bool			  pi_armed;
+	TAILQ_ENTRY(perlinterp)	  pi_watchdog_link;
+	struct perlfiber	 *pi_fiber;
+	u_int			  pi_generation;
+	u_int			  pi_pkgid;
+	char			  pi_errbuf[128];
+	perlrequest_t		  pi_request;
+	LIST_HEAD(, perlargs)	  pi_args_free;
+	u_int			  pi_args_nfree;
+	LIST_HEAD(, perlenv)	  pi_env_free;
+	u_int			  pi_env_nfree;
+	AV			 *pi_call_av;
+	struct pperl_output	 *pi_capture_out;
+	struct pperl_output	 *pi_capture_err;
+	AV			 *pi_defer_av;
+	pperl_complete_t	 *pi_onComplete;
+	intptr_t		  pi_complete_data;
+	struct pperl_hwm	  pi_hwm;
 };
 
 
@@ -111,7 +303,8 @@ struct perlinterp {
  *
  *	@param	pc_sv		Perl reference to the anonymous subroutine
  *				representing the compiled code.  See comments
- *				in pperl_compile() for details.
+ *				in pperl_compile() for details.  NULL if the
+ *				code has been discarded to save memory.
  *
  *	@param	pc_name		Name associated with the code.  This is used
  *				for reporting error messages and is the
@@ -125,8 +318,55 @@ struct perlinterp {
  *
  *	@param	pc_pkgstash	Perl package code was compiled and executes in.
  *
+ *	@param	pc_deps_hv	Set of \%INC keys naming the modules the code
+ *				required when it was compiled, whether or not
+ *				they were already loaded; only recorded while
+ *				module reloading is enabled.
+ *
+ *	@param	pc_usec		Number of microseconds it took to compile the
+ *				code (including any modules it loaded).
+ *
+ *	@param	pc_stale	Set when a module the code depends on has
+ *				been reloaded since the code was compiled,
+ *				but the code couldn't be discarded for lack of
+ *				saved source.
+ *
+ *	@param	pc_hash		Hash of \a pc_name, cached for rehashing.
+ *
+ *	@param	pc_nroutes	Number of routes referring to this code.
+ *
+ *	@param	pc_src		Copy of the code's source text, retained so
+ *				the code can be recompiled after it has been
+ *				discarded; NULL if not retained.
+ *
+ *	@param	pc_srclen	Length of \a pc_src in bytes.
+ *
+ *	@param	pc_size		Approximate number of bytes occupied by the
+ *				compiled code.
+ *
+ *	@param	pc_lastrun	Time the code was last run.
+ *
+ *	@param	pc_pending	Set if the code was loaded lazily and has not
+ *				been compiled yet.
+ *
+ *	@param	pc_initialized	Set once the code's body has run without
+ *				error since it was compiled; see
+ *				pperl_run_handler().
+ *
+ *	@param	pc_handler_hv	Handler subroutines already looked up by
+ *				pperl_run_handler(), as references indexed by
+ *				name; NULL if none have been.
+ *
+ *	@param	pc_outlen	Length of the output captured from the code's
+ *				last run; see pperl_run_capture().
+ *
  *	@param	pc_link		Link in linked list of perlcode structures
  *				associated with the compiling interpreter.
+ *
+ *	@param	pc_hash_link	Link in the interpreter's name hash bucket.
+ *
+ *	@param	pc_lru_link	Link in the interpreter's queue of compiled
+ *				code ordered by when it was last run.
  */
 struct perlcode {
 	perlinterp_t		  pc_interp;
@@ -135,8 +375,23 @@ struct perlcode {
 	char			 *pc_name;
 	u_int			  pc_pkgid; 
 	HV			 *pc_pkgstash;
+	HV			 *pc_deps_hv;
+	uint64_t		  pc_usec;
+	bool			  pc_stale;
+	uint32_t		  pc_hash;
+	u_int			  pc_nroutes;
+	char			 *pc_src;
+	size_t			  pc_srclen;
+	size_t			  pc_size;
+	time_t			  pc_lastrun;
+	bool			  pc_pending;
+	bool			  pc_initialized;
+	HV			 *pc_handler_hv;
+	size_t			  pc_outlen;
 
 	LIST_ENTRY(perlcode)	  pc_link;
+	LIST_ENTRY(perlcode)	  pc_hash_link;
+	TAILQ_ENTRY(perlcode)	  pc_lru_link;
 };
 
 
@@ -178,7 +433,8 @@ struct perlcode {
  *				buffer.
  *
  *	@param	pa_link		Link in linked list of perlargs structures
- *				for the parent interpreter.
+ *				for the parent interpreter, or in its free
+ *				list once destroyed.
  */
 struct perlargs {
 	perlinterp_t	  pa_interp;
@@ -224,7 +480,8 @@ struct perlargs {
  *				elements of perl's \%ENV hash.
  *
  *	@param	pe_link		Link in linked list of perlenv structures
- *				for the parent interpreter.
+ *				for the parent interpreter, or in its free
+ *				list once destroyed.
  */
 struct perlenv {
 	perlinterp_t	  pe_interp;
@@ -235,8 +492,14 @@ struct perlenv {
 };
 
 
-extern void	 pperl_args_populate(perlargs_t pargs);
-extern void	 pperl_env_populate(perlenv_t penv);
+extern void	 pperl_args_populate(pTHX_ perlargs_t pargs);
+extern void	 pperl_env_populate(pTHX_ perlenv_t penv);
+extern void	 pperl_env_detach(pTHX);
+extern void	 pperl_env_export(perlenv_t penv);
+extern void	 pperl_request_populate(pTHX_ perlrequest_t req);
+extern void	 pperl_args_purge(perlinterp_t interp);
+extern SV	*pperl_handler_find(pTHX_ perlcode_t pc, const char *handler);
+extern void	 pperl_env_purge(perlinterp_t interp);
 
 
 /*!
@@ -254,9 +517,19 @@ extern void	 pperl_env_populate(perlenv_t penv);
  *	@param	pio_onClose	Callback, if any, to be invoked when the I/O
  *				handle is closed.
  *
+ *	@param	pio_onSend	Callback, if any, to be handed buffers passed
+ *				to libpperl::send().
+ *
+ *	@param	pio_onSendfile	Callback, if any, to be handed file ranges
+ *				passed to libpperl::sendfile().
+ *
  *	@param	pio_data	Opaque data passed to callbacks when they are
  *				invoked.
  *
+ *	@param	pio_output	Buffer writes are appended to directly, in
+ *				place of calling \a pio_onWrite; see
+ *				pperl_run_capture().
+ *
  *	@param	pio_f		The PerlIO structure representing the perl I/O
  *				handle.
  *
@@ -270,16 +543,42 @@ struct perlio {
 	pperl_io_read_t		*pio_onRead; 
 	pperl_io_write_t	*pio_onWrite;
 	pperl_io_close_t	*pio_onClose;
+	pperl_io_send_t		*pio_onSend;
+	pperl_io_sendfile_t	*pio_onSendfile;
 
 	intptr_t		 pio_data;
+	struct pperl_output	*pio_output;
 
 	PerlIO			*pio_f;
 	perlinterp_t		 pio_interp;
 	LIST_ENTRY(perlio)	 pio_link;
 };
 
-extern void	 pperl_io_init(void);
+
+/*!
+ * @struct perliobuf
+ * @internal
+ *
+ *	A buffer handed off by libpperl::send(), owned by the C side until
+ *	released with pperl_iobuf_release().
+ *
+ *	@param	piob_sv		Scalar holding the buffer.
+ *
+ *	@param	piob_interp	The persistent perl interpreter the scalar
+ *				belongs to.
+ */
+struct perliobuf {
+	SV			*piob_sv;
+	perlinterp_t		 piob_interp;
+};
+
+extern void	 pperl_io_init(pTHX);
 extern void	 pperl_io_destroy(perlio_t *piop);
+extern void	 pperl_io_detach(perlinterp_t interp);
+extern void	 pperl_io_capture(pTHX_ perlinterp_t interp, const char *name,
+				  struct pperl_output *out);
+extern void	 pperl_io_input(pTHX_ const char *name, const char *buf,
+				size_t len);
 
 
 /*!
@@ -295,11 +594,74 @@ enum pperl_calllist_flags {
 	CONTINUE_ON_ERROR	= 0x10
 };
 
-extern void	 pperl_calllist_run(AV *calllist, const HV *pkgstash,
+extern void	 pperl_calllist_run(pTHX_ AV *calllist, const HV *pkgstash,
 				    enum pperl_calllist_flags flags);
-extern void	 pperl_calllist_clear(AV *calllist, const HV *pkgstash);
-
-extern void	 pperl_seterr(int errnum, struct perlresult *result);
+extern void	 pperl_calllist_clear(pTHX_ AV *calllist, const HV *pkgstash);
+extern HV	*pperl_calllist_stashset(pTHX);
+extern void	 pperl_calllist_stashset_add(pTHX_ HV *set, const HV *pkgstash,
+					     const char *name);
+extern void	 pperl_calllist_clear_set(pTHX_ AV *calllist, HV *set);
+extern void	 pperl_calllist_run_set(pTHX_ AV *calllist, HV *set);
+
+extern HV	*pperl_inc_snapshot(pTHX);
+extern AV	*pperl_inc_delta(pTHX_ HV *snapshot);
+extern void	 pperl_manifest_add(perlinterp_t interp, const char *name,
+				    uint64_t usec, AV *inc_av);
+
+extern void	 pperl_profile_free(perlinterp_t interp);
+extern void	 pperl_profile_hook(void);
+
+extern void	 pperl_reload_depend(pTHX_ perlinterp_t interp,
+				     const char *requirer, const char *name,
+				     STRLEN namelen);
+extern void	 pperl_reload_check(perlinterp_t interp, perlenv_t penv,
+				    bool force, struct perlresult *result);
+
+extern bool	 pperl_compile(perlcode_t pc, perlenv_t penv,
+			       const char *code, size_t codelen,
+			       struct perlresult *result);
+extern void	 pperl_discard(perlcode_t pc);
+
+extern void	 pperl_lru_insert(perlcode_t pc, I32 svcount);
+extern void	 pperl_lru_remove(perlcode_t pc);
+extern void	 pperl_lru_touch(perlcode_t pc, I32 svcount);
+extern void	 pperl_lru_trim(perlinterp_t interp, perlcode_t keep);
+
+extern void	 pperl_lazy_done(perlcode_t pc);
+
+extern void	 pperl_hwm_record(pTHX_ perlinterp_t interp);
+extern void	 pperl_hwm_presize(pTHX_ perlinterp_t interp);
+
+extern bool	 pperl_fiber_park(perlinterp_t interp);
+extern bool	 pperl_fiber_parked(perlinterp_t interp);
+
+extern void	 pperl_cancel_init(perlinterp_t interp);
+extern void	 pperl_cancel_arm(perlinterp_t interp);
+extern int	 pperl_cancel_disarm(perlinterp_t interp);
+
+extern void	 pperl_registry_add(perlcode_t pc);
+extern void	 pperl_registry_remove(perlcode_t pc);
+extern void	 pperl_registry_destroy(perlinterp_t interp);
+extern uint32_t	 pperl_registry_hash(const char *name);
+
+extern uint64_t	 pperl_clock(void);
+
+struct pperl_queue;
+extern struct pperl_queue *pperl_queue_new(u_int depth);
+extern void	 pperl_queue_free(struct pperl_queue *pq);
+extern bool	 pperl_queue_push(struct pperl_queue *pq, void *item);
+extern void	*pperl_queue_pop(struct pperl_queue *pq);
+extern u_int	 pperl_queue_depth(const struct pperl_queue *pq);
+
+extern perlinterp_t pperl_current_interp(pTHX);
+extern void	 pperl_seterr(perlinterp_t interp, int errnum,
+			      struct perlresult *result);
+extern bool	 pperl_curdir_save(perlinterp_t interp, int *fdp,
+				   struct perlresult *result);
+extern void	 pperl_curdir_restore(int *fdp);
+extern void	 pperl_setvars(pTHX_ const char *procname);
+extern void	 pperl_require(pTHX_ const char *fmt, ...)
+			__attribute__ ((format (printf, pTHX_1, pTHX_2)));
 
 extern void	*pperl_malloc(size_t size);
 extern void	*pperl_realloc(void *ptr, size_t size);
@@ -0,0 +1,670 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*
+ * @struct pperl_reqprof
+ *
+ * Profile of a single module load.  Nodes form a tree mirroring the order
+ * modules were required in: a module's children are the modules which were
+ * first loaded while it was being compiled or run.  The root node represents the
+ * interpreter itself.
+ *
+ *	@param	rp_name		\%INC key of the module (e.g. "File/Spec.pm").
+ *
+ *	@param	rp_usec		Inclusive time spent compiling and running
+ *				the module, including the time spent loading
+ *				child modules.
+ *
+ *	@param	rp_bytes	Size of the module's source file.
+ *
+ *	@param	rp_svs		Net number of perl scalars allocated while
+ *				loading the module (including children).
+ *
+ *	@param	rp_failed	True if the module failed to load.
+ */
+struct pperl_reqprof {
+	char				*rp_name;
+	uint64_t			 rp_usec;
+	off_t				 rp_bytes;
+	IV				 rp_svs;
+	bool				 rp_failed;
+
+	struct pperl_reqprof		*rp_parent;
+	TAILQ_HEAD(, pperl_reqprof)	 rp_children;
+	TAILQ_ENTRY(pperl_reqprof)	 rp_link;
+};
+
+
+/*
+ * @struct pperl_reqpend
+ *
+ * A module load which has started but not yet finished.  Perl's require
+ * op only compiles the module; its body is run afterwards, inside the eval
+ * context the require pushed, and the load completes when that context is
+ * left.  Pending loads form a stack, innermost first.
+ *
+ *	@param	rq_name		\%INC key of the module being loaded.
+ *
+ *	@param	rq_namesv	Name perl recorded in the module's eval
+ *				context; NULL until the require op returns.
+ *
+ *	@param	rq_si		Perl stack the module's eval context is on;
+ *				BEGIN blocks are run on stacks of their own.
+ *
+ *	@param	rq_cxix		Index of the module's eval context.
+ *
+ *	@param	rq_node		Profile node of the module; NULL if only a
+ *				manifest is being recorded.
+ *
+ *	@param	rq_start	When the require started.
+ *
+ *	@param	rq_svcount	Number of perl scalars when it started.
+ *
+ *	@param	rq_inop		Whether pperl_pp_require() is still running
+ *				for this load (and so will free it).
+ *
+ *	@param	rq_done		Whether the load has been completed.
+ */
+struct pperl_reqpend {
+	char				*rq_name;
+	SV				*rq_namesv;
+	PERL_SI				*rq_si;
+	I32				 rq_cxix;
+	struct pperl_reqprof		*rq_node;
+	uint64_t			 rq_start;
+	IV				 rq_svcount;
+	bool				 rq_inop;
+	bool				 rq_done;
+
+	LIST_ENTRY(pperl_reqpend)	 rq_link;
+};
+
+
+/* Whether a context is the eval context of a require. */
+#ifdef CxOLD_OP_TYPE
+#define	PPERL_CX_IS_REQUIRE(cx)						\
+	(CxTYPE(cx) == CXt_EVAL && CxOLD_OP_TYPE(cx) == OP_REQUIRE)
+#else
+#define	PPERL_CX_IS_REQUIRE(cx)						\
+	(CxTYPE(cx) == CXt_EVAL && (cx)->blk_eval.old_op_type == OP_REQUIRE)
+#endif
+
+
+static void			 pperl_profile_install(void);
+static OP			*pperl_pp_require(pTHX);
+static OP			*pperl_pp_leaveeval(pTHX);
+static bool			 pperl_reqpend_live(pTHX_
+					struct pperl_reqpend *rq);
+static void			 pperl_reqpend_unwind(pTHX_
+					perlinterp_t interp);
+static void			 pperl_reqpend_finish(pTHX_
+					perlinterp_t interp,
+					struct pperl_reqpend *rq, bool failed);
+static struct pperl_reqprof	*pperl_reqprof_new(const char *name,
+					struct pperl_reqprof *parent);
+static void			 pperl_reqprof_free(struct pperl_reqprof *rp);
+static void			 pperl_reqprof_print(FILE *fp,
+					struct pperl_reqprof *rp, int depth);
+static int			 pperl_reqprof_bycost(const void *a,
+						      const void *b);
+
+
+/*
+ * Perl's original implementations of the require and leaveeval ops.  The
+ * op table is shared by all interpreters in the process, so the hooks are
+ * installed once and check whether profiling is enabled for the calling
+ * interpreter.
+ */
+static pthread_once_t pperl_hook_once = PTHREAD_ONCE_INIT;
+static Perl_ppaddr_t pperl_pp_require_orig = NULL;
+static Perl_ppaddr_t pperl_pp_leaveeval_orig = NULL;
+
+
+/*!
+ * pperl_profile_require() - Enable or disable profiling of module loads.
+ *
+ *	When enabled, every module loaded via require (or use) is timed and
+ *	recorded in a tree reflecting which module pulled in which; see
+ *	pperl_profile_report().  This works by wrapping perl's require op, so
+ *	only code compiled after profiling is enabled is measured.  The
+ *	intent is to enable profiling immediately after pperl_new(), load the
+ *	application's code, and then report where startup time went.
+ *
+ *	The time recorded for a module covers compiling it, including any
+ *	modules it uses (since those are loaded by BEGIN blocks during
+ *	compilation), and then running its body, including any modules the
+ *	body requires.
+ *
+ *	@param	interp		Interpreter to profile.
+ *
+ *	@param	enable		If true, discard any previously collected
+ *				profile and start a new one.  If false, stop
+ *				collecting; the profile collected so far is
+ *				retained for pperl_profile_report().
+ */
+void
+pperl_profile_require(perlinterp_t interp, bool enable)
+{
+	PerlInterpreter *orig_perl;
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	if (enable) {
+		pperl_profile_free(interp);
+		interp->pi_reqprof_root = pperl_reqprof_new("(interpreter)",
+							    NULL);
+		interp->pi_reqprof_cur = interp->pi_reqprof_root;
+		pperl_profile_hook();
+	}
+
+	interp->pi_reqprof_on = enable;
+
+	PERL_SET_CONTEXT(orig_perl);
+}
+
+
+/*!
+ * pperl_profile_report() - Write the module load profile as a tree.
+ *
+ *	Writes one line per module loaded since pperl_profile_require()
+ *	enabled profiling.  Each line lists the inclusive and exclusive
+ *	load time (in milliseconds), the size of the module's source file,
+ *	the net number of perl scalars allocated while loading it, and the
+ *	module's name indented according to its depth in the dependency tree.
+ *	Siblings are sorted by descending inclusive time so the dependency
+ *	dominating startup is always listed first.
+ *
+ *	@param	interp		Interpreter to report the profile of.
+ *
+ *	@param	fp		Stream to write the report to.
+ */
+void
+pperl_profile_report(perlinterp_t interp, FILE *fp)
+{
+	struct pperl_reqprof *root = interp->pi_reqprof_root;
+	struct pperl_reqprof *child;
+	PerlInterpreter *orig_perl;
+	dTHXa(interp->pi_perl);
+
+	if (root == NULL)
+		return;
+
+	/* Close loads left pending by modules whose body died. */
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+	pperl_reqpend_unwind(aTHX_ interp);
+	PERL_SET_CONTEXT(orig_perl);
+
+	/* The root's cost is the sum of all top-level module loads. */
+	root->rp_usec = 0;
+	root->rp_svs = 0;
+	root->rp_bytes = 0;
+	TAILQ_FOREACH(child, &root->rp_children, rp_link) {
+		root->rp_usec += child->rp_usec;
+		root->rp_svs += child->rp_svs;
+		root->rp_bytes += child->rp_bytes;
+	}
+
+	fprintf(fp, "%10s %10s %10s %10s  %s\n",
+		"incl(ms)", "excl(ms)", "bytes", "SVs", "module");
+	pperl_reqprof_print(fp, root, 0);
+	fflush(fp);
+}
+
+
+/*!
+ * pperl_profile_free() - Free any module load profile of an interpreter.
+ *
+ *	Called by pperl_destroy() and whenever a new profile is started.
+ */
+void
+pperl_profile_free(perlinterp_t interp)
+{
+
+	struct pperl_reqpend *rq;
+
+	while ((rq = LIST_FIRST(&interp->pi_reqpend_head)) != NULL) {
+		LIST_REMOVE(rq, rq_link);
+		free(rq->rq_name);
+		free(rq);
+	}
+
+	if (interp->pi_reqprof_root != NULL)
+		pperl_reqprof_free(interp->pi_reqprof_root);
+	interp->pi_reqprof_root = NULL;
+	interp->pi_reqprof_cur = NULL;
+	interp->pi_reqprof_on = false;
+}
+
+
+/*!
+ * pperl_profile_hook() - Install the wrappers around perl's require ops.
+ *
+ *	Used by the profiler and pperl_manifest_record(), which need the
+ *	time each module took to load, and by the module reloader, which
+ *	needs to know which code and modules depend on which modules.  The op table is shared by every
+ *	interpreter in the process, so the wrappers are installed exactly
+ *	once no matter how many threads call this.
+ */
+void
+pperl_profile_hook(void)
+{
+
+	pthread_once(&pperl_hook_once, pperl_profile_install);
+}
+
+
+/*
+ * pperl_profile_install() - Replace perl's require and leaveeval ops.
+ */
+void
+pperl_profile_install(void)
+{
+
+	pperl_pp_require_orig = PL_ppaddr[OP_REQUIRE];
+	PL_ppaddr[OP_REQUIRE] = pperl_pp_require;
+	pperl_pp_leaveeval_orig = PL_ppaddr[OP_LEAVEEVAL];
+	PL_ppaddr[OP_LEAVEEVAL] = pperl_pp_leaveeval;
+}
+
+
+/*!
+ * pperl_pp_require() - Profiling wrapper around perl's require op.
+ *
+ *	Starts timing each module which is actually loaded (version checks
+ *	and modules already in \%INC are passed straight through) and then
+ *	invokes perl's own implementation.  That only compiles the module:
+ *	its body is run afterwards by the caller's run loop, so the load is
+ *	normally completed by pperl_pp_leaveeval().  If the require dies,
+ *	the exception is intercepted just long enough to close the profile
+ *	node before being propogated on.  While module reloading is enabled,
+ *	every require (even of a module which is already loaded) is also
+ *	noted as a dependency; see pperl_reload_depend().
+ */
+OP *
+pperl_pp_require(pTHX)
+{
+	perlinterp_t interp;
+	struct pperl_reqpend *rq;
+	const char *name;
+	STRLEN namelen;
+	SV *sv, **svp;
+	OP *nextop;
+	bool mustcatch;
+	int ret;
+	dSP;
+	dJMPENV;
+
+	interp = pperl_current_interp(aTHX);
+	if (interp == NULL ||
+	    (!interp->pi_reqprof_on && interp->pi_manifest == NULL &&
+	     interp->pi_reload_interval < 0))
+		return pperl_pp_require_orig(aTHX);
+
+	/* Version checks (e.g. "require 5.006") don't load anything. */
+	sv = TOPs;
+	if (SvNIOKp(sv))
+		return pperl_pp_require_orig(aTHX);
+#ifdef SvVOK
+	if (SvVOK(sv))
+		return pperl_pp_require_orig(aTHX);
+#endif
+
+	name = SvPV(sv, namelen);
+
+	/* Close loads whose body died since the last require. */
+	pperl_reqpend_unwind(aTHX_ interp);
+
+	/*
+	 * Whatever is requiring the module (the innermost module being
+	 * loaded, else the code being compiled) depends on it, even if it
+	 * is already loaded.
+	 */
+	if (interp->pi_reload_interval >= 0) {
+		rq = LIST_FIRST(&interp->pi_reqpend_head);
+		pperl_reload_depend(aTHX_ interp,
+				    rq != NULL ? rq->rq_name : NULL,
+				    name, namelen);
+	}
+
+	/* Requires for modules which are already loaded load nothing. */
+	svp = hv_fetch(GvHVn(PL_incgv), name, namelen, FALSE);
+	if (svp != NULL && SvTRUE(*svp))
+		return pperl_pp_require_orig(aTHX);
+
+	/*
+	 * The require pops its argument, so keep a copy of the name.  The
+	 * eval context perl pushes for the module will be the next one.
+	 */
+	rq = pperl_malloc(sizeof(*rq));
+	rq->rq_name = pperl_strdup(name);
+	rq->rq_namesv = NULL;
+	rq->rq_si = PL_curstackinfo;
+	rq->rq_cxix = cxstack_ix + 1;
+	rq->rq_node = NULL;
+	rq->rq_inop = true;
+	rq->rq_done = false;
+	if (interp->pi_reqprof_on) {
+		rq->rq_node = pperl_reqprof_new(name, interp->pi_reqprof_cur);
+		interp->pi_reqprof_cur = rq->rq_node;
+	}
+	LIST_INSERT_HEAD(&interp->pi_reqpend_head, rq, rq_link);
+	rq->rq_svcount = PL_sv_count;
+	rq->rq_start = pperl_clock();
+	nextop = NULL;
+
+	/*
+	 * Trap exceptions so the profile tree stays consistent if the module
+	 * fails to compile.  Preserve the caller's notion of whether a nested
+	 * run loop is needed to catch exceptions; require relies on it.
+	 */
+	mustcatch = CATCH_GET;
+	JMPENV_PUSH(ret);
+	CATCH_SET(mustcatch);
+	if (ret == 0)
+		nextop = pperl_pp_require_orig(aTHX);
+	JMPENV_POP;
+
+	/*
+	 * If perl ran the module's body in a nested run loop, the load has
+	 * already been closed by pperl_pp_leaveeval().  Otherwise the body
+	 * is yet to run and the module's eval context is on the context
+	 * stack, unless the module failed to compile.
+	 */
+	rq->rq_inop = false;
+	if (rq->rq_done)
+		free(rq);
+	else if (!pperl_reqpend_live(aTHX_ rq))
+		pperl_reqpend_unwind(aTHX_ interp);
+	else if (ret == 0)
+		rq->rq_namesv = cxstack[rq->rq_cxix].blk_eval.old_namesv;
+
+	if (ret != 0)
+		JMPENV_JUMP(ret);
+
+	return (nextop);
+}
+
+
+/*!
+ * pperl_pp_leaveeval() - Profiling wrapper around perl's leaveeval op.
+ *
+ *	Completes the load started by pperl_pp_require() once the module's
+ *	body has finished running, so the time recorded covers both
+ *	compiling and running the module.  Evals other than requires are
+ *	passed straight through.
+ */
+OP *
+pperl_pp_leaveeval(pTHX)
+{
+	perlinterp_t interp;
+	struct pperl_reqpend *rq;
+	PERL_CONTEXT *cx;
+	SV *namesv;
+	I32 cxix;
+	OP *nextop;
+	bool mustcatch;
+	int ret;
+	dJMPENV;
+
+	cx = &cxstack[cxstack_ix];
+	if (!PPERL_CX_IS_REQUIRE(cx))
+		return pperl_pp_leaveeval_orig(aTHX);
+
+	interp = pperl_current_interp(aTHX);
+	if (interp == NULL || LIST_EMPTY(&interp->pi_reqpend_head))
+		return pperl_pp_leaveeval_orig(aTHX);
+
+	pperl_reqpend_unwind(aTHX_ interp);
+	rq = LIST_FIRST(&interp->pi_reqpend_head);
+	cxix = cxstack_ix;
+	namesv = cx->blk_eval.old_namesv;
+	if (rq == NULL || rq->rq_si != PL_curstackinfo ||
+	    rq->rq_cxix != cxix ||
+	    (rq->rq_namesv != NULL && rq->rq_namesv != namesv))
+		return pperl_pp_leaveeval_orig(aTHX);
+
+	/* A module which doesn't return true fails here. */
+	nextop = NULL;
+	mustcatch = CATCH_GET;
+	JMPENV_PUSH(ret);
+	CATCH_SET(mustcatch);
+	if (ret == 0)
+		nextop = pperl_pp_leaveeval_orig(aTHX);
+	JMPENV_POP;
+
+	pperl_reqpend_finish(aTHX_ interp, rq, ret != 0);
+
+	if (ret != 0)
+		JMPENV_JUMP(ret);
+
+	return (nextop);
+}
+
+
+/*
+ * pperl_reqpend_live() - Check whether a pending load is still running.
+ *
+ *	A module whose body dies is unwound without reaching leaveeval, so
+ *	its load remains pending until its eval context is found to be gone.
+ */
+bool
+pperl_reqpend_live(pTHX_ struct pperl_reqpend *rq)
+{
+	PERL_CONTEXT *cx;
+	PERL_SI *si;
+
+	for (si = PL_curstackinfo; si != NULL; si = si->si_prev)
+		if (si == rq->rq_si)
+			break;
+	if (si == NULL || rq->rq_cxix > si->si_cxix)
+		return (false);
+	cx = &si->si_cxstack[rq->rq_cxix];
+	if (!PPERL_CX_IS_REQUIRE(cx))
+		return (false);
+	return (rq->rq_namesv == NULL ||
+		rq->rq_namesv == cx->blk_eval.old_namesv);
+}
+
+
+/*
+ * pperl_reqpend_unwind() - Close pending loads whose module died.
+ */
+void
+pperl_reqpend_unwind(pTHX_ perlinterp_t interp)
+{
+	struct pperl_reqpend *rq;
+
+	while ((rq = LIST_FIRST(&interp->pi_reqpend_head)) != NULL &&
+	       !pperl_reqpend_live(aTHX_ rq))
+		pperl_reqpend_finish(aTHX_ interp, rq, true);
+}
+
+
+/*
+ * pperl_reqpend_finish() - Record the cost of a completed module load.
+ *
+ *	The time taken by each successful load is also noted for
+ *	pperl_manifest_add() when a manifest is being recorded.
+ */
+void
+pperl_reqpend_finish(pTHX_ perlinterp_t interp, struct pperl_reqpend *rq,
+		     bool failed)
+{
+	struct pperl_reqprof *node = rq->rq_node;
+	struct stat sb;
+	uint64_t usec;
+	SV **svp;
+
+	usec = pperl_clock() - rq->rq_start;
+	LIST_REMOVE(rq, rq_link);
+
+	if (!failed && interp->pi_manifest != NULL) {
+		if (interp->pi_manifest_usec_hv == NULL)
+			interp->pi_manifest_usec_hv = newHV();
+		hv_store(interp->pi_manifest_usec_hv, rq->rq_name,
+			 strlen(rq->rq_name), newSVuv(usec), 0);
+	}
+
+	if (node != NULL) {
+		node->rp_usec = usec;
+		node->rp_svs = PL_sv_count - rq->rq_svcount;
+		node->rp_failed = failed;
+		interp->pi_reqprof_cur = node->rp_parent;
+
+		/* Lookup the file the module was loaded from for its size. */
+		svp = hv_fetch(GvHVn(PL_incgv), rq->rq_name,
+			       strlen(rq->rq_name), FALSE);
+		if (svp != NULL && SvPOK(*svp) &&
+		    stat(SvPVX(*svp), &sb) == 0)
+			node->rp_bytes = sb.st_size;
+	}
+
+	/* pperl_pp_require() frees loads it is still waiting on itself. */
+	free(rq->rq_name);
+	rq->rq_name = NULL;
+	rq->rq_done = true;
+	if (!rq->rq_inop)
+		free(rq);
+}
+
+
+/*
+ * pperl_reqprof_new() - Allocate a profile node, linking it to its parent.
+ */
+struct pperl_reqprof *
+pperl_reqprof_new(const char *name, struct pperl_reqprof *parent)
+{
+	struct pperl_reqprof *rp;
+
+	rp = pperl_malloc(sizeof(*rp));
+	rp->rp_name = pperl_strdup(name);
+	rp->rp_usec = 0;
+	rp->rp_bytes = 0;
+	rp->rp_svs = 0;
+	rp->rp_failed = false;
+	rp->rp_parent = parent;
+	TAILQ_INIT(&rp->rp_children);
+
+	if (parent != NULL)
+		TAILQ_INSERT_TAIL(&parent->rp_children, rp, rp_link);
+
+	return (rp);
+}
+
+
+/*
+ * pperl_reqprof_free() - Free a profile node and all of its children.
+ */
+void
+pperl_reqprof_free(struct pperl_reqprof *rp)
+{
+	struct pperl_reqprof *child;
+
+	while (!TAILQ_EMPTY(&rp->rp_children)) {
+		child = TAILQ_FIRST(&rp->rp_children);
+		TAILQ_REMOVE(&rp->rp_children, child, rp_link);
+		pperl_reqprof_free(child);
+	}
+
+	free(rp->rp_name);
+	free(rp);
+}
+
+
+/*
+ * pperl_reqprof_print() - Print a profile node and its children.
+ */
+void
+pperl_reqprof_print(FILE *fp, struct pperl_reqprof *rp, int depth)
+{
+	struct pperl_reqprof **children;
+	struct pperl_reqprof *child;
+	uint64_t childusec;
+	int nchildren;
+	int i;
+
+	childusec = 0;
+	nchildren = 0;
+	TAILQ_FOREACH(child, &rp->rp_children, rp_link) {
+		childusec += child->rp_usec;
+		nchildren++;
+	}
+
+	fprintf(fp, "%10.3f %10.3f %10jd %10jd  %*s%s%s\n",
+		rp->rp_usec / 1000.0,
+		(rp->rp_usec > childusec ? rp->rp_usec - childusec : 0) /
+		    1000.0,
+		(intmax_t)rp->rp_bytes, (intmax_t)rp->rp_svs,
+		depth * 2, "", rp->rp_name,
+		rp->rp_failed ? " (failed)" : "");
+
+	if (nchildren == 0)
+		return;
+
+	children = pperl_malloc(nchildren * sizeof(*children));
+	i = 0;
+	TAILQ_FOREACH(child, &rp->rp_children, rp_link)
+		children[i++] = child;
+	qsort(children, nchildren, sizeof(*children), pperl_reqprof_bycost);
+
+	for (i = 0; i < nchildren; i++)
+		pperl_reqprof_print(fp, children[i], depth + 1);
+
+	free(children);
+}
+
+
+/*
+ * qsort(3) comparison routine ordering profile nodes by descending
+ * inclusive time.
+ */
+int
+pperl_reqprof_bycost(const void *a, const void *b)
+{
+	const struct pperl_reqprof *rpa = *(struct pperl_reqprof * const *)a;
+	const struct pperl_reqprof *rpb = *(struct pperl_reqprof * const *)b;
+
+	if (rpa->rp_usec != rpb->rp_usec)
+		return (rpa->rp_usec > rpb->rp_usec ? -1 : 1);
+	return (strcmp(rpa->rp_name, rpb->rp_name));
+}
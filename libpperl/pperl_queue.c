@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*
+ * Size of a cache line; the producer and consumer positions are kept on
+ * separate cache lines so producers and consumers don't contend for them.
+ */
+#define	CACHELINE_SIZE		64
+
+
+/*
+ * @struct pperl_queue
+ *
+ * Bounded multiple-producer, multiple-consumer queue which does not use
+ * locks.  This is Dmitry Vyukov's array-based design: every cell carries a
+ * sequence number which tells producers and consumers whether the cell is
+ * ready for them, so the only contended operation is a compare-and-swap
+ * on the respective position counter.
+ *
+ *	@param	pq_cells	Ring of queue cells.
+ *
+ *	@param	pq_mask		Number of cells in \a pq_cells minus one; the
+ *				number of cells is always a power of two.
+ *
+ *	@param	pq_enqueue	Position the next item will be pushed at.
+ *
+ *	@param	pq_dequeue	Position the next item will be popped from.
+ */
+struct pperl_queue_cell {
+	volatile size_t		 pqc_seq;
+	void			*pqc_item;
+};
+
+struct pperl_queue {
+	struct pperl_queue_cell	*pq_cells;
+	size_t			 pq_mask;
+	char			 pq_pad0[CACHELINE_SIZE];
+	volatile size_t		 pq_enqueue;
+	char			 pq_pad1[CACHELINE_SIZE];
+	volatile size_t		 pq_dequeue;
+	char			 pq_pad2[CACHELINE_SIZE];
+};
+
+
+/*!
+ * pperl_queue_new() - Create a bounded lock-free queue.
+ *
+ *	@param	depth		Minimum number of items the queue must hold;
+ *				rounded up to a power of two.
+ *
+ *	@return	New, empty queue.
+ */
+struct pperl_queue *
+pperl_queue_new(u_int depth)
+{
+	struct pperl_queue *pq;
+	size_t size, i;
+
+	for (size = 2; size < depth; size <<= 1)
+		continue;
+
+	pq = pperl_malloc(sizeof(*pq));
+	memset(pq, 0, sizeof(*pq));
+	pq->pq_cells = pperl_malloc(size * sizeof(*pq->pq_cells));
+	pq->pq_mask = size - 1;
+
+	for (i = 0; i < size; i++) {
+		pq->pq_cells[i].pqc_seq = i;
+		pq->pq_cells[i].pqc_item = NULL;
+	}
+
+	return (pq);
+}
+
+
+/*!
+ * pperl_queue_free() - Free a queue.
+ *
+ *	The queue must not be in use by any other thread; items still in
+ *	the queue are not freed.
+ */
+void
+pperl_queue_free(struct pperl_queue *pq)
+{
+
+	free(pq->pq_cells);
+	free(pq);
+}
+
+
+/*!
+ * pperl_queue_push() - Add an item to the tail of a queue.
+ *
+ *	May be called by any number of threads concurrently.
+ *
+ *	@return	True if the item was queued; false if the queue is full.
+ */
+bool
+pperl_queue_push(struct pperl_queue *pq, void *item)
+{
+	struct pperl_queue_cell *cell;
+	size_t pos, seq;
+	intptr_t dif;
+
+	pos = pq->pq_enqueue;
+	for (;;) {
+		cell = &pq->pq_cells[pos & pq->pq_mask];
+		seq = cell->pqc_seq;
+		__sync_synchronize();
+
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			/* Cell is free; try to claim it. */
+			if (__sync_bool_compare_and_swap(&pq->pq_enqueue,
+							 pos, pos + 1))
+				break;
+			pos = pq->pq_enqueue;
+		}
+		else if (dif < 0) {
+			/* Cell still holds an item from a lap ago: full. */
+			return false;
+		}
+		else {
+			/* Another producer got here first. */
+			pos = pq->pq_enqueue;
+		}
+	}
+
+	cell->pqc_item = item;
+	__sync_synchronize();
+	cell->pqc_seq = pos + 1;
+
+	return true;
+}
+
+
+/*!
+ * pperl_queue_pop() - Remove the item at the head of a queue.
+ *
+ *	May be called by any number of threads concurrently.
+ *
+ *	@return	The item removed, or NULL if the queue is empty.
+ */
+void *
+pperl_queue_pop(struct pperl_queue *pq)
+{
+	struct pperl_queue_cell *cell;
+	size_t pos, seq;
+	intptr_t dif;
+	void *item;
+
+	pos = pq->pq_dequeue;
+	for (;;) {
+		cell = &pq->pq_cells[pos & pq->pq_mask];
+		seq = cell->pqc_seq;
+		__sync_synchronize();
+
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			/* Cell holds an item; try to claim it. */
+			if (__sync_bool_compare_and_swap(&pq->pq_dequeue,
+							 pos, pos + 1))
+				break;
+			pos = pq->pq_dequeue;
+		}
+		else if (dif < 0) {
+			/* Producer hasn't filled the cell yet: empty. */
+			return (NULL);
+		}
+		else {
+			/* Another consumer got here first. */
+			pos = pq->pq_dequeue;
+		}
+	}
+
+	item = cell->pqc_item;
+	__sync_synchronize();
+	cell->pqc_seq = pos + pq->pq_mask + 1;
+
+	return (item);
+}
+
+
+/*!
+ * pperl_queue_depth() - Report the approximate number of items queued.
+ *
+ *	The result is only a snapshot as other threads may be pushing or
+ *	popping items concurrently.
+ */
+u_int
+pperl_queue_depth(const struct pperl_queue *pq)
+{
+	size_t enqueue, dequeue;
+
+	dequeue = pq->pq_dequeue;
+	enqueue = pq->pq_enqueue;
+
+	return (enqueue > dequeue ? (u_int)(enqueue - dequeue) : 0);
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/* Initial number of buckets in the name hash; must be a power of two. */
+#define	REGISTRY_INITSIZE	64
+
+
+/*
+ * @struct pperl_route
+ *
+ * Node in the prefix trie used to route request paths to loaded code.
+ * Each node represents the path prefix spelled out by the bytes on the
+ * edges leading to it from the root.
+ *
+ *	@param	rt_pc		Code registered for this exact prefix, if any.
+ *
+ *	@param	rt_edges	Edges to child nodes, sorted by byte value so
+ *				they can be binary searched.
+ *
+ *	@param	rt_nedges	Number of entries in the \a rt_edges array.
+ *
+ *	@param	rt_maxedges	Number of entries \a rt_edges can hold.
+ */
+struct pperl_route_edge {
+	u_char			 re_byte;
+	struct pperl_route	*re_node;
+};
+
+struct pperl_route {
+	perlcode_t		 rt_pc;
+	struct pperl_route_edge	*rt_edges;
+	int			 rt_nedges;
+	int			 rt_maxedges;
+};
+
+
+static void			 pperl_registry_grow(perlinterp_t interp);
+static struct pperl_route	*pperl_route_child(struct pperl_route *rt,
+						   u_char byte, bool create);
+static bool			 pperl_route_purge(struct pperl_route *rt,
+						   perlcode_t pc);
+
+
+/*!
+ * pperl_registry_add() - Add loaded code to the interpreter's name index.
+ *
+ *	Called by pperl_load() for every piece of code loaded.
+ */
+void
+pperl_registry_add(perlcode_t pc)
+{
+	perlinterp_t interp = pc->pc_interp;
+
+	if (interp->pi_code_count >= interp->pi_code_hashsize)
+		pperl_registry_grow(interp);
+
+	pc->pc_hash = pperl_registry_hash(pc->pc_name);
+	LIST_INSERT_HEAD(&interp->pi_code_hash[pc->pc_hash &
+			 (interp->pi_code_hashsize - 1)], pc, pc_hash_link);
+	interp->pi_code_count++;
+}
+
+
+/*!
+ * pperl_registry_remove() - Remove code from the name index and router.
+ *
+ *	Called by pperl_unload() before the code is freed.
+ */
+void
+pperl_registry_remove(perlcode_t pc)
+{
+	perlinterp_t interp = pc->pc_interp;
+
+	LIST_REMOVE(pc, pc_hash_link);
+	interp->pi_code_count--;
+
+	if (pc->pc_nroutes > 0 && interp->pi_route_root != NULL)
+		pperl_route_purge(interp->pi_route_root, pc);
+	pc->pc_nroutes = 0;
+}
+
+
+/*!
+ * pperl_registry_destroy() - Free the name index and router of an
+ *			      interpreter.
+ *
+ *	Called by pperl_destroy(); the code itself is freed separately.
+ */
+void
+pperl_registry_destroy(perlinterp_t interp)
+{
+
+	free(interp->pi_code_hash);
+	interp->pi_code_hash = NULL;
+	interp->pi_code_hashsize = 0;
+	interp->pi_code_count = 0;
+
+	if (interp->pi_route_root != NULL) {
+		pperl_route_purge(interp->pi_route_root, NULL);
+		free(interp->pi_route_root->rt_edges);
+		free(interp->pi_route_root);
+		interp->pi_route_root = NULL;
+	}
+}
+
+
+/*!
+ * pperl_code_find() - Lookup loaded code by name.
+ *
+ *	Finds code previously loaded into the interpreter by the name it was
+ *	loaded with (for pperl_load_file(), the last component of the file's
+ *	path).  Lookups are by hash so they take constant time regardless of
+ *	how much code is loaded.
+ *
+ *	@param	interp		Interpreter to search.
+ *
+ *	@param	name		Name of the code to find.
+ *
+ *	@return	Handle of the loaded code or NULL if no code with the given
+ *		name is loaded.  If more than one piece of code was loaded
+ *		with the same name, the most recently loaded is returned.
+ *
+ *	@note	Like all other operations on an interpreter, lookups are not
+ *		synchronized; callers sharing an interpreter between threads
+ *		must serialize access themselves.
+ */
+perlcode_t
+pperl_code_find(perlinterp_t interp, const char *name)
+{
+	perlcode_t pc;
+	uint32_t hash;
+
+	if (interp->pi_code_hashsize == 0)
+		return (NULL);
+
+	hash = pperl_registry_hash(name);
+	LIST_FOREACH(pc, &interp->pi_code_hash[hash &
+		     (interp->pi_code_hashsize - 1)], pc_hash_link) {
+		if (pc->pc_hash == hash && strcmp(pc->pc_name, name) == 0)
+			return (pc);
+	}
+
+	return (NULL);
+}
+
+
+/*!
+ * pperl_route_add() - Route requests for a path prefix to loaded code.
+ *
+ *	Registers \a pc as the handler for all paths beginning with
+ *	\a prefix.  When more than one registered prefix matches a path,
+ *	pperl_route_lookup() selects the longest one.  Prefixes are matched
+ *	byte-for-byte; to only match whole path components, register the
+ *	prefix with a trailing slash (e.g. "/cgi-bin/").
+ *
+ *	Routes are removed automatically when the code they refer to is
+ *	unloaded.
+ *
+ *	@param	interp		Interpreter the code is loaded in.
+ *
+ *	@param	prefix		Path prefix to route.  The empty string
+ *				matches every path.
+ *
+ *	@param	pc		Code to route requests to; if NULL, any
+ *				existing route for \a prefix is removed.
+ */
+void
+pperl_route_add(perlinterp_t interp, const char *prefix, perlcode_t pc)
+{
+	struct pperl_route *rt;
+	const u_char *pos;
+
+	assert(pc == NULL || pc->pc_interp == interp);
+
+	if (interp->pi_route_root == NULL) {
+		if (pc == NULL)
+			return;
+		interp->pi_route_root = pperl_malloc(sizeof(struct pperl_route));
+		memset(interp->pi_route_root, 0, sizeof(struct pperl_route));
+	}
+
+	rt = interp->pi_route_root;
+	for (pos = (const u_char *)prefix; *pos != '\0'; pos++) {
+		rt = pperl_route_child(rt, *pos, pc != NULL);
+		if (rt == NULL)
+			return;		/* Removing a route that isn't there. */
+	}
+
+	if (rt->rt_pc != NULL)
+		rt->rt_pc->pc_nroutes--;
+	rt->rt_pc = pc;
+	if (pc != NULL)
+		pc->pc_nroutes++;
+}
+
+
+/*!
+ * pperl_route_lookup() - Find the code responsible for a request path.
+ *
+ *	Walks the prefix trie one byte at a time, remembering the last
+ *	registered prefix passed; the cost is proportional to the length of
+ *	the path rather than the number of routes.
+ *
+ *	@param	interp		Interpreter to search.
+ *
+ *	@param	path		Request path to route.
+ *
+ *	@return	Handle of the code registered for the longest prefix of
+ *		\a path, or NULL if no registered prefix matches.
+ */
+perlcode_t
+pperl_route_lookup(perlinterp_t interp, const char *path)
+{
+	struct pperl_route *rt;
+	const u_char *pos;
+	perlcode_t pc;
+
+	rt = interp->pi_route_root;
+	if (rt == NULL)
+		return (NULL);
+
+	pc = rt->rt_pc;
+	for (pos = (const u_char *)path; *pos != '\0'; pos++) {
+		rt = pperl_route_child(rt, *pos, false);
+		if (rt == NULL)
+			break;
+		if (rt->rt_pc != NULL)
+			pc = rt->rt_pc;
+	}
+
+	return (pc);
+}
+
+
+/*
+ * pperl_registry_hash() - FNV-1a hash of a code name.
+ */
+uint32_t
+pperl_registry_hash(const char *name)
+{
+	const u_char *pos;
+	uint32_t hash;
+
+	hash = 2166136261U;
+	for (pos = (const u_char *)name; *pos != '\0'; pos++) {
+		hash ^= *pos;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+
+/*
+ * pperl_registry_grow() - Double the number of buckets in the name hash.
+ *
+ *	Each entry's full hash value is cached in the perlcode structure so
+ *	rehashing doesn't need to look at the names again.
+ */
+void
+pperl_registry_grow(perlinterp_t interp)
+{
+	struct perlcode_list *newhash;
+	u_int newsize;
+	perlcode_t pc;
+	u_int i;
+
+	newsize = interp->pi_code_hashsize * 2;
+	if (newsize == 0)
+		newsize = REGISTRY_INITSIZE;
+
+	newhash = pperl_malloc(newsize * sizeof(*newhash));
+	for (i = 0; i < newsize; i++)
+		LIST_INIT(&newhash[i]);
+
+	for (i = 0; i < interp->pi_code_hashsize; i++) {
+		while (!LIST_EMPTY(&interp->pi_code_hash[i])) {
+			pc = LIST_FIRST(&interp->pi_code_hash[i]);
+			LIST_REMOVE(pc, pc_hash_link);
+			LIST_INSERT_HEAD(&newhash[pc->pc_hash & (newsize - 1)],
+					 pc, pc_hash_link);
+		}
+	}
+
+	free(interp->pi_code_hash);
+	interp->pi_code_hash = newhash;
+	interp->pi_code_hashsize = newsize;
+}
+
+
+/*
+ * pperl_route_child() - Find (and optionally create) the child of a trie
+ *			 node reached via the given byte.
+ */
+struct pperl_route *
+pperl_route_child(struct pperl_route *rt, u_char byte, bool create)
+{
+	struct pperl_route *child;
+	int lo, hi, mid;
+
+	/* Binary search the sorted edge list. */
+	lo = 0;
+	hi = rt->rt_nedges;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (rt->rt_edges[mid].re_byte == byte)
+			return (rt->rt_edges[mid].re_node);
+		if (rt->rt_edges[mid].re_byte < byte)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!create)
+		return (NULL);
+
+	/* Not found; insert a new edge at position 'lo'. */
+	if (rt->rt_nedges == rt->rt_maxedges) {
+		rt->rt_maxedges = rt->rt_maxedges == 0 ? 2 :
+				  rt->rt_maxedges * 2;
+		rt->rt_edges = pperl_realloc(rt->rt_edges,
+				rt->rt_maxedges * sizeof(*rt->rt_edges));
+	}
+	memmove(&rt->rt_edges[lo + 1], &rt->rt_edges[lo],
+		(rt->rt_nedges - lo) * sizeof(*rt->rt_edges));
+	rt->rt_nedges++;
+
+	child = pperl_malloc(sizeof(*child));
+	memset(child, 0, sizeof(*child));
+	rt->rt_edges[lo].re_byte = byte;
+	rt->rt_edges[lo].re_node = child;
+
+	return (child);
+}
+
+
+/*
+ * pperl_route_purge() - Remove all routes to the given code.
+ *
+ *	Recursively walks the trie below \a rt, clearing any routes to \a pc
+ *	(or all routes, if \a pc is NULL) and freeing nodes left with neither
+ *	a route nor children.
+ *
+ *	@return	True if \a rt itself is now empty and may be freed by the
+ *		caller.
+ */
+bool
+pperl_route_purge(struct pperl_route *rt, perlcode_t pc)
+{
+	struct pperl_route *child;
+	int i, j;
+
+	for (i = j = 0; i < rt->rt_nedges; i++) {
+		child = rt->rt_edges[i].re_node;
+		if (pperl_route_purge(child, pc)) {
+			free(child->rt_edges);
+			free(child);
+			continue;
+		}
+		rt->rt_edges[j++] = rt->rt_edges[i];
+	}
+	rt->rt_nedges = j;
+
+	if (rt->rt_pc != NULL && (pc == NULL || rt->rt_pc == pc)) {
+		rt->rt_pc->pc_nroutes--;
+		rt->rt_pc = NULL;
+	}
+
+	return (rt->rt_pc == NULL && rt->rt_nedges == 0);
+}
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+static void	 pperl_reload_scan(perlinterp_t interp, bool reload,
+				   struct perlresult *result);
+static bool	 pperl_reload_module(pTHX_ const char *key);
+static void	 pperl_reload_invalidate(perlinterp_t interp, const char *key);
+static bool	 pperl_reload_reaches(pTHX_ perlinterp_t interp, HV *deps_hv,
+				      const char *key, HV *seen_hv);
+
+
+/*!
+ * pperl_module_reload() - Enable or disable automatic reloading of modules.
+ *
+ *	Once enabled, pperl_run() periodically checks the modification time
+ *	of every file listed in perl's \%INC hash.  Any module whose file has
+ *	changed is recompiled in place (re-required), so that subsequent runs
+ *	use the new definitions without having to restart the interpreter.
+ *	Code which used the changed module when it was compiled, directly or
+ *	through other modules, may have captured state from the old version
+ *	(imported variables, inlined constants, etc), so it is discarded and
+ *	recompiled the next time it is run; see pperl_code_stale().
+ *
+ *	Enabling reloading records the current modification time of every
+ *	loaded module; modules loaded later are recorded the first time they
+ *	are checked.  Dependencies are only recorded while reloading is
+ *	enabled, so it should be enabled before any code is loaded.
+ *
+ *	@param	interp		Interpreter to reload modules in.
+ *
+ *	@param	interval	Minimum number of seconds between checks.
+ *				Zero checks before every run; a negative value
+ *				disables reloading.
+ */
+void
+pperl_module_reload(perlinterp_t interp, int interval)
+{
+	PerlInterpreter *orig_perl;
+	dTHXa(interp->pi_perl);
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	if (interval >= 0 && interp->pi_reload_interval < 0) {
+		if (interp->pi_inc_mtime_hv == NULL)
+			interp->pi_inc_mtime_hv = newHV();
+		if (interp->pi_moddeps_hv == NULL)
+			interp->pi_moddeps_hv = newHV();
+		pperl_profile_hook();
+		pperl_reload_scan(interp, false, NULL);
+		interp->pi_reload_last = time(NULL);
+	}
+
+	interp->pi_reload_interval = interval;
+
+	PERL_SET_CONTEXT(orig_perl);
+}
+
+
+/*!
+ * pperl_module_check() - Reload any modules which have changed on disk.
+ *
+ *	Performs the same check pperl_run() does when module reloading is
+ *	enabled, but immediately rather than subject to the check interval.
+ *	Reloading must have been enabled via pperl_module_reload().
+ *
+ *	@param	interp		Interpreter to reload modules in.
+ *
+ *	@param	penv		Environment variable list to populate \%ENV
+ *				with while recompiling modules.
+ *
+ *	@param	result		If non-NULL, populated with the result of the
+ *				first module which failed to recompile.  The
+ *				check isn't made (and pperl_errno is EBUSY)
+ *				while a fiber is parked in the interpreter.
+ */
+void
+pperl_module_check(perlinterp_t interp, perlenv_t penv,
+		   struct perlresult *result)
+{
+	PerlInterpreter *orig_perl;
+	int curdir;
+
+	pperl_result_clear(result);
+
+	if (interp->pi_reload_interval < 0)
+		return;
+
+	/* Code run by a parked fiber mustn't be discarded from under it. */
+	if (pperl_fiber_parked(interp)) {
+		pperl_seterr(interp, EBUSY, result);
+		return;
+	}
+
+	/* Save the current directory in case the module code changes it. */
+	if (!pperl_curdir_save(interp, &curdir, result))
+		return;
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	pperl_reload_check(interp, penv, true, result);
+
+	PERL_SET_CONTEXT(orig_perl);
+
+	pperl_curdir_restore(&curdir);
+}
+
+
+/*!
+ * pperl_code_stale() - Determine whether loaded code depends on a module
+ *			which has since been reloaded.
+ *
+ *	Reloading a module redefines its subroutines, but code that was
+ *	compiled against the old version may have captured state from it
+ *	(imported variables, inlined constants, etc).  Such code is normally
+ *	discarded and transparently recompiled the next time it is run.
+ *	Code whose source wasn't retained, because it was loaded before
+ *	reloading was enabled, is marked stale instead; the caller should
+ *	unload and reload it at its convenience.
+ *
+ *	@param	pc		Loaded code to check.
+ *
+ *	@return	True if a module the code depends on has been reloaded.
+ */
+bool
+pperl_code_stale(const perlcode_t pc)
+{
+
+	return (pc->pc_stale);
+}
+
+
+/*!
+ * pperl_reload_check() - Internal implementation of the module reload check.
+ *
+ *	@param	interp		Interpreter to reload modules in; must be the
+ *				current perl context.
+ *
+ *	@param	penv		Environment to compile modules with.
+ *
+ *	@param	force		If false, do nothing unless the check interval
+ *				has elapsed since the last check.
+ *
+ *	@param	result		If non-NULL, populated with the result of the
+ *				first module which failed to recompile.
+ */
+void
+pperl_reload_check(perlinterp_t interp, perlenv_t penv, bool force,
+		   struct perlresult *result)
+{
+	time_t now;
+	dTHXa(interp->pi_perl);
+
+	if (interp->pi_reload_interval < 0)
+		return;
+
+	now = time(NULL);
+	if (!force && now - interp->pi_reload_last < interp->pi_reload_interval)
+		return;
+	interp->pi_reload_last = now;
+
+	ENTER;
+	SAVETMPS;
+
+	pperl_setvars(aTHX_ "reload");
+	pperl_env_populate(aTHX_ penv);
+
+	pperl_reload_scan(interp, true, result);
+
+	FREETMPS;
+	LEAVE;
+}
+
+
+/*!
+ * pperl_reload_scan() - Compare modification times of all loaded modules
+ *			 against those previously recorded.
+ *
+ *	@param	interp		Interpreter to scan; must be the current perl
+ *				context.
+ *
+ *	@param	reload		If true, reload modules whose files changed.
+ *				Otherwise, simply record modification times.
+ *
+ *	@param	result		If non-NULL, populated with the result of the
+ *				first module which failed to recompile.
+ */
+void
+pperl_reload_scan(perlinterp_t interp, bool reload, struct perlresult *result)
+{
+	HV *inc_hv;
+	AV *keys_av;
+	HE *entry;
+	SV **svp;
+	SV *key_sv;
+	SV *err_sv;
+	struct stat sb;
+	const char *key;
+	STRLEN keylen;
+	int i;
+	dTHXa(interp->pi_perl);
+
+	inc_hv = GvHVn(PL_incgv);
+	err_sv = NULL;
+
+	/*
+	 * Reloading a module modifies %INC so we can't reload while
+	 * iterating over it; gather the keys up front.
+	 */
+	keys_av = newAV();
+	hv_iterinit(inc_hv);
+	while ((entry = hv_iternext(inc_hv)) != NULL) {
+		key = HePV(entry, keylen);
+		av_push(keys_av, newSVpvn(key, keylen));
+	}
+
+	for (i = 0; i <= av_len(keys_av); i++) {
+		key_sv = *av_fetch(keys_av, i, FALSE);
+		key = SvPV(key_sv, keylen);
+
+		svp = hv_fetch(inc_hv, key, keylen, FALSE);
+		if (svp == NULL || !SvOK(*svp))
+			continue;
+
+		/*
+		 * Entries which don't refer to a file (e.g. those set by
+		 * modules defining other packages inline) can't change.
+		 */
+		if (stat(SvPV_nolen(*svp), &sb) < 0)
+			continue;
+
+		svp = hv_fetch(interp->pi_inc_mtime_hv, key, keylen, FALSE);
+		if (svp != NULL && SvIV(*svp) == (IV)sb.st_mtime)
+			continue;
+
+		hv_store(interp->pi_inc_mtime_hv, key, keylen,
+			 newSViv((IV)sb.st_mtime), 0);
+
+		/* First time we've seen this module; nothing to compare. */
+		if (svp == NULL || !reload)
+			continue;
+
+		pperl_log(LOG_INFO, "module %s changed; reloading", key);
+
+		if (!pperl_reload_module(aTHX_ key) && err_sv == NULL)
+			err_sv = newSVsv(ERRSV);
+
+		pperl_reload_invalidate(interp, key);
+
+		/* Spare children forked so far have the old version. */
+		interp->pi_generation++;
+	}
+
+	SvREFCNT_dec(keys_av);
+
+	/*
+	 * Later modules reloading successfully will have cleared $@; put
+	 * back the first error so it can be reported to the caller.
+	 */
+	if (err_sv != NULL) {
+		sv_setsv(ERRSV, err_sv);
+		SvREFCNT_dec(err_sv);
+		if (result != NULL) {
+			result->pperl_status = STATUS_CURRENT;
+			result->pperl_errmsg = SvPVX(ERRSV);
+		}
+	}
+}
+
+
+/*!
+ * pperl_reload_module() - Recompile a single module in place.
+ *
+ *	@param	key		\%INC key of the module to recompile.
+ *
+ *	@return	True if the module recompiled successfully; otherwise the
+ *		error is in ERRSV.
+ */
+bool
+pperl_reload_module(pTHX_ const char *key)
+{
+	HV *inc_hv = GvHVn(PL_incgv);
+	SV *orig_sv;
+	size_t keylen = strlen(key);
+
+	/*
+	 * Require won't load a module which is already listed in %INC, so
+	 * remove it first.  Keep the original entry so it can be restored
+	 * if the new version fails to compile; otherwise every subsequent
+	 * require of the module would attempt (and fail) to load it again.
+	 */
+	orig_sv = hv_delete(inc_hv, key, keylen, 0);
+	if (orig_sv != NULL)
+		SvREFCNT_inc(orig_sv);
+
+	if (strpbrk(key, "'\\") != NULL)
+		sv_setpvf(ERRSV, "cannot reload %s", key);
+	else
+		pperl_require(aTHX_ "'%s'", key);
+
+	if (!SvTRUE(ERRSV)) {
+		SvREFCNT_dec(orig_sv);
+		return true;
+	}
+
+	pperl_log(LOG_ERR, "failed to reload module %s: %s",
+		  key, SvPV_nolen(ERRSV));
+	if (orig_sv != NULL)
+		hv_store(inc_hv, key, keylen, orig_sv, 0);
+
+	return false;
+}
+
+
+/*!
+ * pperl_reload_depend() - Record that a module is required by something.
+ *
+ *	Called by the require op wrapper for every require while reloading
+ *	is enabled, whether or not the module is already loaded.
+ *
+ *	@param	requirer	\%INC key of the module being loaded which
+ *				requires the module, or NULL if it is required
+ *				by the code being compiled (if any).
+ *
+ *	@param	name		\%INC key of the module required.
+ *
+ *	@param	namelen		Length of \a name.
+ */
+void
+pperl_reload_depend(pTHX_ perlinterp_t interp, const char *requirer,
+		    const char *name, STRLEN namelen)
+{
+	HV *deps_hv;
+	SV **svp;
+
+	if (requirer == NULL)
+		deps_hv = interp->pi_deps_hv;
+	else {
+		svp = hv_fetch(interp->pi_moddeps_hv, requirer,
+			       strlen(requirer), FALSE);
+		if (svp != NULL)
+			deps_hv = (HV *)SvRV(*svp);
+		else {
+			deps_hv = newHV();
+			hv_store(interp->pi_moddeps_hv, requirer,
+				 strlen(requirer), newRV_noinc((SV *)deps_hv),
+				 0);
+		}
+	}
+
+	if (deps_hv != NULL && !hv_exists(deps_hv, name, namelen))
+		hv_store(deps_hv, name, namelen, newSViv(1), 0);
+}
+
+
+/*!
+ * pperl_reload_invalidate() - Discard code which depends on a module.
+ *
+ *	Code depends on a module if it required the module when it was
+ *	compiled, or required a module which (transitively) did.  Dependent
+ *	code is discarded so that it is recompiled from its saved source
+ *	the next time it is run; code without saved source is marked stale.
+ *
+ *	@param	interp		Interpreter to search for dependent code; must
+ *				be the current perl context.
+ *
+ *	@param	key		\%INC key of the module which was reloaded.
+ */
+void
+pperl_reload_invalidate(perlinterp_t interp, const char *key)
+{
+	perlcode_t pc;
+	HV *seen_hv;
+	bool depends;
+	dTHXa(interp->pi_perl);
+
+	LIST_FOREACH(pc, &interp->pi_code_head, pc_link) {
+		if (pc->pc_sv == NULL || pc->pc_stale)
+			continue;
+
+		seen_hv = newHV();
+		depends = pperl_reload_reaches(aTHX_ interp, pc->pc_deps_hv,
+					       key, seen_hv);
+		SvREFCNT_dec(seen_hv);
+		if (!depends)
+			continue;
+
+		if (pc->pc_src != NULL) {
+			pperl_log(LOG_INFO, "%s depends on %s; discarded",
+				  pc->pc_name, key);
+			pperl_discard(pc);
+		}
+		else {
+			pperl_log(LOG_INFO, "%s depends on %s; marked stale",
+				  pc->pc_name, key);
+			pc->pc_stale = true;
+		}
+	}
+}
+
+
+/*
+ * pperl_reload_reaches() - Determine whether a set of dependencies includes
+ *			    a module, directly or through the modules in it.
+ *
+ *	@param	seen_hv		Modules already searched, to stop at cycles.
+ */
+bool
+pperl_reload_reaches(pTHX_ perlinterp_t interp, HV *deps_hv, const char *key,
+		     HV *seen_hv)
+{
+	const char *dep;
+	I32 deplen;
+	HE *entry;
+	SV **svp;
+
+	if (deps_hv == NULL)
+		return false;
+	if (hv_exists(deps_hv, key, strlen(key)))
+		return true;
+
+	hv_iterinit(deps_hv);
+	while ((entry = hv_iternext(deps_hv)) != NULL) {
+		dep = hv_iterkey(entry, &deplen);
+		if (hv_exists(seen_hv, dep, deplen))
+			continue;
+		hv_store(seen_hv, dep, deplen, newSViv(1), 0);
+
+		svp = hv_fetch(interp->pi_moddeps_hv, dep, deplen, FALSE);
+		if (svp != NULL &&
+		    pperl_reload_reaches(aTHX_ interp, (HV *)SvRV(*svp), key,
+					 seen_hv))
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*
+ * @struct perlrequest
+ *
+ * Everything needed to run code on behalf of one request, held as plain C
+ * data so that it can be built on any thread without touching a perl
+ * interpreter.  The perl \@ARGV, \%ENV, and STDIN are only created from it
+ * by pperl_request_run(), in whichever interpreter ends up running it.
+ *
+ *	@param	pr_tainted	Whether perl should consider the arguments,
+ *				environment, and input tainted.
+ *
+ *	@param	pr_argv		Arguments to pass as \@ARGV.
+ *
+ *	@param	pr_envv		Environment variables to pass as \%ENV, as
+ *				"name=value" strings.  These and the strings
+ *				in \a pr_argv are owned by the request.
+ *
+ *	@param	pr_stdin	Data to be read from STDIN; NULL if STDIN
+ *				should be left as it is.  Always followed by a
+ *				nul byte, which is not counted in
+ *				\a pr_stdinlen.
+ *
+ *	@param	pr_body		Caller-owned request body to expose as
+ *				$libpperl::body; NULL if none.
+ */
+struct perlrequest {
+	bool		  pr_tainted;
+	const char	**pr_argv;
+	int		  pr_argc;
+	int		  pr_argmax;
+	const char	**pr_envv;
+	int		  pr_envc;
+	int		  pr_envmax;
+	char		 *pr_stdin;
+	size_t		  pr_stdinlen;
+	size_t		  pr_stdinsize;
+	const char	 *pr_body;
+	size_t		  pr_bodylen;
+};
+
+
+static void	 pperl_request_strvec_add(const char ***vecp, int *countp,
+					  int *maxp, const char *str);
+static SV	*pperl_request_sv(pTHX_ perlrequest_t req, const char *buf,
+				  size_t len);
+
+
+/*!
+ * pperl_request_new() - Create an empty request.
+ *
+ *	Unlike pperl_args_new() and pperl_env_new(), no interpreter is
+ *	needed, so requests may be built on any thread (e.g. the thread
+ *	reading them from the network) and handed to whichever interpreter
+ *	is free to run them.
+ *
+ *	@param	tainted		Whether or not perl code should consider the
+ *				request's arguments, environment variables,
+ *				and input "tainted" (possibly untrustworthy).
+ *
+ *	@return	New request with no arguments, no environment variables, and
+ *		no input.
+ */
+perlrequest_t
+pperl_request_new(bool tainted)
+{
+	perlrequest_t req;
+
+	req = pperl_malloc(sizeof(*req));
+	memset(req, 0, sizeof(*req));
+	req->pr_tainted = tainted;
+
+	return (req);
+}
+
+
+/*!
+ * pperl_request_arg() - Append an argument to a request's \@ARGV list.
+ */
+void
+pperl_request_arg(perlrequest_t req, const char *arg)
+{
+
+	pperl_request_strvec_add(&req->pr_argv, &req->pr_argc,
+				 &req->pr_argmax, pperl_strdup(arg));
+}
+
+
+/*!
+ * pperl_request_env() - Add a variable to a request's \%ENV hash.
+ */
+void
+pperl_request_env(perlrequest_t req, const char *name, const char *value)
+{
+	char *str;
+
+	if (asprintf(&str, "%s=%s", name, value) < 0)
+		pperl_fatal(EX_OSERR, "asprintf: %m");
+	pperl_request_strvec_add(&req->pr_envv, &req->pr_envc,
+				 &req->pr_envmax, str);
+}
+
+
+/*!
+ * pperl_request_stdin() - Append data to a request's standard input.
+ *
+ *	While the request runs, reads from STDIN return the data appended
+ *	here and then end-of-file.  If this is never called, STDIN is left
+ *	as it is.
+ *
+ *	@param	req		Request to add input to.
+ *
+ *	@param	buf		Data to append.
+ *
+ *	@param	len		Number of bytes in \a buf; may be zero to give
+ *				the request an empty STDIN.
+ */
+void
+pperl_request_stdin(perlrequest_t req, const void *buf, size_t len)
+{
+
+	/* Always leave room for a trailing nul. */
+	if (req->pr_stdinlen + len >= req->pr_stdinsize) {
+		if (req->pr_stdinsize == 0)
+			req->pr_stdinsize = 512;
+		while (req->pr_stdinlen + len >= req->pr_stdinsize)
+			req->pr_stdinsize *= 2;
+		req->pr_stdin = pperl_realloc(req->pr_stdin,
+					      req->pr_stdinsize);
+	}
+
+	memcpy(req->pr_stdin + req->pr_stdinlen, buf, len);
+	req->pr_stdinlen += len;
+	req->pr_stdin[req->pr_stdinlen] = '\0';
+}
+
+
+/*!
+ * pperl_request_body() - Give a request a body without copying it.
+ *
+ *	While the request runs, $libpperl::body is a read-only scalar whose
+ *	value is the given buffer itself, so large bodies (e.g. uploads to
+ *	be parsed as JSON or XML) never need to be copied into perl.  If
+ *	the request has no input from pperl_request_stdin(), STDIN reads the
+ *	body too.
+ *
+ *	The buffer is not copied: it must remain valid and unchanged until
+ *	pperl_request_run() returns.  Perl expects string buffers to be
+ *	followed by a nul byte, so one should follow the body (it is not
+ *	counted in \a len).  Code which wants to modify the body, or keep it
+ *	after the run, must copy it.
+ *
+ *	@param	req		Request to give the body to.
+ *
+ *	@param	buf		The body; NULL to remove it.
+ *
+ *	@param	len		Number of bytes in \a buf.
+ */
+void
+pperl_request_body(perlrequest_t req, const void *buf, size_t len)
+{
+
+	req->pr_body = buf;
+	req->pr_bodylen = buf != NULL ? len : 0;
+}
+
+
+/*!
+ * pperl_request_run() - Run code on behalf of a request.
+ *
+ *	Creates the request's \@ARGV and \%ENV in the code's interpreter,
+ *	binds STDIN and $libpperl::body to the request's input and body if it
+ *	has any, and runs the code as pperl_run() would.  The request itself
+ *	is not modified, so it may be run again.
+ *
+ *	@param	pc		Code to run.
+ *
+ *	@param	req		Request to run the code for.
+ *
+ *	@param	result		If non-NULL, populated with the result of
+ *				running the code; see pperl_run().
+ */
+void
+pperl_request_run(perlcode_t pc, perlrequest_t req, struct perlresult *result)
+{
+	const perlinterp_t interp = pc->pc_interp;
+	perlargs_t pargs;
+	perlenv_t penv;
+
+	pargs = pperl_args_new(interp, req->pr_tainted, req->pr_argc,
+			       req->pr_argv);
+	penv = pperl_env_new(interp, req->pr_tainted, req->pr_envc,
+			     req->pr_envv);
+
+	if (req->pr_stdin != NULL || req->pr_body != NULL)
+		interp->pi_request = req;
+
+	pperl_run(pc, pargs, penv, result);
+
+	/* In case the run failed before STDIN was bound. */
+	interp->pi_request = NULL;
+
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+}
+
+
+/*!
+ * pperl_request_free() - Free a request.
+ *
+ *	@param	reqp		Pointer to request to free.
+ *
+ *	@post	*reqp is set to NULL.
+ */
+void
+pperl_request_free(perlrequest_t *reqp)
+{
+	perlrequest_t req = *reqp;
+	int i;
+
+	*reqp = NULL;
+
+	for (i = 0; i < req->pr_argc; i++)
+		free(ignoreconst(req->pr_argv[i]));
+	for (i = 0; i < req->pr_envc; i++)
+		free(ignoreconst(req->pr_envv[i]));
+	free(req->pr_argv);
+	free(req->pr_envv);
+	free(req->pr_stdin);
+	free(req);
+}
+
+
+/*
+ * pperl_request_populate() - Bind STDIN and $libpperl::body to a request.
+ *
+ *	Localizes *STDIN (as "local *STDIN" would) and opens it on an
+ *	in-memory scalar which refers to the request's input buffer directly
+ *	rather than copying it.  Similarly localizes $libpperl::body to a
+ *	scalar referring to the request's body, if it has one.
+ *
+ *	@note	Must be called inside an ENTER/LEAVE block; STDIN and
+ *		$libpperl::body are restored by LEAVE.
+ */
+void
+pperl_request_populate(pTHX_ perlrequest_t req)
+{
+	GV *stdin_gv, *body_gv;
+	SV *buf_sv, *body_sv = NULL, *ref_sv;
+
+	assert(req->pr_stdin != NULL || req->pr_body != NULL);
+
+	if (req->pr_body != NULL) {
+		body_sv = pperl_request_sv(aTHX_ req, req->pr_body,
+					   req->pr_bodylen);
+		body_gv = gv_fetchpv(PPERL_NAMESPACE_PUBLIC "::body", TRUE,
+				     SVt_PV);
+		save_scalar(body_gv);
+		SvREFCNT_dec(GvSV(body_gv));
+		GvSV(body_gv) = body_sv;
+	}
+
+	if (req->pr_stdin != NULL)
+		buf_sv = pperl_request_sv(aTHX_ req, req->pr_stdin,
+					  req->pr_stdinlen);
+	else
+		buf_sv = SvREFCNT_inc(body_sv);
+
+	stdin_gv = gv_fetchpv("STDIN", TRUE, SVt_PVIO);
+	save_gp(stdin_gv, 1);
+
+	ref_sv = sv_2mortal(newRV_noinc(buf_sv));
+
+	if (!Perl_do_openn(aTHX_ stdin_gv, ignoreconst("<"), 1, FALSE,
+			   O_RDONLY, 0, Nullfp, &ref_sv, 1))
+		pperl_log(LOG_ERR, "failed to bind request input to STDIN: %s",
+			  SvPV_nolen(get_sv("!", TRUE)));
+}
+
+
+/*
+ * pperl_request_sv() - Create a scalar referring to a request's buffer.
+ *
+ *	The scalar is read-only as perl must never try to reallocate or free
+ *	a buffer it does not own.
+ */
+SV *
+pperl_request_sv(pTHX_ perlrequest_t req, const char *buf, size_t len)
+{
+	SV *sv;
+
+	sv = newSV(0);
+	sv_upgrade(sv, SVt_PV);
+	SvPV_set(sv, ignoreconst(buf));
+	SvCUR_set(sv, len);
+	SvLEN_set(sv, 0);
+	SvPOK_only(sv);
+	if (req->pr_tainted)
+		SvTAINTED_on(sv);
+	SvREADONLY_on(sv);
+
+	return (sv);
+}
+
+
+/*
+ * pperl_request_strvec_add() - Append a string to a dynamically-sized vector.
+ */
+void
+pperl_request_strvec_add(const char ***vecp, int *countp, int *maxp,
+			 const char *str)
+{
+
+	if (*countp == *maxp) {
+		*maxp = *maxp == 0 ? 8 : *maxp * 2;
+		*vecp = pperl_realloc(*vecp, *maxp * sizeof(**vecp));
+	}
+	(*vecp)[(*countp)++] = str;
+}
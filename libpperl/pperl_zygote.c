@@ -0,0 +1,850 @@
+/*
+ * Copyright (c) 2005 NTT Multimedia Communications Laboratories, Inc.
+ * All rights reserved
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "pperl_platform.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define	HAS_BOOL	/* We use stdbool's bool type rather than perl's. */
+#define	PERL_NO_GET_CONTEXT	/* Pass perl interpreter context explicitly. */
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "queue.h"
+#include "sbuf.h"
+
+#include "pperl.h"
+#include "pperl_private.h"
+
+
+/*
+ * Sending a request to a spare which has died must fail with EPIPE rather
+ * than kill the host with SIGPIPE.  Platforms without MSG_NOSIGNAL offer
+ * SO_NOSIGPIPE instead, which is set on each spare's socket.
+ */
+#ifndef MSG_NOSIGNAL
+#define	MSG_NOSIGNAL	0
+#endif
+
+
+/*
+ * @struct pperl_spare
+ *
+ * A child forked ahead of time, waiting for a request on its socket.
+ *
+ *	@param	ps_pid		Process ID of the child.
+ *
+ *	@param	ps_sock		Parent's end of the socket pair connecting it
+ *				to the child.
+ *
+ *	@param	ps_generation	Interpreter's load generation when the child
+ *				was forked; code loaded since isn't in the
+ *				child.
+ */
+struct pperl_spare {
+	pid_t			 ps_pid;
+	int			 ps_sock;
+	u_int			 ps_generation;
+	TAILQ_ENTRY(pperl_spare) ps_link;
+};
+
+
+/*
+ * @struct perlzygote
+ *
+ * Preloaded parent interpreter which runs each request in a forked child.
+ *
+ *	@param	pz_interp	Interpreter holding the preloaded code.
+ *
+ *	@param	pz_nspares	Number of spare children to keep ready.
+ *
+ *	@param	pz_spares	Spare children, oldest first.
+ *
+ *	@param	pz_errmsg	Error message of the last request, if any.
+ *
+ *	@param	pz_stats	Counters reported by pperl_zygote_stats().
+ */
+struct perlzygote {
+	perlinterp_t		 pz_interp;
+	int			 pz_nspares;
+	TAILQ_HEAD(, pperl_spare) pz_spares;
+	char			*pz_errmsg;
+	struct pperl_zygote_stats pz_stats;
+};
+
+
+/*
+ * Header of the request sent to a spare child, followed by the arguments
+ * and environment (each a length-prefixed string; environment variables
+ * as name then value).  The standard descriptors are passed alongside as
+ * SCM_RIGHTS ancillary data.
+ */
+struct zygote_request {
+	perlcode_t		 zr_pc;
+	int			 zr_argc;
+	int			 zr_envc;
+	bool			 zr_args_tainted;
+	bool			 zr_env_tainted;
+	int			 zr_fdmask;
+	size_t			 zr_len;
+};
+
+/*
+ * Reply sent back by a child once its run completes, followed by
+ * zp_msglen bytes of error message.
+ */
+struct zygote_reply {
+	int			 zp_status;
+	int			 zp_errno;
+	size_t			 zp_msglen;
+};
+
+
+static void	 pperl_zygote_spawn(perlzygote_t pz, int busy);
+static void	 pperl_zygote_reap(struct pperl_spare *ps);
+static void	 pperl_zygote_closeall(perlzygote_t pz, int busy);
+static void	 pperl_zygote_spare_main(perlinterp_t interp, int sock)
+			__attribute__ ((noreturn));
+static void	 pperl_zygote_child(perlcode_t pc, perlargs_t pargs,
+				    perlenv_t penv, const int fds[3],
+				    int sock)
+			__attribute__ ((noreturn));
+static void	 pperl_zygote_stdio(perlinterp_t interp, const int fds[3]);
+static void	 pperl_zygote_wait(perlzygote_t pz, pid_t pid, int sock,
+				   struct perlresult *result);
+static void	 pperl_zygote_encode(struct sbuf *sb, perlcode_t pc,
+				     perlargs_t pargs, perlenv_t penv,
+				     int fdmask);
+static bool	 pperl_zygote_decode(perlinterp_t interp,
+				     const struct zygote_request *zr,
+				     const char *buf, perlargs_t *pargsp,
+				     perlenv_t *penvp);
+static void	 pperl_zygote_putstr(struct sbuf *sb, const char *str,
+				     size_t len);
+static bool	 readall(int fd, void *buf, size_t len);
+static bool	 writeall(int fd, const void *buf, size_t len);
+
+
+/*!
+ * pperl_zygote_new() - Create a zygote for running code in child processes.
+ *
+ *	A zygote runs each request in a child forked from the given
+ *	interpreter.  The child inherits everything already loaded into the
+ *	interpreter (including compiled code and modules) copy-on-write, runs
+ *	a single request, and exits; nothing the code does can affect later
+ *	requests.  This costs a fork(2) per request, which is still far
+ *	cheaper than starting a new perl and compiling the code again.
+ *
+ *	To hide the cost of the fork, the zygote can keep a number of spare
+ *	children forked in advance, each waiting for a request.  Spares which
+ *	predate the most recent pperl_load() or pperl_unload() in the
+ *	interpreter are discarded rather than used.
+ *
+ *	@note	fork(2) only duplicates the calling thread, so the zygote's
+ *		process should not have any other threads running perl.
+ *
+ *	@param	interp		Fully loaded interpreter to fork children from.
+ *
+ *	@param	spares		Number of spare children to keep ready.
+ *
+ *	@return	New zygote.
+ */
+perlzygote_t
+pperl_zygote_new(perlinterp_t interp, int spares)
+{
+	perlzygote_t pz;
+
+	pz = pperl_malloc(sizeof(*pz));
+	memset(pz, 0, sizeof(*pz));
+	pz->pz_interp = interp;
+	pz->pz_nspares = spares;
+	TAILQ_INIT(&pz->pz_spares);
+
+	pperl_zygote_spawn(pz, -1);
+
+	return (pz);
+}
+
+
+/*!
+ * pperl_zygote_destroy() - Destroy a zygote.
+ *
+ *	Terminates any spare children.  The interpreter itself is left intact.
+ *
+ *	@param	pzp		Pointer to zygote to destroy.
+ *
+ *	@post	*pzp is set to NULL.
+ */
+void
+pperl_zygote_destroy(perlzygote_t *pzp)
+{
+	perlzygote_t pz = *pzp;
+	struct pperl_spare *ps;
+
+	*pzp = NULL;
+
+	while ((ps = TAILQ_FIRST(&pz->pz_spares)) != NULL) {
+		TAILQ_REMOVE(&pz->pz_spares, ps, ps_link);
+		pperl_zygote_reap(ps);
+	}
+
+	free(pz->pz_errmsg);
+	free(pz);
+}
+
+
+/*!
+ * pperl_zygote_run() - Run code in a child process.
+ *
+ *	Equivalent to pperl_run() except the code runs in a child process
+ *	with its standard input, output, and error connected to the given
+ *	descriptors.  Any I/O overrides the interpreter has for STDIN,
+ *	STDOUT, or STDERR are replaced in the child by handles on those
+ *	descriptors.  Returns once the child exits.
+ *
+ *	@param	pz		Zygote to run the code with.
+ *
+ *	@param	pc		Code to run; must be loaded in the zygote's
+ *				interpreter.
+ *
+ *	@param	pargs		Argument list; see pperl_run().
+ *
+ *	@param	penv		Environment variable list; see pperl_run().
+ *
+ *	@param	fds		Descriptors to use as the child's standard
+ *				input, output, and error.  An entry of -1
+ *				leaves the respective handle as it is.
+ *
+ *	@param	result		If non-NULL, populated with the result of the
+ *				run.  If the child died without reporting a
+ *				result, pperl_status holds its wait(2) status
+ *				and pperl_errno is ECHILD.  The error message
+ *				remains valid until the next run.
+ */
+void
+pperl_zygote_run(perlzygote_t pz, perlcode_t pc, perlargs_t pargs,
+		 perlenv_t penv, const int fds[3], struct perlresult *result)
+{
+	struct perlresult dummy_result;
+	perlinterp_t interp = pz->pz_interp;
+	struct pperl_spare *ps;
+	PerlInterpreter *orig_perl;
+	struct zygote_request zr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct sbuf sb;
+	uint64_t start, usec;
+	int cmsgbuf[CMSG_SPACE(3 * sizeof(int)) / sizeof(int) + 1];
+	int sv[2];
+	int nfds, i;
+	pid_t pid;
+
+	assert(pc->pc_interp == interp);
+
+	if (result == NULL)
+		result = &dummy_result;
+	pperl_result_clear(result);
+
+	orig_perl = PERL_GET_CONTEXT;
+	PERL_SET_CONTEXT(interp->pi_perl);
+
+	pz->pz_stats.pzs_runs++;
+
+	/* Throw away spares which don't have the latest code. */
+	while ((ps = TAILQ_FIRST(&pz->pz_spares)) != NULL &&
+	       ps->ps_generation != interp->pi_generation) {
+		TAILQ_REMOVE(&pz->pz_spares, ps, ps_link);
+		pperl_zygote_reap(ps);
+	}
+
+	pid = -1;
+	if (ps != NULL) {
+		/*
+		 * Hand the request to a spare child: the code to run, its
+		 * arguments and environment, and the descriptors to use.
+		 */
+		TAILQ_REMOVE(&pz->pz_spares, ps, ps_link);
+
+		memset(&zr, 0, sizeof(zr));
+		for (nfds = i = 0; i < 3; i++) {
+			if (fds != NULL && fds[i] >= 0) {
+				zr.zr_fdmask |= 1 << i;
+				memcpy((int *)CMSG_DATA((struct cmsghdr *)
+				       cmsgbuf) + nfds++, &fds[i],
+				       sizeof(int));
+			}
+		}
+
+		sbuf_new(&sb, NULL, 256, SBUF_AUTOEXTEND);
+		pperl_zygote_encode(&sb, pc, pargs, penv, zr.zr_fdmask);
+		sbuf_finish(&sb);
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = sbuf_data(&sb);
+		iov.iov_len = sizeof(zr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (nfds > 0) {
+			cmsg = (struct cmsghdr *)cmsgbuf;
+			cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			msg.msg_control = cmsgbuf;
+			msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		}
+
+		/*
+		 * A spare may have died while waiting (e.g. killed by an
+		 * administrator); if so, discard it and fork instead.
+		 */
+		if (sendmsg(ps->ps_sock, &msg, MSG_NOSIGNAL) !=
+		    (ssize_t)sizeof(zr) ||
+		    !writeall(ps->ps_sock, sbuf_data(&sb) + sizeof(zr),
+			      sbuf_len(&sb) - sizeof(zr))) {
+			pperl_log(LOG_WARNING, "failed to send request to "
+				  "spare child %d, forking instead: %m",
+				  (int)ps->ps_pid);
+			pperl_zygote_reap(ps);
+		}
+		else {
+			pz->pz_stats.pzs_spare_hits++;
+			pid = ps->ps_pid;
+			sv[0] = ps->ps_sock;
+			free(ps);
+		}
+		sbuf_delete(&sb);
+	}
+
+	if (pid < 0) {
+		/* No spare available; fork a child for this request. */
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			pperl_log(LOG_ERR, "socketpair: %m");
+			pperl_seterr(interp, errno, result);
+			goto done;
+		}
+
+		start = pperl_clock();
+		pid = fork();
+		if (pid == 0) {
+			close(sv[0]);
+			pperl_zygote_closeall(pz, -1);
+			pperl_zygote_child(pc, pargs, penv, fds, sv[1]);
+		}
+		usec = pperl_clock() - start;
+		close(sv[1]);
+
+		if (pid < 0) {
+			pperl_log(LOG_ERR, "fork: %m");
+			pperl_seterr(interp, errno, result);
+			close(sv[0]);
+			goto done;
+		}
+
+		pz->pz_stats.pzs_forks++;
+		pz->pz_stats.pzs_fork_usec += usec;
+		if (usec > pz->pz_stats.pzs_fork_max_usec)
+			pz->pz_stats.pzs_fork_max_usec = usec;
+	}
+
+	/*
+	 * Top up the spares while the child runs, so the fork cost is off
+	 * the next request's critical path.
+	 */
+	pperl_zygote_spawn(pz, sv[0]);
+
+	pperl_zygote_wait(pz, pid, sv[0], result);
+	close(sv[0]);
+
+done:
+	PERL_SET_CONTEXT(orig_perl);
+}
+
+
+/*!
+ * pperl_zygote_stats() - Report zygote statistics.
+ *
+ *	@param	pz		Zygote to report on.
+ *
+ *	@param	stats		Populated with a snapshot of the zygote's
+ *				counters.
+ */
+void
+pperl_zygote_stats(perlzygote_t pz, struct pperl_zygote_stats *stats)
+{
+
+	struct pperl_spare *ps;
+
+	*stats = pz->pz_stats;
+	stats->pzs_spares = 0;
+	TAILQ_FOREACH(ps, &pz->pz_spares, ps_link)
+		stats->pzs_spares++;
+}
+
+
+/*!
+ * pperl_zygote_spawn() - Fork spare children until there are enough.
+ *
+ *	Must be called with the zygote's interpreter as the current perl
+ *	context.
+ *
+ *	@param	busy		Parent's socket to a child currently running a
+ *				request, which spares must not hold open; -1
+ *				if none.
+ */
+void
+pperl_zygote_spawn(perlzygote_t pz, int busy)
+{
+	struct pperl_spare *ps;
+	uint64_t start, usec;
+	int count;
+	int sv[2];
+#ifdef SO_NOSIGPIPE
+	int on;
+#endif
+	pid_t pid;
+
+	count = 0;
+	TAILQ_FOREACH(ps, &pz->pz_spares, ps_link)
+		count++;
+
+	for (; count < pz->pz_nspares; count++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			pperl_log(LOG_ERR, "socketpair: %m");
+			return;
+		}
+#ifdef SO_NOSIGPIPE
+		on = 1;
+		setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+		start = pperl_clock();
+		pid = fork();
+		if (pid == 0) {
+			close(sv[0]);
+			pperl_zygote_closeall(pz, busy);
+			pperl_zygote_spare_main(pz->pz_interp, sv[1]);
+		}
+		usec = pperl_clock() - start;
+		close(sv[1]);
+
+		if (pid < 0) {
+			pperl_log(LOG_ERR, "fork: %m");
+			close(sv[0]);
+			return;
+		}
+
+		pz->pz_stats.pzs_forks++;
+		pz->pz_stats.pzs_fork_usec += usec;
+		if (usec > pz->pz_stats.pzs_fork_max_usec)
+			pz->pz_stats.pzs_fork_max_usec = usec;
+
+		ps = pperl_malloc(sizeof(*ps));
+		ps->ps_pid = pid;
+		ps->ps_sock = sv[0];
+		ps->ps_generation = pz->pz_interp->pi_generation;
+		TAILQ_INSERT_TAIL(&pz->pz_spares, ps, ps_link);
+	}
+}
+
+
+/*!
+ * pperl_zygote_reap() - Terminate a spare child and free its record.
+ *
+ *	Closing the socket tells the child to exit.  A child which hasn't
+ *	exited within a second (e.g. because it is stuck in an END block) is
+ *	killed.
+ */
+void
+pperl_zygote_reap(struct pperl_spare *ps)
+{
+	pid_t pid;
+	int i;
+
+	close(ps->ps_sock);
+
+	for (i = 0; i < 100; i++) {
+		pid = waitpid(ps->ps_pid, NULL, WNOHANG);
+		if (pid != 0 && !(pid < 0 && errno == EINTR))
+			break;
+		if (pid == 0)
+			usleep(10000);
+	}
+	if (i == 100) {
+		pperl_log(LOG_WARNING, "spare child %d did not exit; killing",
+			  (int)ps->ps_pid);
+		kill(ps->ps_pid, SIGKILL);
+		while (waitpid(ps->ps_pid, NULL, 0) < 0 && errno == EINTR)
+			continue;
+	}
+	free(ps);
+}
+
+
+/*!
+ * pperl_zygote_closeall() - Close the parent's sockets in a new child.
+ *
+ *	A child holding another child's socket open would keep that child
+ *	from seeing EOF when the parent closes its end, so each child drops
+ *	them straight after fork(2).
+ *
+ *	@param	busy		Additional socket to close; -1 if none.
+ */
+void
+pperl_zygote_closeall(perlzygote_t pz, int busy)
+{
+	struct pperl_spare *ps;
+
+	TAILQ_FOREACH(ps, &pz->pz_spares, ps_link)
+		close(ps->ps_sock);
+	if (busy >= 0)
+		close(busy);
+}
+
+
+/*!
+ * pperl_zygote_spare_main() - Body of a spare child.
+ *
+ *	Waits for a single request from the parent, runs it, and exits.
+ */
+void
+pperl_zygote_spare_main(perlinterp_t interp, int sock)
+{
+	struct zygote_request zr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	perlargs_t pargs;
+	perlenv_t penv;
+	char *buf;
+	int cmsgbuf[CMSG_SPACE(3 * sizeof(int)) / sizeof(int) + 1];
+	int fds[3];
+	int nfds, i;
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &zr;
+	iov.iov_len = sizeof(zr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+
+	do {
+		len = recvmsg(sock, &msg, MSG_WAITALL);
+	} while (len < 0 && errno == EINTR);
+
+	/* EOF means the parent doesn't need us anymore. */
+	if (len != (ssize_t)sizeof(zr))
+		_exit(0);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	nfds = 0;
+	for (i = 0; i < 3; i++) {
+		fds[i] = -1;
+		if ((zr.zr_fdmask & (1 << i)) != 0 && cmsg != NULL &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fds[i], (int *)CMSG_DATA(cmsg) + nfds++,
+			       sizeof(int));
+	}
+
+	buf = pperl_malloc(zr.zr_len + 1);
+	if (!readall(sock, buf, zr.zr_len) ||
+	    !pperl_zygote_decode(interp, &zr, buf, &pargs, &penv))
+		_exit(EX_PROTOCOL);
+	free(buf);
+
+	pperl_zygote_child(zr.zr_pc, pargs, penv, fds, sock);
+}
+
+
+/*!
+ * pperl_zygote_child() - Run a request in a child and report the result.
+ */
+void
+pperl_zygote_child(perlcode_t pc, perlargs_t pargs, perlenv_t penv,
+		   const int fds[3], int sock)
+{
+	struct perlresult result;
+	struct zygote_reply zp;
+
+	/*
+	 * Cancelling from another thread isn't possible here; neither is
+	 * running the parent's END blocks, hence _exit() below.
+	 */
+	if (fds != NULL)
+		pperl_zygote_stdio(pc->pc_interp, fds);
+
+	/* The child is single-threaded, so subprocesses can see %ENV. */
+	pperl_env_export(penv);
+
+	pperl_run(pc, pargs, penv, &result);
+
+	zp.zp_status = result.pperl_status;
+	zp.zp_errno = result.pperl_errno;
+	zp.zp_msglen = result.pperl_errmsg != NULL ?
+		       strlen(result.pperl_errmsg) : 0;
+
+	if (writeall(sock, &zp, sizeof(zp)) && zp.zp_msglen > 0)
+		writeall(sock, result.pperl_errmsg, zp.zp_msglen);
+
+	_exit(0);
+}
+
+
+/*!
+ * pperl_zygote_stdio() - Connect a child's standard handles to the given
+ *			  descriptors.
+ *
+ *	I/O overrides inherited from the parent would act on the parent's
+ *	state (e.g. write to a connection the parent owns), so their
+ *	callbacks are detached before the handles are reopened.
+ */
+void
+pperl_zygote_stdio(perlinterp_t interp, const int fds[3])
+{
+	static const char *const reopen[3] = {
+		"open(STDIN, '<&=0');",
+		"open(STDOUT, '>&=1');",
+		"open(STDERR, '>&=2');",
+	};
+	int i;
+	dTHXa(interp->pi_perl);
+
+	pperl_io_detach(interp);
+
+	for (i = 0; i < 3; i++) {
+		if (fds[i] < 0)
+			continue;
+		if (fds[i] != i) {
+			dup2(fds[i], i);
+			close(fds[i]);
+		}
+		eval_pv(reopen[i], FALSE);
+	}
+}
+
+
+/*!
+ * pperl_zygote_wait() - Collect the result of a request from a child.
+ */
+void
+pperl_zygote_wait(perlzygote_t pz, pid_t pid, int sock,
+		  struct perlresult *result)
+{
+	struct zygote_reply zp;
+	int status;
+
+	free(pz->pz_errmsg);
+	pz->pz_errmsg = NULL;
+
+	if (readall(sock, &zp, sizeof(zp))) {
+		result->pperl_status = zp.zp_status;
+		result->pperl_errno = zp.zp_errno;
+		if (zp.zp_msglen > 0) {
+			pz->pz_errmsg = pperl_malloc(zp.zp_msglen + 1);
+			if (!readall(sock, pz->pz_errmsg, zp.zp_msglen))
+				zp.zp_msglen = 0;
+			pz->pz_errmsg[zp.zp_msglen] = '\0';
+			result->pperl_errmsg = pz->pz_errmsg;
+		}
+	}
+	else
+		zp.zp_msglen = (size_t)-1;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			status = 0;
+			break;
+		}
+	}
+
+	/* The child died before it could report back. */
+	if (zp.zp_msglen == (size_t)-1) {
+		pperl_log(LOG_ERR, "child %d exited without a result "
+			  "(status %#x)", (int)pid, status);
+		pz->pz_stats.pzs_crashes++;
+		result->pperl_status = status;
+		result->pperl_errno = ECHILD;
+		result->pperl_errmsg = "child exited without a result";
+	}
+}
+
+
+/*!
+ * pperl_zygote_encode() - Serialize a request for a spare child.
+ */
+void
+pperl_zygote_encode(struct sbuf *sb, perlcode_t pc, perlargs_t pargs,
+		    perlenv_t penv, int fdmask)
+{
+	struct zygote_request zr;
+	const char *pos;
+	HE *entry;
+	char *key;
+	const char *val;
+	STRLEN keylen, vallen;
+	int i;
+	dTHXa(pc->pc_interp->pi_perl);
+
+	memset(&zr, 0, sizeof(zr));
+	zr.zr_pc = pc;
+	zr.zr_fdmask = fdmask;
+	sbuf_bcat(sb, &zr, sizeof(zr));
+
+	if (pargs != NULL) {
+		zr.zr_args_tainted = pargs->pa_tainted;
+		pos = pargs->pa_strbuf;
+		for (i = 0; i < pargs->pa_argc; i++) {
+			pperl_zygote_putstr(sb, pos, pargs->pa_arglenv[i]);
+			pos += pargs->pa_arglenv[i];
+			zr.zr_argc++;
+		}
+	}
+
+	if (penv != NULL) {
+		zr.zr_env_tainted = penv->pe_tainted;
+		hv_iterinit(penv->pe_envhash);
+		while ((entry = hv_iternext(penv->pe_envhash)) != NULL) {
+			key = HePV(entry, keylen);
+			val = SvPV(HeVAL(entry), vallen);
+			pperl_zygote_putstr(sb, key, keylen);
+			pperl_zygote_putstr(sb, val, vallen);
+			zr.zr_envc++;
+		}
+	}
+
+	/* Now that the counts are known, rewrite the header. */
+	zr.zr_len = sbuf_len(sb) - sizeof(zr);
+	memcpy(sbuf_data(sb), &zr, sizeof(zr));
+}
+
+
+/*!
+ * pperl_zygote_decode() - Rebuild a request's arguments and environment in
+ *			   a spare child.
+ */
+bool
+pperl_zygote_decode(perlinterp_t interp, const struct zygote_request *zr,
+		    const char *buf, perlargs_t *pargsp, perlenv_t *penvp)
+{
+	const char *pos = buf;
+	const char *end = buf + zr->zr_len;
+	char *str[2];
+	size_t len;
+	int i, j;
+
+	*pargsp = pperl_args_new(interp, zr->zr_args_tainted, 0, NULL);
+	*penvp = pperl_env_new(interp, zr->zr_env_tainted, 0, NULL);
+
+	for (i = 0; i < zr->zr_argc + zr->zr_envc; i++) {
+		for (j = 0; j < (i < zr->zr_argc ? 1 : 2); j++) {
+			if (end - pos < (ssize_t)sizeof(len))
+				return false;
+			memcpy(&len, pos, sizeof(len));
+			pos += sizeof(len);
+			if ((size_t)(end - pos) < len)
+				return false;
+			str[j] = pperl_malloc(len + 1);
+			memcpy(str[j], pos, len);
+			str[j][len] = '\0';
+			pos += len;
+		}
+
+		if (i < zr->zr_argc) {
+			pperl_args_append(*pargsp, str[0]);
+			free(str[0]);
+		}
+		else {
+			pperl_env_set(*penvp, str[0], str[1]);
+			free(str[0]);
+			free(str[1]);
+		}
+	}
+
+	return true;
+}
+
+
+/*!
+ * pperl_zygote_putstr() - Append a length-prefixed string to a request.
+ */
+void
+pperl_zygote_putstr(struct sbuf *sb, const char *str, size_t len)
+{
+
+	sbuf_bcat(sb, &len, sizeof(len));
+	sbuf_bcat(sb, str, len);
+}
+
+
+/*
+ * readall(), writeall() - read(2)/send(2) exactly the given number of
+ *			   bytes, retrying after interruptions.  A peer
+ *			   which has gone away is reported as EPIPE rather
+ *			   than raising SIGPIPE.
+ */
+bool
+readall(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+
+	return true;
+}
+
+bool
+writeall(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+
+	return true;
+}
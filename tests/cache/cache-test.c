@@ -0,0 +1,86 @@
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+static const char code[] =
+	"our $count++;\n"
+	"print \"run $count: @ARGV for $ENV{LANG}\\n\";\n";
+
+static const char fail[] =
+	"die \"failed\\n\";\n";
+
+static void
+run(perlcache_t cache, perlcode_t pc, perlargs_t pargs, perlenv_t penv)
+{
+	struct pperl_output out = { NULL, 0, 0 };
+	struct perlresult result;
+
+	pperl_cache_run(cache, pc, pargs, penv, &out, &result);
+	printf("%.*s", (int)out.po_len, out.po_buf);
+	printf("status %d, error %s", result.pperl_status,
+	       result.pperl_errmsg != NULL ? result.pperl_errmsg : "none\n");
+	free(out.po_buf);
+}
+
+int
+main(void)
+{
+	static const char *argv[] = { "a" };
+	static const char *en[] = { "LANG=en", "TZ=UTC" };
+	static const char *en_tz[] = { "LANG=en", "TZ=JST" };
+	static const char *fr[] = { "LANG=fr", "TZ=UTC" };
+	struct pperl_cache_stats stats;
+	struct perlresult result;
+	perlinterp_t interp;
+	perlcache_t cache;
+	perlargs_t pargs;
+	perlenv_t penv;
+	perlcode_t pc, pc_fail;
+
+	interp = pperl_new("cache-test", DEFAULT);
+	pargs = pperl_args_new(interp, false, 1, argv);
+	penv = pperl_env_new(interp, false, 2, en);
+	pc = pperl_load(interp, "code", penv, code, strlen(code), &result);
+	pc_fail = pperl_load(interp, "fail", penv, fail, strlen(fail),
+			     &result);
+
+	cache = pperl_cache_new(65536, 60000);
+	pperl_cache_env(cache, "LANG");
+
+	/* The second run is served from the cache. */
+	run(cache, pc, pargs, penv);
+	run(cache, pc, pargs, penv);
+
+	/* Variables which aren't part of the key don't matter... */
+	pperl_env_destroy(&penv);
+	penv = pperl_env_new(interp, false, 2, en_tz);
+	run(cache, pc, pargs, penv);
+
+	/* ...but those which are do. */
+	pperl_env_destroy(&penv);
+	penv = pperl_env_new(interp, false, 2, fr);
+	run(cache, pc, pargs, penv);
+
+	/* Failed runs aren't cached. */
+	run(cache, pc_fail, pargs, penv);
+	run(cache, pc_fail, pargs, penv);
+
+	/* Nor is anything once the cache is purged. */
+	pperl_cache_purge(cache);
+	run(cache, pc, pargs, penv);
+
+	pperl_cache_stats(cache, &stats);
+	printf("hits %u, misses %u\n", (u_int)stats.pcs_hits,
+	       (u_int)stats.pcs_misses);
+
+	pperl_cache_free(&cache);
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}
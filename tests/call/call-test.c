@@ -0,0 +1,94 @@
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+static const char code[] =
+	"our $base = 100;\n"
+	"sub add { return $base + $_[0] + $_[1]; }\n"
+	"sub greet { return \"hello, $_[0]\"; }\n"
+	"sub several { return (7, 2.5, 'x', undef); }\n"
+	"sub fail { die \"failed\\n\"; }\n";
+
+static void
+print_value(const struct pperl_value *val)
+{
+
+	switch (val->pv_type) {
+	case PPERL_UNDEF:
+		printf("undef");
+		break;
+	case PPERL_INT:
+		printf("int %lld", (long long)val->pv_int);
+		break;
+	case PPERL_DOUBLE:
+		printf("double %g", val->pv_double);
+		break;
+	case PPERL_STRING:
+		printf("string \"%.*s\"", (int)val->pv_len, val->pv_str);
+		break;
+	}
+}
+
+int
+main(void)
+{
+	struct perlresult result;
+	struct pperl_value argv[2], retv[3];
+	perlinterp_t interp;
+	perlenv_t penv;
+	perlcode_t pc;
+	int count, i;
+
+	interp = pperl_new("call-test", DEFAULT);
+	penv = pperl_env_new(interp, false, 0, NULL);
+	pc = pperl_load(interp, "rules", penv, code, strlen(code), &result);
+
+	argv[0].pv_type = PPERL_INT;
+	argv[0].pv_int = 1;
+	argv[1].pv_type = PPERL_INT;
+	argv[1].pv_int = 2;
+	pperl_call(pc, "add", argv, 2, retv, 1, &result);
+	printf("add(1, 2) = ");
+	print_value(&retv[0]);
+	printf("\n");
+
+	argv[1].pv_type = PPERL_DOUBLE;
+	argv[1].pv_double = 2.5;
+	pperl_call(pc, "add", argv, 2, retv, 1, &result);
+	printf("add(1, 2.5) = ");
+	print_value(&retv[0]);
+	printf("\n");
+
+	/* Strings are passed by length; they needn't be nul-terminated. */
+	argv[0].pv_type = PPERL_STRING;
+	argv[0].pv_str = "world!!!";
+	argv[0].pv_len = 5;
+	pperl_call(pc, "greet", argv, 1, retv, 1, &result);
+	printf("greet(\"world\") = ");
+	print_value(&retv[0]);
+	printf("\n");
+
+	/* Values beyond the end of the result vector are counted only. */
+	count = pperl_call(pc, "several", NULL, 0, retv, 3, &result);
+	printf("several() returned %d:", count);
+	for (i = 0; i < count && i < 3; i++) {
+		printf(" ");
+		print_value(&retv[i]);
+	}
+	printf("\n");
+
+	count = pperl_call(pc, "fail", NULL, 0, retv, 3, &result);
+	printf("fail() returned %d: %s", count, result.pperl_errmsg);
+
+	count = pperl_call(pc, "nosuch", NULL, 0, retv, 3, &result);
+	printf("nosuch() returned %d: %s\n", count, result.pperl_errmsg);
+
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}
@@ -0,0 +1,71 @@
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+static const char code[] =
+	"print \"out: $ARGV[0]\\n\";\n"
+	"warn \"err: $ARGV[0]\\n\";\n"
+	"print 'x' x 1000, \"\\n\" if $ARGV[0] eq 'big';\n";
+
+static void
+run(perlcode_t pc, perlargs_t pargs, const char *arg,
+    struct pperl_output *out, struct pperl_output *err)
+{
+	struct perlresult result;
+
+	pperl_args_reset(pargs);
+	pperl_args_append(pargs, arg);
+	pperl_run_capture(pc, pargs, NULL, out, err, &result);
+	printf("%s: status %d, %zu bytes out, %zu bytes err\n",
+	       arg, result.pperl_status, out->po_len,
+	       err != NULL ? err->po_len : 0);
+}
+
+int
+main(void)
+{
+	struct pperl_output out, err, fresh;
+	struct perlresult result;
+	perlinterp_t interp;
+	perlargs_t pargs;
+	perlenv_t penv;
+	perlcode_t pc;
+
+	interp = pperl_new("capture-test", DEFAULT);
+	pargs = pperl_args_new(interp, false, 0, NULL);
+	penv = pperl_env_new(interp, false, 0, NULL);
+	pc = pperl_load(interp, "capture", penv, code, strlen(code), &result);
+
+	memset(&out, 0, sizeof(out));
+	memset(&err, 0, sizeof(err));
+
+	run(pc, pargs, "one", &out, &err);
+	printf("[%.*s] [%.*s]\n", (int)out.po_len, out.po_buf,
+	       (int)err.po_len, err.po_buf);
+
+	/* Each run replaces the previous output. */
+	run(pc, pargs, "two", &out, &err);
+	printf("[%.*s] [%.*s]\n", (int)out.po_len, out.po_buf,
+	       (int)err.po_len, err.po_buf);
+
+	run(pc, pargs, "big", &out, NULL);
+
+	/* A new buffer is presized from the previous run's output. */
+	memset(&fresh, 0, sizeof(fresh));
+	run(pc, pargs, "big", &fresh, NULL);
+	printf("presized: %s\n", fresh.po_size >= 1010 ? "yes" : "no");
+
+	free(out.po_buf);
+	free(err.po_buf);
+	free(fresh.po_buf);
+
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}
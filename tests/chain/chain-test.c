@@ -0,0 +1,77 @@
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+static const char auth[] =
+	"exit(1) unless $ENV{USER} eq 'alice';\n"
+	"print \"user=$ENV{USER}\\n\";\n";
+
+static const char upper[] =
+	"while (<STDIN>) { print uc; }\n"
+	"print \"ARGS=@ARGV\\n\";\n";
+
+static const char render[] =
+	"my @lines = <STDIN>;\n"
+	"print scalar(@lines), \" lines:\\n\", map { \"  $_\" } @lines;\n";
+
+static const char fail[] =
+	"die \"failed\\n\";\n";
+
+static void
+run(perlcode_t *pcv, int npc, perlargs_t pargs, perlenv_t penv)
+{
+	struct perlresult result;
+
+	pperl_run_chain(pcv, npc, pargs, penv, &result);
+	fflush(stdout);
+	printf("status %d, error %s", result.pperl_status,
+	       result.pperl_errmsg != NULL ? result.pperl_errmsg : "none\n");
+}
+
+int
+main(void)
+{
+	static const char *argv[] = { "a", "b" };
+	static const char *alice[] = { "USER=alice" };
+	static const char *bob[] = { "USER=bob" };
+	struct perlresult result;
+	perlinterp_t interp;
+	perlargs_t pargs;
+	perlenv_t penv;
+	perlcode_t pcv[3];
+
+	interp = pperl_new("chain-test", DEFAULT);
+	pargs = pperl_args_new(interp, false, 2, argv);
+	penv = pperl_env_new(interp, false, 1, alice);
+
+	pcv[0] = pperl_load(interp, "auth", penv, auth, strlen(auth),
+			    &result);
+	pcv[1] = pperl_load(interp, "upper", penv, upper, strlen(upper),
+			    &result);
+	pcv[2] = pperl_load(interp, "render", penv, render, strlen(render),
+			    &result);
+
+	run(pcv, 3, pargs, penv);
+
+	/* A stage exiting with a non-zero status stops the chain. */
+	pperl_env_destroy(&penv);
+	penv = pperl_env_new(interp, false, 1, bob);
+	run(pcv, 3, pargs, penv);
+
+	/* So does one which dies. */
+	pcv[1] = pperl_load(interp, "fail", penv, fail, strlen(fail),
+			    &result);
+	pperl_env_destroy(&penv);
+	penv = pperl_env_new(interp, false, 1, alice);
+	run(pcv, 3, pargs, penv);
+
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}
@@ -0,0 +1,78 @@
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+#define	NJOBS	8
+
+static const char code[] =
+	"exit($ARGV[0] + $ENV{ADD});\n";
+
+static bool
+worker_init(perlinterp_t interp, int worker, intptr_t data)
+{
+	struct perlresult result;
+	perlenv_t penv;
+	perlcode_t pc;
+
+	(void)worker;
+	(void)data;
+
+	penv = pperl_env_new(interp, false, 0, NULL);
+	pc = pperl_load(interp, "double", penv, code, strlen(code), &result);
+	pperl_env_destroy(&penv);
+
+	return (pc != NULL);
+}
+
+int
+main(void)
+{
+	struct perlresult result;
+	perlexecutor_t pex;
+	perljob_t jobs[NJOBS], job;
+	char arg[16];
+	int error, i;
+
+	pex = pperl_executor_new("executor-test", DEFAULT, 2, 16,
+				 worker_init, 0);
+	if (pex == NULL) {
+		printf("failed to create executor\n");
+		exit(1);
+	}
+
+	for (i = 0; i < NJOBS; i++) {
+		jobs[i] = pperl_job_new("double");
+		snprintf(arg, sizeof(arg), "%d", i);
+		pperl_job_arg(jobs[i], arg);
+		pperl_job_env(jobs[i], "ADD", arg);
+		error = pperl_executor_submit(pex, jobs[i], NULL, 0);
+		if (error != 0)
+			printf("job %d: submit failed: %s\n", i,
+			       strerror(error));
+	}
+
+	for (i = 0; i < NJOBS; i++) {
+		pperl_job_wait(jobs[i], &result);
+		printf("job %d: status %d\n", i, result.pperl_status);
+		pperl_job_free(&jobs[i]);
+	}
+
+	/* Jobs for code no worker has loaded fail; so do resubmissions. */
+	job = pperl_job_new("nosuch");
+	for (i = 0; i < 2; i++) {
+		pperl_executor_submit(pex, job, NULL, 0);
+		pperl_job_wait(job, &result);
+		printf("nosuch: %s\n", result.pperl_errmsg != NULL ?
+		       result.pperl_errmsg : "no error");
+	}
+	pperl_job_free(&job);
+
+	pperl_executor_destroy(&pex);
+	printf("destroyed\n");
+
+	exit(0);
+}
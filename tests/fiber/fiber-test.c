@@ -0,0 +1,103 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+static const char code[] =
+	"while (my $line = <STDIN>) { print \"got $line\"; }\n"
+	"print \"eof\\n\";\n";
+
+static const char *const input[] = { "one\n", "two\n", NULL };
+
+struct reader {
+	int		 line;
+	size_t		 off;
+	bool		 ready;
+};
+
+/*
+ * Delivers the input a line at a time, reporting that it would block
+ * (which parks the fiber) before each line.
+ */
+static size_t
+read_input(char *buf, size_t buflen, intptr_t data)
+{
+	struct reader *rd = (struct reader *)data;
+	const char *line = input[rd->line];
+	size_t len;
+
+	if (line == NULL)
+		return (0);
+	if (!rd->ready) {
+		rd->ready = true;
+		return (PPERL_IO_WOULDBLOCK);
+	}
+
+	len = strlen(line) - rd->off;
+	if (len > buflen)
+		len = buflen;
+	memcpy(buf, line + rd->off, len);
+	rd->off += len;
+	if (line[rd->off] == '\0') {
+		rd->line++;
+		rd->off = 0;
+		rd->ready = false;
+	}
+	return (len);
+}
+
+int
+main(void)
+{
+	struct perlresult result;
+	enum pperl_fiber_state state;
+	perlinterp_t interp;
+	perlfiber_t fiber;
+	perlargs_t pargs;
+	perlenv_t penv;
+	perlcode_t pc;
+	struct reader rd = { 0, 0, false };
+
+	interp = pperl_new("fiber-test", DEFAULT);
+	pargs = pperl_args_new(interp, false, 0, NULL);
+	penv = pperl_env_new(interp, false, 0, NULL);
+	pc = pperl_load(interp, "fiber", penv, code, strlen(code), &result);
+
+	pperl_io_override(interp, "STDIN", read_input, NULL, NULL,
+			  (intptr_t)&rd);
+
+	fiber = pperl_fiber_new(pc, pargs, penv, 0);
+
+	/* Code not run by the fiber can't park; the read fails instead. */
+	fflush(stdout);
+	pperl_run(pc, pargs, penv, &result);
+	printf("unparked run: status %d\n", result.pperl_status);
+	rd.ready = false;
+
+	do {
+		fflush(stdout);
+		state = pperl_fiber_resume(fiber, &result);
+		printf("%s\n", state == PPERL_FIBER_BLOCKED ? "blocked" :
+		       "done");
+
+		/* Nothing else may run while the fiber is parked. */
+		if (state == PPERL_FIBER_BLOCKED) {
+			pperl_run(pc, pargs, penv, &result);
+			printf("run while parked: %s\n",
+			       result.pperl_errno == EBUSY ? "busy" : "ran");
+		}
+	} while (state == PPERL_FIBER_BLOCKED);
+	printf("status %d, error %s\n", result.pperl_status,
+	       result.pperl_errmsg != NULL ? result.pperl_errmsg : "none");
+	pperl_fiber_destroy(&fiber);
+
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}
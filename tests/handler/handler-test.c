@@ -0,0 +1,52 @@
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+/* Handler state lives in "our" variables; see pperl_run_handler(). */
+static const char code[] =
+	"our $greeting = 'hello';\n"
+	"our $count = 0;\n"
+	"print \"setup\\n\";\n"
+	"sub handle { $count++; print \"$greeting $count: @ARGV\\n\"; }\n";
+
+static void
+run(perlcode_t pc, perlargs_t pargs, perlenv_t penv)
+{
+	struct perlresult result;
+
+	fflush(stdout);
+	pperl_run_handler(pc, "handle", pargs, penv, &result);
+	printf("status %d, error %s", result.pperl_status,
+	       result.pperl_errmsg != NULL ? result.pperl_errmsg : "none\n");
+}
+
+int
+main(void)
+{
+	static const char *argv[] = { "a", "b" };
+	struct perlresult result;
+	perlinterp_t interp;
+	perlargs_t pargs;
+	perlenv_t penv;
+	perlcode_t pc;
+
+	interp = pperl_new("handler-test", DEFAULT);
+	pargs = pperl_args_new(interp, false, 2, argv);
+	penv = pperl_env_new(interp, false, 0, NULL);
+	pc = pperl_load(interp, "handler", penv, code, strlen(code),
+			&result);
+
+	/* The body only runs before the first call. */
+	run(pc, pargs, penv);
+	run(pc, pargs, penv);
+
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}
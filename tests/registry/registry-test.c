@@ -0,0 +1,78 @@
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+static const char *names[] = { "root", "cgi", "cgi-foo", "static", "gone" };
+#define	NUMNAMES	(sizeof(names) / sizeof(names[0]))
+
+static const char *paths[] = {
+	"/",
+	"/index.html",
+	"/cgi-bin/",
+	"/cgi-bin/bar.pl",
+	"/cgi-bin/foo.pl",
+	"/cgi-bin/foo.plx",
+	"/static/logo.png",
+	"/old/page.html",
+	"",
+};
+#define	NUMPATHS	(sizeof(paths) / sizeof(paths[0]))
+
+int
+main(void)
+{
+	struct perlresult result;
+	perlinterp_t interp;
+	perlenv_t penv;
+	perlargs_t pargs;
+	perlcode_t pc, nomatch;
+	char code[128];
+	u_int i;
+
+	interp = pperl_new("registry-test", DEFAULT);
+	penv = pperl_env_new(interp, false, 0, NULL);
+
+	/* Each script just prints its name and the path it was given. */
+	for (i = 0; i < NUMNAMES; i++) {
+		snprintf(code, sizeof(code),
+			 "print \"%s: $ARGV[0]\\n\";", names[i]);
+		pperl_load(interp, names[i], penv, code, strlen(code), &result);
+	}
+	strcpy(code, "print \"no route: $ARGV[0]\\n\";");
+	nomatch = pperl_load(interp, "nomatch", penv, code, strlen(code),
+			     &result);
+
+	pperl_route_add(interp, "/", pperl_code_find(interp, "root"));
+	pperl_route_add(interp, "/cgi-bin/", pperl_code_find(interp, "cgi"));
+	pperl_route_add(interp, "/cgi-bin/foo.pl",
+			pperl_code_find(interp, "cgi-foo"));
+	pperl_route_add(interp, "/static/", pperl_code_find(interp, "static"));
+	pperl_route_add(interp, "/old/", pperl_code_find(interp, "gone"));
+
+	/* Unloading code must remove any routes to it. */
+	pc = pperl_code_find(interp, "gone");
+	pperl_unload(&pc);
+
+	/* Removing a route makes the next shortest prefix match instead. */
+	pperl_route_add(interp, "/", NULL);
+
+	for (i = 0; i < NUMPATHS; i++) {
+		pc = pperl_route_lookup(interp, paths[i]);
+		if (pc == NULL)
+			pc = nomatch;
+
+		pargs = pperl_args_new(interp, false, 0, NULL);
+		pperl_args_append(pargs, paths[i]);
+		pperl_run(pc, pargs, penv, &result);
+		pperl_args_destroy(&pargs);
+	}
+
+	pperl_destroy(&interp);
+
+	exit(0);
+}
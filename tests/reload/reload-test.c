@@ -0,0 +1,74 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+/* Code which inlines a constant from a module loaded before it was. */
+static const char code[] =
+	"use ReloadTest;\n"
+	"print \"tag \", TAG, \"\\n\";\n";
+
+/*
+ * Writes the module with the given tag, giving each version a distinct
+ * modification time so the change is noticed within the same second.
+ */
+static void
+write_module(const char *tag, time_t mtime)
+{
+	struct timeval tv[2];
+	FILE *fp;
+
+	fp = fopen("ReloadTest.pm", "w");
+	fprintf(fp, "package ReloadTest;\n"
+		    "use base 'Exporter';\n"
+		    "our @EXPORT = ('TAG');\n"
+		    "use constant TAG => '%s';\n"
+		    "1;\n", tag);
+	fclose(fp);
+
+	tv[0].tv_sec = tv[1].tv_sec = mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	utimes("ReloadTest.pm", tv);
+}
+
+int
+main(void)
+{
+	struct perlresult result;
+	perlinterp_t interp;
+	perlargs_t pargs;
+	perlenv_t penv;
+	perlcode_t pc;
+
+	write_module("one", 1000000000);
+
+	interp = pperl_new("reload-test", DEFAULT);
+	pperl_incpath_add(interp, ".");
+	pargs = pperl_args_new(interp, false, 0, NULL);
+	penv = pperl_env_new(interp, false, 0, NULL);
+
+	pperl_module_reload(interp, 0);
+	pperl_load_module(interp, "ReloadTest", penv, &result);
+	pc = pperl_load(interp, "reload", penv, code, strlen(code), &result);
+
+	fflush(stdout);
+	pperl_run(pc, pargs, penv, &result);
+
+	/* The code is recompiled against the new version before it runs. */
+	write_module("two", 1000000100);
+	fflush(stdout);
+	pperl_run(pc, pargs, penv, &result);
+	printf("status %d, error %s, stale %d\n", result.pperl_status,
+	       result.pperl_errmsg != NULL ? result.pperl_errmsg : "none",
+	       pperl_code_stale(pc));
+
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}
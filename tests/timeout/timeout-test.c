@@ -0,0 +1,70 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+static const char spin[] =
+	"1 while 1;\n";
+
+static const char trapped[] =
+	"eval { 1 while 1; };\n"
+	"print \"escaped\\n\";\n";
+
+static const char quick[] =
+	"print \"quick\\n\";\n";
+
+static void
+run(const char *name, perlcode_t pc, perlargs_t pargs, perlenv_t penv)
+{
+	struct perlresult result;
+
+	fflush(stdout);
+	pperl_run(pc, pargs, penv, &result);
+	printf("%s: errno %s\n", name,
+	       result.pperl_errno == 0 ? "none" :
+	       result.pperl_errno == ETIMEDOUT ? "ETIMEDOUT" :
+	       strerror(result.pperl_errno));
+}
+
+int
+main(void)
+{
+	struct perlresult result;
+	perlinterp_t interp;
+	perlargs_t pargs;
+	perlenv_t penv;
+	perlcode_t pc_spin, pc_trapped, pc_quick;
+
+	interp = pperl_new("timeout-test", DEFAULT);
+	pargs = pperl_args_new(interp, false, 0, NULL);
+	penv = pperl_env_new(interp, false, 0, NULL);
+
+	pc_spin = pperl_load(interp, "spin", penv, spin, strlen(spin),
+			     &result);
+	pc_trapped = pperl_load(interp, "trapped", penv, trapped,
+				strlen(trapped), &result);
+	pc_quick = pperl_load(interp, "quick", penv, quick, strlen(quick),
+			      &result);
+
+	pperl_run_timeout(interp, 100);
+	run("spin", pc_spin, pargs, penv);
+
+	/* An eval block in the code can't swallow the interruption. */
+	run("trapped", pc_trapped, pargs, penv);
+
+	/* Nor does the interruption leak into the next run. */
+	run("quick", pc_quick, pargs, penv);
+
+	pperl_run_timeout(interp, 0);
+	run("quick", pc_quick, pargs, penv);
+
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}
@@ -0,0 +1,50 @@
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pperl.h>
+
+static const char code[] =
+	"print \"child: @ARGV\\n\";\n";
+
+int
+main(void)
+{
+	static const char *argv[] = { "a", "b" };
+	struct pperl_zygote_stats stats;
+	struct perlresult result;
+	perlinterp_t interp;
+	perlzygote_t pz;
+	perlargs_t pargs;
+	perlenv_t penv;
+	perlcode_t pc;
+
+	interp = pperl_new("zygote-test", DEFAULT);
+	pargs = pperl_args_new(interp, false, 2, argv);
+	penv = pperl_env_new(interp, false, 0, NULL);
+	pc = pperl_load(interp, "child", penv, code, strlen(code), &result);
+
+	pz = pperl_zygote_new(interp, 3);
+
+	fflush(stdout);
+	pperl_zygote_run(pz, pc, pargs, penv, NULL, &result);
+	printf("status %d, error %s\n", result.pperl_status,
+	       result.pperl_errmsg != NULL ? result.pperl_errmsg : "none");
+
+	pperl_zygote_stats(pz, &stats);
+	printf("runs %u, spare hits %u, spares %u\n",
+	       (u_int)stats.pzs_runs, (u_int)stats.pzs_spare_hits,
+	       stats.pzs_spares);
+
+	/* Must reap every spare without hanging. */
+	pperl_zygote_destroy(&pz);
+	printf("destroyed\n");
+
+	pperl_args_destroy(&pargs);
+	pperl_env_destroy(&penv);
+	pperl_destroy(&interp);
+
+	exit(0);
+}